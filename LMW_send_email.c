@@ -19,6 +19,15 @@
  */
 
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // clone(2) and other Linux extensions
+#endif
+// when this file is included in another, that already included a system header,
+// it is too late for the define above
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "define _GNU_SOURCE before including any system header, see \"Direct inclusion\" in README.md"
+#endif
+
 #ifndef LMW_SKIP_HEADERS
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -32,11 +41,40 @@
 #include <errno.h>
 #include <unistd.h>  // getpid(2)
 #include <limits.h>  // PATH_MAX
+#include <stdint.h>  // SIZE_MAX
 #include <fcntl.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>  // writev(2)
+#include <stdatomic.h>
+#include <sysexits.h>  // refusals that do not count for cfg->breaker
+#ifdef __linux__
+#include <sys/syscall.h> // pidfd_open(2)
+#include <sched.h>    // clone(2)
+#include <sys/mman.h>
+#include <sys/epoll.h>   // LMW_send_email_async()
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
 #endif  //LMW_SKIP_HEADERS
 
+#ifdef LMW_IO_URING
+#ifdef __linux__
+#include <linux/io_uring.h>
+#else
+#undef LMW_IO_URING   // io_uring(7) is Linux only
+#endif
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>  // LMW_text_scan()
+#define LMW_SCAN_X86
+#endif
+
 #include "LMW_send_email.h"
 
 // Default logging function
@@ -51,6 +89,9 @@ static void __LMW__default_log_error(const char *msg, ...) {
 // of type  "LMW_config *cfg"
 #define LMW_log_error( msg, ...) \
   { if (cfg && cfg->log_error ) cfg->log_error(msg, ##__VA_ARGS__);}
+// the config may be shared by threads
+#define LMW_count_failure() \
+  { if (cfg) __atomic_fetch_add(&cfg->failures, 1, __ATOMIC_RELAXED);}
 
 
 void LMW_config_init(LMW_config *cfg)
@@ -60,6 +101,19 @@ void LMW_config_init(LMW_config *cfg)
     .max_wait = LMW_MAX_WAIT,
     .failures = 0,
     .log_error = __LMW__default_log_error,
+    .spawn = LMW_SPAWN,
+    .capture_max = LMW_CAPTURE_MAX,
+    .capture_to_disk = 0,
+    .backend = NULL,
+    .smtp_relay = LMW_SMTP_RELAY,
+    .smtp_from = NULL,
+    .batch_parallel = LMW_BATCH_PARALLEL,
+    .stats = NULL,
+    .ratelimit = NULL,
+    .breaker = NULL,
+    .mailer_cache = NULL,
+    .encode_subject = 0,
+    .timeout = NULL,
   };
 };
 
@@ -70,6 +124,475 @@ static int __LMW__make_nonblocking(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+/* a pipe closed on exec, so that mailers started by other threads do not keep it open */
+static int __LMW__pipe_cloexec(int fd[2]) {
+#ifdef __linux__
+    return pipe2(fd, O_CLOEXEC);
+#else
+    if (pipe(fd) == -1) return -1;
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/*
+  Writing to a pipe whose mailer exited raises SIGPIPE. Instead of
+  changing the handler, that is shared by all threads, SIGPIPE is
+  blocked in the calling thread only, and the SIGPIPE raised meanwhile
+  is discarded before unblocking it; the write fails with EPIPE anyway.
+  Mailers started meanwhile must not inherit the blocked SIGPIPE.
+*/
+static _Thread_local int __LMW_sigpipe_blocked;
+
+typedef struct {
+  sigset_t old;
+  int pending;   // a SIGPIPE was pending already, it is not ours
+} __LMW_sigpipe;
+
+static void __LMW__sigpipe_block(__LMW_sigpipe *sp)
+{
+  sigset_t set, pending;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, &sp->old);
+  sigpending(&pending);
+  sp->pending = sigismember(&pending, SIGPIPE);
+  __LMW_sigpipe_blocked = !sigismember(&sp->old, SIGPIPE);
+}
+
+static void __LMW__sigpipe_unblock(__LMW_sigpipe *sp)
+{
+  int saved_errno = errno;
+  if (!sp->pending) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&set, NULL, &zero) == -1 && errno == EINTR)
+      ;
+  }
+  __LMW_sigpipe_blocked = 0;
+  pthread_sigmask(SIG_SETMASK, &sp->old, NULL);
+  errno = saved_errno;
+}
+
+/* the signal mask for a child of this thread */
+static void __LMW__child_sigmask(sigset_t *mask)
+{
+  pthread_sigmask(SIG_BLOCK, NULL, mask);
+  if (__LMW_sigpipe_blocked)
+    sigdelset(mask, SIGPIPE);
+}
+
+static long long __LMW__now_ns(void);
+
+/* ========== MAILER CACHE ========== */
+
+/*
+  The mailer is looked up in PATH, its symlinks resolved, and opened
+  once; then the children exec the open file with execveat(2), or the
+  resolved path where that is not possible (scripts, whose interpreter
+  must open the file by name, and posix_spawn(3)).
+  At most every LMW_MAILER_RECHECK ms the name is stat'ed again, and if
+  it is another file now (e.g. an alternatives symlink was switched)
+  the new one is opened; the old one stays open while children of
+  other threads may still be starting it.
+*/
+#define LMW_MAILER_RECHECK 1000
+
+typedef struct {
+  char *path;        // without symlinks
+  int fd;            // O_PATH , or -1 if it must be executed by path
+  struct stat st;
+  int refs;
+} __LMW_exe;
+
+struct LMW_mailer_cache {
+  char *name;        // the cfg->mailer it was made for
+  char *found;       // where it was found in PATH
+  pthread_mutex_t lock;
+  __LMW_exe *exe;
+  long long checked;
+};
+
+/* the file for `name` , searching PATH as execvp(3); NULL and errno if none */
+static char *__LMW__exe_lookup(const char *name)
+{
+  if (strchr(name, '/'))
+    return access(name, X_OK) == 0 ? strdup(name) : NULL;
+  const char *path = getenv("PATH");
+  if (!path)
+    path = "/bin:/usr/bin";
+  size_t nl = strlen(name);
+  int err = ENOENT;
+  // an empty element, also the first or the last one, is the current directory
+  for (;;) {
+    const char *e = strchr(path, ':');
+    size_t dl = e ? (size_t) (e - path) : strlen(path);
+    char *f = malloc(dl + nl + 3);
+    if (!f)
+      return NULL;
+    sprintf(f, "%.*s/%s", (int) (dl ? dl : 1), dl ? path : ".", name);
+    if (access(f, X_OK) == 0)
+      return f;
+    if (errno == EACCES)
+      err = EACCES;
+    free(f);
+    if (!e)
+      break;
+    path = e + 1;
+  }
+  errno = err;
+  return NULL;
+}
+
+static __LMW_exe *__LMW__exe_open(const char *found)
+{
+  __LMW_exe *exe = calloc(1, sizeof(__LMW_exe));
+  if (!exe)
+    return NULL;
+  exe->fd = -1;
+  exe->path = realpath(found, NULL);
+  if (!exe->path || stat(exe->path, &exe->st) == -1) {
+    free(exe->path);
+    free(exe);
+    return NULL;
+  }
+  if (!S_ISREG(exe->st.st_mode)) {
+    free(exe->path);
+    free(exe);
+    errno = EACCES;
+    return NULL;
+  }
+#if defined(__linux__) && defined(O_PATH) && defined(SYS_execveat)
+  // a script cannot be executed from a file descriptor closed on exec
+  char head[2] = { 0 };
+  int rfd = open(exe->path, O_RDONLY | O_CLOEXEC);
+  if (rfd >= 0) {
+    if (read(rfd, head, 2) != 2)
+      head[0] = 0;
+    close(rfd);
+  }
+  if (head[0] != '#' || head[1] != '!')
+    exe->fd = open(exe->path, O_PATH | O_CLOEXEC);
+#endif
+  return exe;
+}
+
+static void __LMW__exe_free(__LMW_exe *exe)
+{
+  if (exe->fd >= 0)
+    close(exe->fd);
+  free(exe->path);
+  free(exe);
+}
+
+LMW_mailer_cache *LMW_mailer_cache_new(LMW_config *cfg)
+{
+  const char *name = cfg ? cfg->mailer : LMW_MAILER;
+  LMW_mailer_cache *mc = calloc(1, sizeof(LMW_mailer_cache));
+  if (!mc)
+    return NULL;
+  mc->name = strdup(name);
+  mc->found = __LMW__exe_lookup(name);
+  if (mc->found)
+    mc->exe = __LMW__exe_open(mc->found);
+  if (!mc->exe) {
+    int e = errno;
+    LMW_log_error("Cannot execute the mailer %s: %d %s\n", name, e, strerror(e));
+    free(mc->found);
+    free(mc->name);
+    free(mc);
+    errno = e;
+    return NULL;
+  }
+  mc->exe->refs = 1;
+  mc->checked = __LMW__now_ns();
+  pthread_mutex_init(&mc->lock, NULL);
+  return mc;
+}
+
+void LMW_mailer_cache_free(LMW_mailer_cache *mc)
+{
+  if (!mc)
+    return;
+  __LMW__exe_free(mc->exe);
+  pthread_mutex_destroy(&mc->lock);
+  free(mc->found);
+  free(mc->name);
+  free(mc);
+}
+
+/* the file to execute for `name` , or NULL to search it in PATH; release it with __LMW__exe_put() */
+static __LMW_exe *__LMW__exe_get(LMW_config *cfg, const char *name)
+{
+  LMW_mailer_cache *mc = cfg ? cfg->mailer_cache : NULL;
+  if (!mc || strcmp(mc->name, name))
+    return NULL;
+  long long now = __LMW__now_ns();
+  pthread_mutex_lock(&mc->lock);
+  if (now - mc->checked > LMW_MAILER_RECHECK * 1000000LL) {
+    mc->checked = now;
+    struct stat st;
+    __LMW_exe *exe = mc->exe;
+    if (stat(mc->found, &st) == 0 &&
+	(st.st_dev != exe->st.st_dev || st.st_ino != exe->st.st_ino || st.st_size != exe->st.st_size ||
+	 st.st_mtime != exe->st.st_mtime || st.st_ctime != exe->st.st_ctime)) {
+      __LMW_exe *fresh = __LMW__exe_open(mc->found);
+      if (fresh) {
+	fresh->refs = 1;
+	if (--exe->refs == 0)
+	  __LMW__exe_free(exe);
+	mc->exe = fresh;
+      }
+    }
+  }
+  __LMW_exe *exe = mc->exe;
+  exe->refs++;
+  pthread_mutex_unlock(&mc->lock);
+  return exe;
+}
+
+static void __LMW__exe_put(LMW_config *cfg, __LMW_exe *exe)
+{
+  if (!exe)
+    return;
+  LMW_mailer_cache *mc = cfg->mailer_cache;
+  pthread_mutex_lock(&mc->lock);
+  int last = --exe->refs == 0;
+  pthread_mutex_unlock(&mc->lock);
+  if (last)
+    __LMW__exe_free(exe);
+}
+
+/* exec the mailer; returns only on failure, with errno */
+static void __LMW__exec(__LMW_exe *exe, char *args[])
+{
+  extern char **environ;
+#if defined(__linux__) && defined(O_PATH) && defined(SYS_execveat)
+  if (exe && exe->fd >= 0) {
+    syscall(SYS_execveat, exe->fd, "", args, environ, AT_EMPTY_PATH);
+    if (errno != ENOSYS)
+      return;
+  }
+#endif
+  if (exe)
+    execv(exe->path, args);
+  else
+    execvp(args[0], args);
+}
+
+#ifdef __linux__
+
+// stack size for the clone(CLONE_VM|CLONE_VFORK) child, that only runs until execvp()
+#define LMW_CLONE_STACK (64 * 1024)
+
+struct __LMW_clone_arg {
+  char **args;
+  __LMW_exe *exe;
+  int stdin_fd, close_fd, stdout_fd, stderr_fd;
+  sigset_t *oldmask;
+  volatile int exec_errno; // written by the child, that shares our memory
+};
+
+static int __LMW__clone_child__(void *p)
+{
+  struct __LMW_clone_arg *a = p;
+  // The handler table was copied (no CLONE_SIGHAND), so resetting it does not
+  // affect the parent; a signal caught before execvp() must not run the
+  // parent's handlers on the shared memory
+  struct sigaction dfl;
+  memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction old;
+    if (sigaction(sig, NULL, &old) == 0 && old.sa_handler != SIG_IGN)
+      sigaction(sig, &dfl, NULL);
+  }
+  sigprocmask(SIG_SETMASK, a->oldmask, NULL);
+
+  close(a->close_fd);
+  dup2(a->stdin_fd, STDIN_FILENO);
+  close(a->stdin_fd);
+  dup2(a->stdout_fd, STDOUT_FILENO);
+  dup2(a->stderr_fd, STDERR_FILENO);
+  close(a->stdout_fd);
+  close(a->stderr_fd);
+
+  __LMW__exec(a->exe, a->args);
+  a->exec_errno = errno;
+  _exit(LMW_CHILD_EXEC_FAILED);
+}
+
+/* start the mailer with clone(CLONE_VM|CLONE_VFORK) , as vfork() but the child runs on its own stack;
+   returns the pid, or -1 and errno */
+static pid_t __LMW__clone_vfork__(char *args[], __LMW_exe *exe, int stdin_fd, int close_fd,
+				  int stdout_fd, int stderr_fd, int *exec_errno)
+{
+  char *stack = mmap(NULL, LMW_CLONE_STACK, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+    return -1;
+
+  sigset_t all, oldmask, childmask;
+  sigfillset(&all);
+  __LMW__child_sigmask(&childmask);
+  struct __LMW_clone_arg a = {
+    .args = args,
+    .exe = exe,
+    .stdin_fd = stdin_fd, .close_fd = close_fd,
+    .stdout_fd = stdout_fd, .stderr_fd = stderr_fd,
+    .oldmask = &childmask,
+    .exec_errno = 0,
+  };
+  // block all signals, so that no handler runs in the child before it resets them
+  pthread_sigmask(SIG_SETMASK, &all, &oldmask);
+  // the parent is suspended until the child calls execvp() or _exit()
+  pid_t pid = clone(__LMW__clone_child__, stack + LMW_CLONE_STACK,
+		    CLONE_VM | CLONE_VFORK | SIGCHLD, &a);
+  int saved_errno = errno;
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  munmap(stack, LMW_CLONE_STACK);
+
+  if (pid == -1) {
+    errno = saved_errno;
+    return -1;
+  }
+  if (a.exec_errno) {
+    waitpid(pid, NULL, 0);
+    *exec_errno = a.exec_errno;
+  }
+  return pid;
+}
+#endif // __linux__
+
+/* start the mailer with posix_spawnp() ; returns the pid, or -1 and errno */
+static pid_t __LMW__posix_spawn__(char *args[], __LMW_exe *exe, int stdin_fd, int close_fd,
+				  int stdout_fd, int stderr_fd, int *exec_errno)
+{
+  extern char **environ;
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+  int r = posix_spawn_file_actions_init(&fa);
+  if (r) {
+    errno = r;
+    return -1;
+  }
+  posix_spawn_file_actions_addclose(&fa, close_fd);
+  posix_spawn_file_actions_adddup2(&fa, stdin_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, stdout_fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, stderr_fd, STDERR_FILENO);
+  if (stdin_fd > STDERR_FILENO)
+    posix_spawn_file_actions_addclose(&fa, stdin_fd);
+  if (stdout_fd > STDERR_FILENO)
+    posix_spawn_file_actions_addclose(&fa, stdout_fd);
+  if (stderr_fd > STDERR_FILENO)
+    posix_spawn_file_actions_addclose(&fa, stderr_fd);
+
+  posix_spawnattr_t attr, *ap = NULL;
+  if (__LMW_sigpipe_blocked && posix_spawnattr_init(&attr) == 0) {
+    sigset_t mask;
+    __LMW__child_sigmask(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    ap = &attr;
+  }
+  if (exe)
+    r = posix_spawn(&pid, exe->path, &fa, ap, args, environ);
+  else
+    r = posix_spawnp(&pid, args[0], &fa, ap, args, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (ap)
+    posix_spawnattr_destroy(ap);
+  if (r) {
+    // glibc reports exec failures here, the child was already reaped
+    *exec_errno = r;
+    return 0;
+  }
+  return pid;
+}
+
+/***
+   start the mailer `args[0]` with arguments `args`,
+   its stdin from `stdin_fd`, its stdout and stderr to `stdout_fd` and `stderr_fd`;
+   `close_fd` is the write end of the pipe, that the child must not keep open.
+
+   Uses the method in cfg->spawn .
+
+   Returns the pid of the child, or -1 (and errno) if it could not be started;
+   if the method detects that exec failed, *exec_errno is set
+   (and the child, if any, was already reaped).
+   With LMW_SPAWN_FORK the exec failure is instead reported by the child
+   exiting with LMW_CHILD_EXEC_FAILED.
+   `exe` is the cached mailer, or NULL.
+*/
+static pid_t __LMW__spawn_exe__(LMW_config *cfg, char *args[], __LMW_exe *exe,
+				int stdin_fd, int close_fd, int stdout_fd, int stderr_fd,
+				int *exec_errno)
+{
+  int spawn = cfg ? cfg->spawn : LMW_SPAWN;
+  *exec_errno = 0;
+
+  if (spawn == LMW_SPAWN_POSIX_SPAWN)
+    return __LMW__posix_spawn__(args, exe, stdin_fd, close_fd, stdout_fd, stderr_fd, exec_errno);
+  if (spawn == LMW_SPAWN_VFORK) {
+#ifdef __linux__
+    return __LMW__clone_vfork__(args, exe, stdin_fd, close_fd, stdout_fd, stderr_fd, exec_errno);
+#else
+    return __LMW__posix_spawn__(args, exe, stdin_fd, close_fd, stdout_fd, stderr_fd, exec_errno);
+#endif
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+        // Child process
+        if (__LMW_sigpipe_blocked) {
+          sigset_t mask;
+          __LMW__child_sigmask(&mask);
+          pthread_sigmask(SIG_SETMASK, &mask, NULL);
+        }
+        close(close_fd);    // Close write end
+        dup2(stdin_fd, STDIN_FILENO); // Redirect pipe read end to stdin
+        close(stdin_fd);
+
+        // Save original stdout,stderr before redirecting (for error reporting if exec fails)
+        int orig_stdout = dup(STDOUT_FILENO);
+        int orig_stderr = dup(STDERR_FILENO);
+
+        // Redirect stdout and stderr to temporary files
+        dup2(stdout_fd, STDOUT_FILENO);
+        dup2(stderr_fd, STDERR_FILENO);
+        close(stdout_fd);
+        close(stderr_fd);
+
+        __LMW__exec(exe, args);
+        // If we get here, exec failed
+        int saved_errno = errno; // Save errno before any system calls
+	dup2(orig_stdout, STDOUT_FILENO); // Restore original stdout
+        dup2(orig_stderr, STDERR_FILENO); // Restore original stderr
+        close(orig_stdout);
+	close(orig_stderr);
+        LMW_log_error("Failure in exec child that should send email: %d %s\n", saved_errno, strerror(saved_errno));
+	// exit
+        _exit(LMW_CHILD_EXEC_FAILED);
+  }
+  return pid;
+}
+
+/* as above, with the mailer in cfg->mailer_cache if it is args[0] */
+static pid_t __LMW__spawn_child__(LMW_config *cfg, char *args[],
+				  int stdin_fd, int close_fd, int stdout_fd, int stderr_fd,
+				  int *exec_errno)
+{
+  __LMW_exe *exe = __LMW__exe_get(cfg, args[0]);
+  pid_t pid = __LMW__spawn_exe__(cfg, args, exe, stdin_fd, close_fd, stdout_fd, stderr_fd, exec_errno);
+  int saved_errno = errno;
+  __LMW__exe_put(cfg, exe);
+  errno = saved_errno;
+  return pid;
+}
+
 static int __LMW__process_exit_status__(int status, LMW_config *cfg)
 {
   if (WIFEXITED(status)) {
@@ -78,86 +601,1454 @@ static int __LMW__process_exit_status__(int status, LMW_config *cfg)
     if (childstatus) {
       LMW_log_error("Failure in child that should send email exit code : %d %s\n",
 		    childstatus, strerror(childstatus));
-      if (cfg) cfg->failures++;
+      LMW_count_failure();
     }
     return childstatus;
   } else if (WIFSIGNALED(status)) {
     // subprocess was terminated by signal
     int sig = WTERMSIG(status);
     LMW_log_error("Failure in child that should send email, terminated by signal %d\n", sig);
-    if (cfg)  cfg->failures++;
+    LMW_count_failure();
     return LMW_ERROR_SIGNAL;
   } else {
     // other termination
     LMW_log_error("Failure in child that should send email, terminated abnormally\n");
-    if (cfg)  cfg->failures++;
+    LMW_count_failure();
     return LMW_ERROR_SIGNAL;
   }
 }
 
 
-static void __LMW_clean_up_tmp(int stdout_fd, int stderr_fd,
-			       char *stdout_path, char *stderr_path,
-			       LMW_config *cfg)
+/* ========== STATISTICS ========== */
+
+/*
+  Log-linear histograms of nanoseconds: values below 16 have their own bucket,
+  then each power of two is split in 16 buckets, so the error is at most 1/16 ;
+  LMW_HIST_BUCKETS covers up to 2^42 ns (more than one hour).
+  The counters are only added to, with relaxed atomics, from any thread.
+*/
+#define LMW_HIST_SUB 16
+
+typedef struct {
+  _Atomic unsigned long long bucket[LMW_HIST_BUCKETS];
+  _Atomic unsigned long long count, sum, max;
+} __LMW_hist;
+
+struct LMW_stats {
+  __LMW_hist phase[LMW_PHASES];
+};
+
+static const char *__LMW_phase_name[LMW_PHASES] = {
+  "capture", "pipe", "spawn", "write", "wait", "cleanup", "total"
+};
+
+static int __LMW__hist_bucket(unsigned long long v)
+{
+  if (v < LMW_HIST_SUB)
+    return (int) v;
+  int msb = 63 - __builtin_clzll(v);
+  int b = (msb - 3) * LMW_HIST_SUB + (int) ((v >> (msb - 4)) & (LMW_HIST_SUB - 1));
+  return b < LMW_HIST_BUCKETS ? b : LMW_HIST_BUCKETS - 1;
+}
+
+/* the largest value that falls in bucket `b` */
+static unsigned long long __LMW__hist_upper(int b)
+{
+  if (b < LMW_HIST_SUB)
+    return b;
+  int msb = b / LMW_HIST_SUB + 3;
+  unsigned long long sub = b % LMW_HIST_SUB + LMW_HIST_SUB;
+  return ((sub + 1) << (msb - 4)) - 1;
+}
+
+static void __LMW__hist_add(__LMW_hist *h, unsigned long long v)
 {
-      // Now handle the temporary files
-    close(stdout_fd);
-    close(stderr_fd);
+  atomic_fetch_add_explicit(&h->bucket[__LMW__hist_bucket(v)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+  unsigned long long m = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (v > m && !atomic_compare_exchange_weak_explicit(&h->max, &m, v, memory_order_relaxed,
+							 memory_order_relaxed))
+    ;
+}
 
-    // Check stdout file
-    struct stat st;
-    if (stat(stdout_path, &st) == 0) {
-        if (st.st_size == 0) {
-            unlink(stdout_path);
-        } else {
-            LMW_log_error("Mail command stdout captured in: %s (size: %ld bytes)\n",
-                         stdout_path, (long)st.st_size);
-        }
+/* if statistics are enabled, record the time from *t to now in `phase`, and move *t to now */
+static void __LMW__stats_phase(LMW_config *cfg, int phase, long long *t)
+{
+  if (!cfg || !cfg->stats)
+    return;
+  long long now = __LMW__now_ns();
+  if (*t)
+    __LMW__hist_add(&cfg->stats->phase[phase], now - *t);
+  *t = now;
+}
+
+LMW_stats *LMW_stats_new(void)
+{
+  return calloc(1, sizeof(LMW_stats));
+}
+
+void LMW_stats_free(LMW_stats *st)
+{
+  free(st);
+}
+
+void LMW_stats_get(LMW_stats *st, LMW_stats_snapshot *snap)
+{
+  *snap = (LMW_stats_snapshot) { 0 };
+  for (int p = 0; p < LMW_PHASES; p++) {
+    __LMW_hist *h = &st->phase[p];
+    LMW_phase_snapshot *s = &snap->phase[p];
+    unsigned long long n = 0, seen = 0;
+    unsigned long long counts[LMW_HIST_BUCKETS];
+    // the buckets, not the counter, so that the percentiles are consistent
+    for (int b = 0; b < LMW_HIST_BUCKETS; b++)
+      n += counts[b] = atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+    s->count = n;
+    s->sum_ns = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    s->max_ns = atomic_load_explicit(&h->max, memory_order_relaxed);
+    if (n == 0)
+      continue;
+    // the smallest value such that at least this fraction of samples is not larger
+    unsigned long long want[3] = { (n * 500 + 999) / 1000, (n * 990 + 999) / 1000, (n * 999 + 999) / 1000 };
+    unsigned long long *out[3] = { &s->p50_ns, &s->p99_ns, &s->p999_ns };
+    int k = 0;
+    for (int b = 0; b < LMW_HIST_BUCKETS && k < 3; b++) {
+      seen += counts[b];
+      while (k < 3 && seen >= want[k]) {
+	unsigned long long u = __LMW__hist_upper(b);
+	*out[k++] = u < s->max_ns ? u : s->max_ns;
+      }
+    }
+  }
+}
+
+void LMW_stats_reset(LMW_stats *st)
+{
+  for (int p = 0; p < LMW_PHASES; p++) {
+    __LMW_hist *h = &st->phase[p];
+    for (int b = 0; b < LMW_HIST_BUCKETS; b++)
+      atomic_store_explicit(&h->bucket[b], 0, memory_order_relaxed);
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+  }
+}
+
+int LMW_stats_print(LMW_stats *st, FILE *f)
+{
+  LMW_stats_snapshot snap;
+  LMW_stats_get(st, &snap);
+  int r = fprintf(f, "%-8s %10s %10s %10s %10s %10s %10s\n",
+		  "phase", "count", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+  for (int p = 0; p < LMW_PHASES && r >= 0; p++) {
+    LMW_phase_snapshot *s = &snap.phase[p];
+    r = fprintf(f, "%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", __LMW_phase_name[p], s->count,
+		s->count ? s->sum_ns / 1e3 / s->count : 0.0,
+		s->p50_ns / 1e3, s->p99_ns / 1e3, s->p999_ns / 1e3, s->max_ns / 1e3);
+  }
+  return r < 0 ? -1 : 0;
+}
+
+
+/* ========== HEADER VALIDATION ========== */
+
+/*
+  LMW_text_scan() ORs together, over all blocks, the bytes that are
+  >= 128 and the masks of the comparisons for control characters;
+  lines are measured only where a block has a newline, from the bit mask
+  of its LFs. `*line` is the length of the line that is not ended yet.
+*/
+static unsigned __LMW__scan_lines(unsigned long long nl, int w, size_t *line, size_t max_line)
+{
+  unsigned found = 0;
+  size_t l = *line;
+  int prev = 0;
+  for (; nl; nl &= nl - 1) {
+    int p = __builtin_ctzll(nl);
+    if (l + (p - prev) > max_line)
+      found = LMW_SCAN_LONG_LINE;
+    l = 0;
+    prev = p + 1;
+  }
+  *line = l + (w - prev);
+  if (*line > max_line)
+    found = LMW_SCAN_LONG_LINE;
+  return found;
+}
+
+/* the same for the block at `i` , where *start is the beginning of the line:
+   if the lines cannot be shorter than a block, only its first and last LF matter */
+static inline unsigned __LMW__scan_block(unsigned nl, size_t i, int w, size_t *start, size_t max_line)
+{
+  if (max_line >= (size_t) w) {
+    if (!nl)
+      return 0;
+    unsigned found = (i + __builtin_ctz(nl) - *start > max_line) ? LMW_SCAN_LONG_LINE : 0;
+    *start = i + 32 - __builtin_clz(nl);
+    return found;
+  }
+  size_t line = i - *start;
+  unsigned found = __LMW__scan_lines(nl, w, &line, max_line);
+  *start = i + w - line;
+  return found;
+}
+
+static unsigned __LMW__scan_byte(unsigned char c)
+{
+  if (c >= 128)
+    return LMW_SCAN_8BIT;
+  if (c == '\n' || c == '\r')
+    return LMW_SCAN_NEWLINE;
+  if ((c < 32 && c != '\t') || c == 127)
+    return LMW_SCAN_CONTROL;
+  return 0;
+}
+
+static unsigned __LMW__scan_tail(const unsigned char *s, size_t n, size_t *line, size_t max_line)
+{
+  unsigned found = 0;
+  size_t l = *line;
+  for (size_t i = 0; i < n; i++) {
+    found |= __LMW__scan_byte(s[i]);
+    if (s[i] == '\n')
+      l = 0;
+    else if (++l > max_line)
+      found |= LMW_SCAN_LONG_LINE;
+  }
+  *line = l;
+  return found;
+}
+
+unsigned LMW_text_scan_scalar(const char *s, size_t n, size_t max_line)
+{
+  size_t line = 0;
+  return __LMW__scan_tail((const unsigned char *) s, n, &line, max_line ? max_line : SIZE_MAX);
+}
+
+#ifdef LMW_SCAN_X86
+static unsigned __LMW__scan_sse2(const unsigned char *s, size_t n, size_t max_line)
+{
+  __m128i hi = _mm_setzero_si128(), nls = hi, ctrl = hi;
+  unsigned found = 0;
+  size_t i = 0, start = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i lf = _mm_cmpeq_epi8(b, _mm_set1_epi8('\n'));
+    __m128i nl = _mm_or_si128(lf, _mm_cmpeq_epi8(b, _mm_set1_epi8('\r')));
+    // b <= 31 , unsigned
+    __m128i lt = _mm_cmpeq_epi8(_mm_min_epu8(b, _mm_set1_epi8(31)), b);
+    lt = _mm_andnot_si128(_mm_or_si128(nl, _mm_cmpeq_epi8(b, _mm_set1_epi8('\t'))), lt);
+    hi = _mm_or_si128(hi, b);
+    nls = _mm_or_si128(nls, nl);
+    ctrl = _mm_or_si128(ctrl, _mm_or_si128(lt, _mm_cmpeq_epi8(b, _mm_set1_epi8(127))));
+    if (!(found & LMW_SCAN_LONG_LINE))
+      found |= __LMW__scan_block((unsigned) _mm_movemask_epi8(lf), i, 16, &start, max_line);
+  }
+  size_t line = i - start;
+  if (line > max_line)
+    found |= LMW_SCAN_LONG_LINE;
+  if (_mm_movemask_epi8(hi))
+    found |= LMW_SCAN_8BIT;
+  if (_mm_movemask_epi8(nls))
+    found |= LMW_SCAN_NEWLINE;
+  if (_mm_movemask_epi8(ctrl))
+    found |= LMW_SCAN_CONTROL;
+  return found | __LMW__scan_tail(s + i, n - i, &line, max_line);
+}
+
+__attribute__((target("avx2")))
+static unsigned __LMW__scan_avx2(const unsigned char *s, size_t n, size_t max_line)
+{
+  __m256i hi = _mm256_setzero_si256(), nls = hi, ctrl = hi;
+  unsigned found = 0;
+  size_t i = 0, start = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i lf = _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\n'));
+    __m256i nl = _mm256_or_si256(lf, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\r')));
+    __m256i lt = _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(31)), b);
+    lt = _mm256_andnot_si256(_mm256_or_si256(nl, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\t'))), lt);
+    hi = _mm256_or_si256(hi, b);
+    nls = _mm256_or_si256(nls, nl);
+    ctrl = _mm256_or_si256(ctrl, _mm256_or_si256(lt, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(127))));
+    if (!(found & LMW_SCAN_LONG_LINE))
+      found |= __LMW__scan_block((unsigned) _mm256_movemask_epi8(lf), i, 32, &start, max_line);
+  }
+  size_t line = i - start;
+  if (line > max_line)
+    found |= LMW_SCAN_LONG_LINE;
+  if (_mm256_movemask_epi8(hi))
+    found |= LMW_SCAN_8BIT;
+  if (_mm256_movemask_epi8(nls))
+    found |= LMW_SCAN_NEWLINE;
+  if (_mm256_movemask_epi8(ctrl))
+    found |= LMW_SCAN_CONTROL;
+  return found | __LMW__scan_tail(s + i, n - i, &line, max_line);
+}
+
+typedef unsigned (*__LMW_scan_fn)(const unsigned char *s, size_t n, size_t max_line);
+static __LMW_scan_fn __LMW_scan = __LMW__scan_sse2;
+static pthread_once_t __LMW_scan_once = PTHREAD_ONCE_INIT;
+
+static void __LMW__scan_init(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    __LMW_scan = __LMW__scan_avx2;
+}
+#endif
+
+unsigned LMW_text_scan(const char *s, size_t n, size_t max_line)
+{
+  if (!max_line)
+    max_line = SIZE_MAX;
+#ifdef LMW_SCAN_X86
+  pthread_once(&__LMW_scan_once, __LMW__scan_init);
+  return __LMW_scan((const unsigned char *) s, n, max_line);
+#else
+  size_t line = 0;
+  return __LMW__scan_tail((const unsigned char *) s, n, &line, max_line);
+#endif
+}
+
+char *LMW_header_encode(const char *s, int fold)
+{
+  size_t n = s ? strlen(s) : 0;
+  unsigned found = s ? LMW_text_scan(s, n, 0) : LMW_SCAN_CONTROL;
+  if (found & (LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!(found & LMW_SCAN_8BIT))
+    return strdup(s);
+  // 3 characters a byte, and 14 more for each word, of at least 20 bytes
+  char *out = malloc(9 * n + 16), *o = out, *word = NULL;
+  if (!out)
+    return NULL;
+  static const char hex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < n; ) {
+    // a character of UTF-8 is its first byte and the bytes 10xxxxxx after it
+    size_t k = 1;
+    while (k < 4 && i + k < n && ((unsigned char) s[i + k] & 0xC0) == 0x80)
+      k++;
+    // "=?UTF-8?Q?" , the character, "?=" in 75
+    if (word && (size_t) (o - word) + 3 * k + 2 > 75) {
+      o = stpcpy(o, "?=");
+      o = stpcpy(o, fold ? "\n " : " ");
+      word = NULL;
+    }
+    if (!word) {
+      word = o;
+      o = stpcpy(o, "=?UTF-8?Q?");
+    }
+    for (; k > 0; k--, i++) {
+      unsigned char c = s[i];
+      if (c == ' ')
+	*o++ = '_';
+      else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+	       c == '!' || c == '*' || c == '+' || c == '-' || c == '/')
+	*o++ = c;
+      else {
+	*o++ = '=';
+	*o++ = hex[c >> 4];
+	*o++ = hex[c & 15];
+      }
+    }
+  }
+  strcpy(o, "?=");
+  return out;
+}
+
+/* rejects what could add headers or options to the mailer; returns LMW_OK or LMW_ERROR_INVALID */
+static int __LMW__headers_check(LMW_config *cfg, const char *recipient, const char *subject)
+{
+  const unsigned bad = LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL;
+  if (recipient && (recipient[0] == '-' || (LMW_text_scan(recipient, strlen(recipient), 0) & bad))) {
+    LMW_log_error("Invalid recipient of the email, it contains control characters or starts with '-'\n");
+    LMW_count_failure();
+    return LMW_ERROR_INVALID;
+  }
+  if (subject && (LMW_text_scan(subject, strlen(subject), 0) & bad)) {
+    LMW_log_error("Invalid subject of the email, it contains newlines or control characters\n");
+    LMW_count_failure();
+    return LMW_ERROR_INVALID;
+  }
+  return LMW_OK;
+}
+
+
+/*
+  Each bucket is a GCRA (generic cell rate algorithm) cell: a single
+  "theoretical arrival time"; an email is allowed if, after moving it
+  one interval forward, it is no more than `burst` intervals in the
+  future. So a check is one compare-and-swap, without locks.
+  The cells of the domains are in a table, found by hashing the domain
+  and probing LMW_RATE_PROBE entries; a cell whose bucket is full
+  again (its time has passed) may be taken over by another domain.
+*/
+#define LMW_RATE_PROBE 4
+
+typedef struct {
+  _Atomic unsigned long long key;  // hash of the domain, 0 if free
+  _Atomic long long tat;           // theoretical arrival time, in nanoseconds
+} __LMW_rate_cell;
+
+struct LMW_ratelimit {
+  long long interval, tolerance;            // of the global bucket, in nanoseconds
+  long long domain_interval, domain_tolerance;
+  int per_address;
+  __LMW_rate_cell global;
+  __LMW_rate_cell *cell;
+  unsigned mask;
+  _Atomic unsigned long long rejected;
+};
+
+void LMW_ratelimit_config_init(LMW_ratelimit_config *rcfg)
+{
+  *rcfg = (LMW_ratelimit_config) {
+    .rate = 0,
+    .burst = LMW_RATE_BURST,
+    .domain_rate = 0,
+    .domain_burst = LMW_RATE_BURST,
+    .per_address = 0,
+    .slots = LMW_RATE_SLOTS,
+  };
+}
+
+LMW_ratelimit *LMW_ratelimit_new(LMW_ratelimit_config *rcfg)
+{
+  LMW_ratelimit_config c;
+  if (rcfg)
+    c = *rcfg;
+  else
+    LMW_ratelimit_config_init(&c);
+  unsigned slots = LMW_RATE_PROBE;
+  while (slots < (unsigned) c.slots && slots < (1U << 30))
+    slots *= 2;
+  LMW_ratelimit *rl = calloc(1, sizeof(LMW_ratelimit));
+  if (!rl)
+    return NULL;
+  rl->cell = calloc(slots, sizeof(__LMW_rate_cell));
+  if (!rl->cell) {
+    free(rl);
+    return NULL;
+  }
+  rl->mask = slots - 1;
+  if (c.rate > 0) {
+    rl->interval = (long long) (1e9 / c.rate);
+    rl->tolerance = (long long) (rl->interval * (c.burst < 1 ? 1 : c.burst));
+  }
+  if (c.domain_rate > 0) {
+    rl->domain_interval = (long long) (1e9 / c.domain_rate);
+    rl->domain_tolerance = (long long) (rl->domain_interval * (c.domain_burst < 1 ? 1 : c.domain_burst));
+  }
+  rl->per_address = c.per_address;
+  return rl;
+}
+
+void LMW_ratelimit_free(LMW_ratelimit *rl)
+{
+  if (!rl) return;
+  free(rl->cell);
+  free(rl);
+}
+
+unsigned long long LMW_ratelimit_rejected(LMW_ratelimit *rl)
+{
+  return rl ? atomic_load_explicit(&rl->rejected, memory_order_relaxed) : 0;
+}
+
+/* take a token from the bucket; returns 0 if it is empty */
+static int __LMW__gcra(_Atomic long long *tat, long long now, long long interval, long long tolerance)
+{
+  long long t = atomic_load_explicit(tat, memory_order_relaxed);
+  for (;;) {
+    long long next = (t > now ? t : now) + interval;
+    if (next - now > tolerance)
+      return 0;
+    if (atomic_compare_exchange_weak_explicit(tat, &t, next, memory_order_relaxed, memory_order_relaxed))
+      return 1;
+  }
+}
+
+/* the bucket of domain `h` ; NULL if the table is crowded there */
+static _Atomic long long *__LMW__rate_cell(LMW_ratelimit *rl, unsigned long long h, long long now)
+{
+  for (unsigned p = 0; p < LMW_RATE_PROBE; p++) {
+    __LMW_rate_cell *c = &rl->cell[(h + p) & rl->mask];
+    unsigned long long k = atomic_load_explicit(&c->key, memory_order_relaxed);
+    if (k == h)
+      return &c->tat;
+    // a free cell, or one whose bucket is full, is as good as a new one
+    if ((k == 0 || atomic_load_explicit(&c->tat, memory_order_relaxed) <= now) &&
+	atomic_compare_exchange_strong_explicit(&c->key, &k, h, memory_order_relaxed, memory_order_relaxed))
+      return &c->tat;
+  }
+  return NULL;
+}
+
+/*
+  the key of the address at *p in the list `recipient` , and moves *p past it;
+  FNV-1a of its domain (or of all the address, as in "Name <address>"), in lowercase;
+  0 at the end of the list
+*/
+static unsigned long long __LMW__rate_key(LMW_ratelimit *rl, const char **p)
+{
+  const char *s = *p;
+  while (*s == ',' || *s == ' ')
+    s++;
+  const char *e = s, *at = NULL, *lt = NULL;
+  while (*e && *e != ',') {
+    if (*e == '@')
+      at = e;
+    else if (*e == '<')
+      lt = e;
+    e++;
+  }
+  *p = e;
+  const char *k = (at && !rl->per_address) ? at + 1 : lt ? lt + 1 : s;
+  if (k == e)
+    return 0;
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (; k < e && *k != ' ' && *k != '>'; k++)
+    h = (h ^ (unsigned char) (*k >= 'A' && *k <= 'Z' ? *k + 32 : *k)) * 0x100000001b3ULL;
+  return h ? h : 1;
+}
+
+/* gives back the tokens taken for the addresses of `recipient` before `stop` (all if NULL), and the global one */
+static void __LMW__rate_give_back(LMW_ratelimit *rl, const char *recipient, const char *stop, long long now)
+{
+  if (rl->domain_interval && recipient) {
+    const char *q = recipient;
+    for (unsigned long long h; (h = __LMW__rate_key(rl, &q)) && q != stop; ) {
+      _Atomic long long *tat = __LMW__rate_cell(rl, h, now);
+      if (tat)
+	atomic_fetch_sub_explicit(tat, rl->domain_interval, memory_order_relaxed);
+    }
+  }
+  if (rl->interval)
+    atomic_fetch_sub_explicit(&rl->global.tat, rl->interval, memory_order_relaxed);
+}
+
+/* the email passed __LMW__rate_check() , but is not sent after all */
+static void __LMW__rate_cancel(LMW_config *cfg, const char *recipient)
+{
+  LMW_ratelimit *rl = cfg ? cfg->ratelimit : NULL;
+  if (rl)
+    __LMW__rate_give_back(rl, recipient, NULL, __LMW__now_ns());
+}
+
+/* returns LMW_OK, or LMW_ERROR_RATE_LIMITED if the email is beyond the limits of cfg->ratelimit */
+static int __LMW__rate_check(LMW_config *cfg, const char *recipient)
+{
+  LMW_ratelimit *rl = cfg ? cfg->ratelimit : NULL;
+  if (!rl)
+    return LMW_OK;
+  long long now = __LMW__now_ns();
+  if (rl->interval && !__LMW__gcra(&rl->global.tat, now, rl->interval, rl->tolerance))
+    goto limited;
+  if (rl->domain_interval && recipient) {
+    const char *p = recipient;
+    for (unsigned long long h; (h = __LMW__rate_key(rl, &p)); ) {
+      _Atomic long long *tat = __LMW__rate_cell(rl, h, now);
+      if (tat && !__LMW__gcra(tat, now, rl->domain_interval, rl->domain_tolerance)) {
+	// the email is not sent: give back the tokens of the addresses before this one
+	__LMW__rate_give_back(rl, recipient, p, now);
+	goto limited;
+      }
+    }
+  }
+  return LMW_OK;
+
+ limited:
+  atomic_fetch_add_explicit(&rl->rejected, 1, memory_order_relaxed);
+  return LMW_ERROR_RATE_LIMITED;
+}
+
+
+/* ========== CIRCUIT BREAKER ========== */
+
+/*
+  `until` is the time when the next probe may start: while the circuit
+  is not closed, an email is let through only by the thread that moves
+  `until` forward, so there is at most one probe at a time, and no lock.
+*/
+struct LMW_breaker {
+  int threshold, probes;
+  long long open;                 // in nanoseconds
+  _Atomic int state;              // one of LMW_CIRCUIT_*
+  _Atomic int failures;           // successive
+  _Atomic int successes;          // successive probes
+  _Atomic long long until;
+};
+
+void LMW_breaker_config_init(LMW_breaker_config *bcfg)
+{
+  *bcfg = (LMW_breaker_config) {
+    .threshold = LMW_BREAKER_THRESHOLD,
+    .open = LMW_BREAKER_OPEN,
+    .probes = LMW_BREAKER_PROBES,
+  };
+}
+
+LMW_breaker *LMW_breaker_new(LMW_breaker_config *bcfg)
+{
+  LMW_breaker_config c;
+  if (bcfg)
+    c = *bcfg;
+  else
+    LMW_breaker_config_init(&c);
+  LMW_breaker *br = calloc(1, sizeof(LMW_breaker));
+  if (!br)
+    return NULL;
+  br->threshold = c.threshold > 0 ? c.threshold : 1;
+  br->probes = c.probes > 0 ? c.probes : 1;
+  br->open = (c.open > 0 ? c.open : 0) * 1000000LL;
+  return br;
+}
+
+void LMW_breaker_free(LMW_breaker *br)
+{
+  free(br);
+}
+
+int LMW_breaker_state(LMW_breaker *br)
+{
+  return br ? atomic_load_explicit(&br->state, memory_order_relaxed) : LMW_CIRCUIT_CLOSED;
+}
+
+/* returns LMW_OK if the email may be sent, or LMW_ERROR_CIRCUIT_OPEN */
+static int __LMW__breaker_enter(LMW_config *cfg)
+{
+  LMW_breaker *br = cfg ? cfg->breaker : NULL;
+  if (!br || atomic_load_explicit(&br->state, memory_order_acquire) == LMW_CIRCUIT_CLOSED)
+    return LMW_OK;
+  long long now = __LMW__now_ns();
+  long long u = atomic_load_explicit(&br->until, memory_order_relaxed);
+  // no other email may start until this probe is over
+  if (now < u || !atomic_compare_exchange_strong_explicit(&br->until, &u, now + br->open,
+							    memory_order_relaxed, memory_order_relaxed))
+    return LMW_ERROR_CIRCUIT_OPEN;
+  return LMW_OK;
+}
+
+/*
+  1 if the result `ret` of an email means that the mailer (or the relay) is failing,
+  0 if it worked, -1 if the email itself was refused, that says nothing about it
+*/
+static int __LMW__breaker_failure(int ret)
+{
+  switch (ret) {
+  case LMW_OK:
+    return 0;
+  case LMW_ERROR_CANNOT_CALL:   // fork, exec or connection failure
+  case LMW_ERROR_PIPE:
+  case LMW_ERROR_TIMEOUT:
+  case LMW_ERROR_SIGNAL:
+  case LMW_CHILD_EXEC_FAILED:
+    return 1;
+  // refusals of one recipient: sysexits(3) of sendmail and compatible mailers ...
+  case EX_USAGE:
+  case EX_DATAERR:
+  case EX_NOUSER:
+  case EX_NOHOST:
+  // ... and SMTP replies, see LMW_backend_smtp()
+  case 450:
+  case 550:
+  case 551:
+  case 552:
+  case 553:
+    return -1;
+  }
+  // the other negative codes are refusals before the mailer was started
+  return ret < 0 ? -1 : 1;
+}
+
+/* accounts for the result `ret` of an email let through by __LMW__breaker_enter() */
+static void __LMW__breaker_leave(LMW_config *cfg, int ret)
+{
+  LMW_breaker *br = cfg ? cfg->breaker : NULL;
+  int failure = __LMW__breaker_failure(ret);
+  if (!br || failure < 0)
+    return;
+  int state = atomic_load_explicit(&br->state, memory_order_acquire);
+  long long now = __LMW__now_ns();
+  if (failure) {
+    int n = atomic_fetch_add_explicit(&br->failures, 1, memory_order_relaxed) + 1;
+    atomic_store_explicit(&br->successes, 0, memory_order_relaxed);
+    if (state == LMW_CIRCUIT_CLOSED && n < br->threshold)
+      return;
+    atomic_store_explicit(&br->until, now + br->open, memory_order_relaxed);
+    if (state != LMW_CIRCUIT_OPEN &&
+	atomic_compare_exchange_strong_explicit(&br->state, &state, LMW_CIRCUIT_OPEN,
+						memory_order_release, memory_order_relaxed)) {
+      LMW_log_error("Circuit open after %d successive failures of the mailer, next try in %lld ms\n",
+		    n, br->open / 1000000);
+    }
+    return;
+  }
+  atomic_store_explicit(&br->failures, 0, memory_order_relaxed);
+  if (state == LMW_CIRCUIT_CLOSED)
+    return;
+  // let the next probe through at once
+  atomic_store_explicit(&br->until, now, memory_order_relaxed);
+  int n = atomic_fetch_add_explicit(&br->successes, 1, memory_order_relaxed) + 1;
+  int next = n >= br->probes ? LMW_CIRCUIT_CLOSED : LMW_CIRCUIT_HALF_OPEN;
+  if (next != state &&
+      atomic_compare_exchange_strong_explicit(&br->state, &state, next, memory_order_release, memory_order_relaxed)) {
+    if (next == LMW_CIRCUIT_CLOSED) {
+      atomic_store_explicit(&br->successes, 0, memory_order_relaxed);
+      LMW_log_error("Circuit closed, the mailer works again\n");
     } else {
-        LMW_log_error("Warning: could not stat stdout temp file %s: %d %s\n",
-                     stdout_path, errno, strerror(errno));
-        unlink(stdout_path); // Try to clean up anyway
-    }
-
-    // Check stderr file
-    if (stat(stderr_path, &st) == 0) {
-        if (st.st_size == 0) {
-            unlink(stderr_path);
-        } else {
-            LMW_log_error("Mail command stderr captured in: %s (size: %ld bytes)\n",
-                         stderr_path, (long)st.st_size);
-        }
+      LMW_log_error("Circuit half open, the mailer worked once\n");
+    }
+  }
+}
+
+
+/* ========== ADAPTIVE TIMEOUT ========== */
+
+/*
+  For each mailer and size of body, the averages of the times and of
+  their deviations, in microseconds, are packed in one 64 bit word,
+  the mean in the high half, so that a sample updates both with one
+  compare-and-swap. The mailers are found by the FNV-1a of their name,
+  in a small table; when it is full, they share the cells.
+*/
+#define LMW_TIMEOUT_MAILERS 8
+#define LMW_TIMEOUT_SIZES 6    // < 4 kB, < 64 kB, < 1 MB, < 16 MB, larger, unknown
+
+typedef struct {
+  _Atomic unsigned long long est;
+  _Atomic unsigned long long samples;
+} __LMW_timeout_cell;
+
+struct LMW_timeout {
+  int min, max, warmup;
+  double factor;
+  struct {
+    _Atomic unsigned long long key;   // FNV-1a of the mailer, 0 if the slot is free
+    __LMW_timeout_cell size[LMW_TIMEOUT_SIZES];
+  } mailer[LMW_TIMEOUT_MAILERS];
+};
+
+void LMW_timeout_config_init(LMW_timeout_config *tcfg)
+{
+  *tcfg = (LMW_timeout_config) {
+    .min = LMW_TIMEOUT_MIN,
+    .max = LMW_TIMEOUT_MAX,
+    .factor = LMW_TIMEOUT_FACTOR,
+    .warmup = LMW_TIMEOUT_WARMUP,
+  };
+}
+
+LMW_timeout *LMW_timeout_new(LMW_timeout_config *tcfg)
+{
+  LMW_timeout_config d;
+  if (!tcfg) {
+    LMW_timeout_config_init(&d);
+    tcfg = &d;
+  }
+  if (tcfg->min < 1 || tcfg->max < tcfg->min || tcfg->factor <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  LMW_timeout *to = calloc(1, sizeof(LMW_timeout));
+  if (!to)
+    return NULL;
+  to->min = tcfg->min;
+  to->max = tcfg->max;
+  to->factor = tcfg->factor;
+  to->warmup = tcfg->warmup;
+  return to;
+}
+
+void LMW_timeout_free(LMW_timeout *to)
+{
+  free(to);
+}
+
+static __LMW_timeout_cell *__LMW__timeout_cell(LMW_timeout *to, const char *mailer, size_t len)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (const char *p = mailer ? mailer : LMW_MAILER; *p; p++)
+    h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+  if (!h)
+    h = 1;
+  int m = 0;
+  for (; m < LMW_TIMEOUT_MAILERS; m++) {
+    unsigned long long k = atomic_load_explicit(&to->mailer[m].key, memory_order_relaxed);
+    if (k == h || (k == 0 && (atomic_compare_exchange_strong(&to->mailer[m].key, &k, h) || k == h)))
+      break;
+  }
+  if (m == LMW_TIMEOUT_MAILERS)
+    m = h % LMW_TIMEOUT_MAILERS;
+  int b = 0;
+  if (len == SIZE_MAX)
+    b = LMW_TIMEOUT_SIZES - 1;
+  else
+    for (len >>= 12; len && b < LMW_TIMEOUT_SIZES - 2; len >>= 4)
+      b++;
+  return &to->mailer[m].size[b];
+}
+
+/* the deadline for the mailer, in milliseconds */
+static int __LMW__max_wait(LMW_config *cfg, size_t len, LMW_timeout_estimate *e)
+{
+  LMW_timeout *to = cfg ? cfg->timeout : NULL;
+  if (e)
+    *e = (LMW_timeout_estimate) { 0 };
+  if (!to) {
+    if (e)
+      e->deadline_ms = cfg ? cfg->max_wait : LMW_MAX_WAIT;
+    return cfg ? cfg->max_wait : LMW_MAX_WAIT;
+  }
+  __LMW_timeout_cell *c = __LMW__timeout_cell(to, cfg->mailer, len);
+  unsigned long long est = atomic_load_explicit(&c->est, memory_order_relaxed);
+  unsigned long long samples = atomic_load_explicit(&c->samples, memory_order_relaxed);
+  double mean = (est >> 32) / 1e3, dev = (est & 0xffffffffULL) / 1e3;
+  double d = samples < (unsigned long long) to->warmup ? to->max : to->factor * (mean + 4 * dev);
+  int ms = d <= to->min ? to->min : d >= to->max ? to->max : (int) d + 1;
+  if (e)
+    *e = (LMW_timeout_estimate) { samples, mean, dev, mean + 4 * dev, ms };
+  return ms;
+}
+
+int LMW_timeout_get(LMW_config *cfg, size_t body_len, LMW_timeout_estimate *e)
+{
+  return __LMW__max_wait(cfg, body_len, e);
+}
+
+/* accounts for a mailer that exited, or timed out, `ns` after it was started */
+static void __LMW__timeout_record(LMW_config *cfg, size_t len, long long ns)
+{
+  LMW_timeout *to = cfg ? cfg->timeout : NULL;
+  if (!to)
+    return;
+  __LMW_timeout_cell *c = __LMW__timeout_cell(to, cfg->mailer, len);
+  long long x = ns / 1000;
+  unsigned long long old = atomic_load_explicit(&c->est, memory_order_relaxed), est;
+  do {
+    long long mean = old >> 32, dev = old & 0xffffffffULL;
+    if (!old) {
+      mean = x;
+      dev = x / 2;
+    } else {
+      long long err = x - mean;
+      mean += err / 8;
+      dev += ((err < 0 ? -err : err) - dev) / 4;
+    }
+    mean = mean < 1 ? 1 : mean > 0xffffffffLL ? 0xffffffffLL : mean;
+    dev = dev < 0 ? 0 : dev > 0xffffffffLL ? 0xffffffffLL : dev;
+    est = (unsigned long long) mean << 32 | (unsigned long long) dev;
+  } while (!atomic_compare_exchange_weak_explicit(&c->est, &old, est, memory_order_relaxed,
+						  memory_order_relaxed));
+  atomic_fetch_add_explicit(&c->samples, 1, memory_order_relaxed);
+}
+
+/* ========== CAPTURE OF STDOUT AND STDERR OF THE MAILER ========== */
+
+typedef struct {
+  int fd[2];         // receive stdout and stderr of the mailer: read ends of pipes, or files
+  int child[2];      // what the mailer gets as stdout and stderr, closed once it started
+  char path[2][32];  // temporary files, when cfg->capture_to_disk ; else empty
+  char *buf[2];      // from the pipes, the first `max` bytes
+  size_t len[2], size[2];
+  size_t total[2];   // all that was read from the pipes
+  size_t max;
+} __LMW_capture;
+
+static const char *__LMW_capture_name[2] = { "stdout", "stderr" };
+
+/* Returns 0, or -1 on failure (that is logged) */
+static int __LMW__capture_open(__LMW_capture *c, LMW_config *cfg)
+{
+  int to_disk = cfg ? cfg->capture_to_disk : 0;
+  c->max = cfg ? cfg->capture_max : LMW_CAPTURE_MAX;
+  for (int j = 0; j < 2; j++) {
+    c->fd[j] = c->child[j] = -1;
+    c->path[j][0] = 0;
+    c->buf[j] = NULL;
+    c->len[j] = c->size[j] = c->total[j] = 0;
+  }
+  for (int j = 0; j < 2; j++) {
+    if (!to_disk) {
+      /* in memory: a pipe, that is drained while waiting for the mailer, so
+	 that its writes never fail, and what is beyond `max` is discarded */
+      int p[2];
+      if (__LMW__pipe_cloexec(p) == -1) {
+	LMW_log_error("Failed to create pipe for %s: %d %s\n",
+		      __LMW_capture_name[j], errno, strerror(errno));
+	goto fail;
+      }
+      __LMW__make_nonblocking(p[0]);
+      c->fd[j] = p[0];
+      c->child[j] = p[1];
+      continue;
+    }
+    snprintf(c->path[j], sizeof(c->path[j]), "/tmp/lmw_%s_XXXXXX", __LMW_capture_name[j]);
+#ifdef __linux__
+    c->fd[j] = mkostemp(c->path[j], O_CLOEXEC);
+#else
+    c->fd[j] = mkstemp(c->path[j]);
+#endif
+    if (c->fd[j] == -1) {
+      LMW_log_error("Failed to create temporary file for %s: %d %s\n",
+		    __LMW_capture_name[j], errno, strerror(errno));
+      c->path[j][0] = 0;
+      goto fail;
+    }
+    fcntl(c->fd[j], F_SETFD, FD_CLOEXEC);
+    c->child[j] = c->fd[j];
+  }
+  return 0;
+
+ fail:
+  for (int j = 0; j < 2; j++) {
+    if (c->child[j] != -1 && c->child[j] != c->fd[j]) close(c->child[j]);
+    if (c->fd[j] != -1) close(c->fd[j]);
+    if (c->path[j][0]) unlink(c->path[j]);
+  }
+  return -1;
+}
+
+/* the mailer has started (or failed to): close our copy of its ends of the pipes */
+static void __LMW__capture_spawned(__LMW_capture *c)
+{
+  for (int j = 0; j < 2; j++) {
+    if (c->child[j] != -1 && c->child[j] != c->fd[j])
+      close(c->child[j]);
+    c->child[j] = -1;
+  }
+}
+
+/* add to `pfd` the pipes that are still open; returns how many */
+static int __LMW__capture_pollfd(__LMW_capture *c, struct pollfd *pfd)
+{
+  int n = 0;
+  for (int j = 0; j < 2; j++)
+    if (!c->path[j][0] && c->fd[j] >= 0)
+      pfd[n++] = (struct pollfd) { .fd = c->fd[j], .events = POLLIN };
+  return n;
+}
+
+/*
+  Reads what is in the pipes, without waiting: the first `max` bytes are
+  kept, the rest is discarded. A pipe is closed at end of file.
+*/
+static void __LMW__capture_drain(__LMW_capture *c)
+{
+  char discard[16384];
+  for (int j = 0; j < 2; j++) {
+    if (c->path[j][0] || c->fd[j] < 0)
+      continue;
+    for (;;) {
+      char *p = discard;
+      size_t n = sizeof(discard);
+      if (c->len[j] < c->max) {
+	// grown as needed, up to `max` and the final NUL
+	if (c->size[j] < c->len[j] + 1 + sizeof(discard) && c->size[j] < c->max + 1) {
+	  size_t want = 2 * c->size[j] > c->len[j] + 1 + sizeof(discard) ?
+	    2 * c->size[j] : c->len[j] + 1 + sizeof(discard);
+	  if (want > c->max + 1)
+	    want = c->max + 1;
+	  char *b = realloc(c->buf[j], want);
+	  if (b) {
+	    c->buf[j] = b;
+	    c->size[j] = want;
+	  }
+	}
+	if (c->size[j] > c->len[j] + 1) {
+	  p = c->buf[j] + c->len[j];
+	  n = c->size[j] - 1 - c->len[j];
+	}
+      }
+      ssize_t r = read(c->fd[j], p, n);
+      if (r > 0) {
+	c->total[j] += r;
+	if (p != discard)
+	  c->len[j] += r;
+	continue;
+      }
+      if (r == -1 && errno == EINTR)
+	continue;
+      if (r == 0) {
+	close(c->fd[j]);
+	c->fd[j] = -1;
+      }
+      break;
+    }
+  }
+}
+
+/*
+  Reads at most cfg->capture_max bytes of what the mailer wrote,
+  stores it in `res` if not NULL, or else logs it; then closes the files.
+  Files on disk are removed if empty, otherwise their path is logged.
+*/
+static void __LMW_clean_up_capture(__LMW_capture *c, LMW_result *res, LMW_config *cfg)
+{
+  size_t max = c->max;
+  long long t = 0;
+  __LMW__stats_phase(cfg, LMW_PHASE_CLEANUP, &t);
+  __LMW__capture_spawned(c);
+  // what is left in the pipes; a process left behind by the mailer may keep them open
+  __LMW__capture_drain(c);
+  for (int j = 0; j < 2; j++) {
+    char *data = NULL;
+    size_t len = 0, total;
+    if (!c->path[j][0]) {
+      data = c->buf[j];
+      len = c->len[j];
+      total = c->total[j];
+      if (data)
+	data[len] = 0;
     } else {
-        LMW_log_error("Warning: could not stat stderr temp file %s: %d %s\n",
-                     stderr_path, errno, strerror(errno));
-        unlink(stderr_path); // Try to clean up anyway
+      struct stat st;
+      if (fstat(c->fd[j], &st) == -1) {
+	LMW_log_error("Warning: could not stat %s capture file: %d %s\n",
+		      __LMW_capture_name[j], errno, strerror(errno));
+	st.st_size = 0;
+      }
+      total = st.st_size;
+      if (total == 0)
+	unlink(c->path[j]);
+      else
+	LMW_log_error("Mail command %s captured in: %s (size: %ld bytes)\n",
+		      __LMW_capture_name[j], c->path[j], (long) total);
+      len = total < max ? total : max;
+      if (len > 0 && res) {
+	data = malloc(len + 1);
+	ssize_t r = data ? pread(c->fd[j], data, len, 0) : -1;
+	len = r > 0 ? r : 0;
+	if (data)
+	  data[len] = 0;
+      }
     }
+    if (len > 0 && res) {
+      *(j ? &res->err : &res->out) = data;
+      *(j ? &res->err_len : &res->out_len) = len;
+      data = NULL;
+    } else if (len > 0 && data) {
+      LMW_log_error("Mail command %s (size: %ld bytes): %s\n",
+		    __LMW_capture_name[j], (long) total, data);
+    }
+    free(data);
+    if (res && total > max)
+      res->truncated = 1;
+    if (c->fd[j] >= 0)
+      close(c->fd[j]);
+    c->fd[j] = -1;
+    c->buf[j] = NULL;
+  }
+  __LMW__stats_phase(cfg, LMW_PHASE_CLEANUP, &t);
+}
+
+void LMW_result_free(LMW_result *res)
+{
+  if (!res) return;
+  free(res->out);
+  free(res->err);
+  res->out = res->err = NULL;
+  res->out_len = res->err_len = 0;
+}
+
+/* ========== WAITING FOR THE CHILD ========== */
+
+// after SIGTERM, how long the child has to terminate before SIGKILL, in milliseconds
+#define LMW_KILL_GRACE 100
+// after a failure in sending the body, how long to wait for the child exit status, in milliseconds
+#define LMW_REASON_WAIT 10
+// without pidfd, longest sleep between checks of the child , in milliseconds
+#define LMW_SIGCHLD_POLL 10
+
+/* monotonic time, in nanoseconds */
+static long long __LMW__now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* milliseconds from now to the deadline, rounded up, 0 if expired */
+static int __LMW__remaining_ms(long long deadline)
+{
+  long long left = deadline - __LMW__now_ns();
+  if (left <= 0) return 0;
+  return (int) ((left + 999999) / 1000000);
+}
+
+/* a file descriptor that becomes readable when the child exits, or -1 if not supported */
+static int __LMW__pidfd_open(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd >= 0)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#else
+  (void) pid;
+  return -1;
+#endif
+}
 
+/*
+  Fallback for kernels without pidfd: a SIGCHLD handler writes to a self-pipe,
+  that is polled by the waiters; the previous handler is still called.
+  Many threads may be waiting on the same pipe, and one may drain the wake up
+  of another; so waiters never sleep more than LMW_SIGCHLD_POLL
+*/
+static int __LMW_sigchld_pipe[2] = { -1, -1 };
+static struct sigaction __LMW_old_sigchld;
+static pthread_once_t __LMW_sigchld_once = PTHREAD_ONCE_INIT;
+
+static void __LMW__sigchld_handler(int sig, siginfo_t *info, void *uctx)
+{
+  int saved_errno = errno;
+  if (write(__LMW_sigchld_pipe[1], "", 1) == -1) {
+    // pipe full, the waiters will wake up anyway
+  }
+  errno = saved_errno;
+  if (__LMW_old_sigchld.sa_flags & SA_SIGINFO) {
+    if (__LMW_old_sigchld.sa_sigaction)
+      __LMW_old_sigchld.sa_sigaction(sig, info, uctx);
+  } else if (__LMW_old_sigchld.sa_handler != SIG_DFL &&
+	     __LMW_old_sigchld.sa_handler != SIG_IGN) {
+    __LMW_old_sigchld.sa_handler(sig);
+  }
+}
+
+static void __LMW__sigchld_init(void)
+{
+  struct sigaction sa;
+  if (sigaction(SIGCHLD, NULL, &__LMW_old_sigchld) == -1 ||
+      __LMW_old_sigchld.sa_handler == SIG_IGN) // children are not waitable anyway
+    return;
+  if (pipe(__LMW_sigchld_pipe) == -1)
+    return;
+  for (int j = 0; j < 2; j++) {
+    fcntl(__LMW_sigchld_pipe[j], F_SETFD, FD_CLOEXEC);
+    __LMW__make_nonblocking(__LMW_sigchld_pipe[j]);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = __LMW__sigchld_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART | (__LMW_old_sigchld.sa_flags & SA_NOCLDSTOP);
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    close(__LMW_sigchld_pipe[0]);
+    close(__LMW_sigchld_pipe[1]);
+    __LMW_sigchld_pipe[0] = __LMW_sigchld_pipe[1] = -1;
+  }
+}
+
+/*
+  Waits until `fd` is ready for `events`, or the child exits, or the deadline;
+  `fd` or `pidfd` may be -1. Meanwhile the pipes of `cap`, if not NULL, are drained.
+  Returns the poll(2) revents of `fd` , 0 otherwise.
+*/
+static int __LMW__wait_events__(int fd, short events, int pidfd, __LMW_capture *cap, long long deadline)
+{
+  struct pollfd pfd[4];
+  int n = 0, fdix = -1;
+  if (fd >= 0) {
+    fdix = n;
+    pfd[n++] = (struct pollfd) { .fd = fd, .events = events };
+  }
+  if (pidfd >= 0) {
+    pfd[n++] = (struct pollfd) { .fd = pidfd, .events = POLLIN };
+  } else {
+    pthread_once(&__LMW_sigchld_once, __LMW__sigchld_init);
+    if (__LMW_sigchld_pipe[0] >= 0)
+      pfd[n++] = (struct pollfd) { .fd = __LMW_sigchld_pipe[0], .events = POLLIN };
+  }
+  if (cap)
+    n += __LMW__capture_pollfd(cap, pfd + n);
+
+  for (;;) {
+    int timeout = __LMW__remaining_ms(deadline);
+    if (pidfd < 0 && timeout > LMW_SIGCHLD_POLL)
+      timeout = LMW_SIGCHLD_POLL;
+    int r = poll(pfd, n, timeout);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (pidfd < 0 && __LMW_sigchld_pipe[0] >= 0) {
+      char buf[64];
+      while (read(__LMW_sigchld_pipe[0], buf, sizeof(buf)) > 0)
+	;
+    }
+    if (cap && r > 0)
+      __LMW__capture_drain(cap);
+    return (r > 0 && fdix >= 0) ? pfd[fdix].revents : 0;
+  }
+}
+
+/*
+  Waits for the child to exit, until the deadline, draining `cap` (that may be NULL).
+  Returns as waitpid(2) : the pid, or 0 on timeout, or -1 on error
+*/
+static pid_t __LMW__wait_child__(pid_t pid, int pidfd, __LMW_capture *cap, int *status, long long deadline)
+{
+  pid_t wp = waitpid(pid, status, WNOHANG);
+  while (wp == 0 && __LMW__now_ns() < deadline) {
+    __LMW__wait_events__(-1, 0, pidfd, cap, deadline);
+    wp = waitpid(pid, status, WNOHANG);
+  }
+  return wp;
+}
+
+/*
+  Returns 1 if the child has exited, without reaping it
+  (waitpid(2) does not accept WNOWAIT on Linux)
+*/
+static int __LMW__child_exited__(pid_t pid)
+{
+  siginfo_t si;
+  si.si_pid = 0;
+  return waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0 && si.si_pid != 0;
 }
 
-static void __LMW__kill_gracefully__(pid_t pid, int count, int max_wait, LMW_config *cfg)
+static void __LMW__kill_gracefully__(pid_t pid, int pidfd, LMW_config *cfg)
 {
-  pid_t wp=0;
   int status=0;
   // Kill the child process since we had a write problem
   LMW_log_error("Terminating child emailer, pid %d\n", pid);
   kill(pid, SIGTERM);
   // Wait a bit for graceful termination
-  max_wait += 100;
-  do {
-    if ( usleep(1000) != 0) {
-      LMW_log_error("Error in usleep: %d %s\n", errno, strerror(errno));
-      break;
+  pid_t wp = __LMW__wait_child__(pid, pidfd, NULL, &status,
+				 __LMW__now_ns() + LMW_KILL_GRACE * 1000000LL);
+  if (wp == 0) {
+    // Still running, force kill
+    LMW_log_error("Killing child emailer, pid %d\n", pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0); // This should not block after SIGKILL
+  }
+}
+
+/* ========== BODY SOURCES ========== */
+
+// size of the buffer used when the body cannot be spliced
+#define LMW_BODY_BUFFER (64 * 1024)
+
+/*
+  Where the body comes from: a list of buffers, a file descriptor, or a callback.
+  A string body is written with write(2) , since the caller may free or reuse
+  it as soon as we return; buffers passed with LMW_send_email_iov() are moved
+  with vmsplice(2), and files with splice(2), so they are not copied
+  in user space.
+*/
+typedef struct {
+  struct iovec *iov;     // the buffers still to send, advanced as they are sent
+  int iovcnt;
+  struct iovec *iov_alloc; // to be freed
+  int use_vmsplice;      // use vmsplice(2) for `iov`
+  int fd;                // or the file, -1 if not used
+  LMW_body_reader reader; // or the callback, NULL if not used
+  void *reader_ctx;
+  int reader_failed;
+  off_t off;             // next offset in `fd`, -1 if not seekable
+  int use_splice;        // use splice(2) for `fd`
+  char *buf;             // when `fd` cannot be spliced, or for `reader`, the data read but not yet sent
+  size_t buf_off, buf_len;
+  size_t left;           // bytes still to send, SIZE_MAX if unknown (until end of file)
+  size_t sent;
+  int last;              // last byte of the body, -1 if empty or unknown
+  struct iovec one;      // storage for a string body
+} __LMW_body;
+
+static void __LMW__body_string(__LMW_body *b, char *body)
+{
+  size_t l = strlen(body);
+  *b = (__LMW_body) { .one = { body, l }, .iovcnt = 1, .fd = -1, .left = l,
+		      .last = l ? (unsigned char) body[l - 1] : -1 };
+  b->iov = &b->one;
+}
+
+/* returns 0, or -1 and errno */
+static int __LMW__body_iov(__LMW_body *b, const struct iovec *iov, int iovcnt)
+{
+  *b = (__LMW_body) { .fd = -1, .last = -1, .use_vmsplice = 1 };
+  b->iov = b->iov_alloc = calloc(iovcnt > 0 ? iovcnt : 1, sizeof(struct iovec));
+  if (!b->iov)
+    return -1;
+  for (int j = 0; j < iovcnt; j++) {
+    if (iov[j].iov_len == 0)
+      continue;
+    b->iov[b->iovcnt++] = iov[j];
+    b->left += iov[j].iov_len;
+    b->last = ((unsigned char *) iov[j].iov_base)[iov[j].iov_len - 1];
+  }
+  return 0;
+}
+
+/* `len` bytes of `fd` from `offset`; len == 0 means: until the end of the file.
+   Returns 0, or -1 and errno */
+static int __LMW__body_fd(__LMW_body *b, int fd, off_t offset, size_t len)
+{
+  struct stat st;
+  unsigned char c;
+  *b = (__LMW_body) { .fd = fd, .off = offset, .left = len, .last = -1, .use_splice = 1 };
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+    if (len == 0)
+      b->left = st.st_size > offset ? (size_t) (st.st_size - offset) : 0;
+    if (b->left > 0 && pread(fd, &c, 1, offset + b->left - 1) == 1)
+      b->last = c;
+  } else {
+    // a pipe or a socket: read from the current position
+    b->off = -1;
+    if (len == 0)
+      b->left = SIZE_MAX;
+  }
+  return 0;
+}
+
+static void __LMW__body_reader(__LMW_body *b, LMW_body_reader reader, void *ctx)
+{
+  *b = (__LMW_body) { .fd = -1, .reader = reader, .reader_ctx = ctx, .off = -1, .left = SIZE_MAX, .last = -1 };
+}
+
+/* read from `fd` or `reader` ; returns as read(2) */
+static ssize_t __LMW__body_read(__LMW_body *b, char *buf, size_t n, off_t off)
+{
+  if (b->reader) {
+    ssize_t r = b->reader(b->reader_ctx, buf, n);
+    if (r < 0 || r > (ssize_t) n) {
+      b->reader_failed = 1;
+      errno = ECANCELED;
+      return -1;
+    }
+    return r;
+  }
+  return (off >= 0) ? pread(b->fd, buf, n, off) : read(b->fd, buf, n);
+}
+
+static void __LMW__body_free(__LMW_body *b)
+{
+  free(b->iov_alloc);
+  free(b->buf);
+}
+
+/* send some of the body to `pipe_fd` ; returns the bytes sent, 0 at end of file, or -1 and errno */
+static ssize_t __LMW__body_send(int pipe_fd, __LMW_body *b)
+{
+  ssize_t r;
+  if (b->fd < 0 && !b->reader) {
+    int n = b->iovcnt < IOV_MAX ? b->iovcnt : IOV_MAX;
+#ifdef __linux__
+    if (b->use_vmsplice) {
+      r = vmsplice(pipe_fd, b->iov, n, SPLICE_F_NONBLOCK);
+      if (r == -1 && (errno == EINVAL || errno == ENOSYS))
+	b->use_vmsplice = 0;
+    }
+    if (!b->use_vmsplice)
+#endif
+      r = writev(pipe_fd, b->iov, n);
+    if (r <= 0)
+      return r;
+    // skip what was sent
+    size_t k = r;
+    while (k > 0 && k >= b->iov->iov_len) {
+      k -= b->iov->iov_len;
+      b->iov++;
+      b->iovcnt--;
+    }
+    if (k > 0) {
+      b->iov->iov_base = (char *) b->iov->iov_base + k;
+      b->iov->iov_len -= k;
+    }
+  } else {
+    size_t n = b->left;
+#ifdef __linux__
+    if (b->use_splice && !b->reader && b->buf_len == 0) {
+      r = splice(b->fd, b->off >= 0 ? &b->off : NULL, pipe_fd, NULL, n,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (r >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+	if (r == 0)
+	  b->left = 0;
+	goto sent;
+      }
+      b->use_splice = 0;
+    }
+#endif
+    // copy through a buffer
+    if (b->buf_off == b->buf_len) {
+      if (!b->buf && !(b->buf = malloc(LMW_BODY_BUFFER)))
+	return -1;
+      if (n > LMW_BODY_BUFFER)
+	n = LMW_BODY_BUFFER;
+      r = __LMW__body_read(b, b->buf, n, b->off);
+      if (r <= 0) {
+	if (r == 0)
+	  b->left = 0;
+	return r;
+      }
+      if (b->off >= 0)
+	b->off += r;
+      b->buf_off = 0;
+      b->buf_len = r;
+      b->last = (unsigned char) b->buf[r - 1];
+    }
+    r = write(pipe_fd, b->buf + b->buf_off, b->buf_len - b->buf_off);
+    if (r <= 0)
+      return r;
+    b->buf_off += r;
+  }
+#ifdef __linux__
+ sent:
+#endif
+  if (r > 0) {
+    b->sent += r;
+    if (b->left != SIZE_MAX)
+      b->left -= r;
+  }
+  return r;
+}
+
+/* the whole body in one string, for cfg->backend ; NULL on failure */
+static char *__LMW__body_gather(__LMW_body *b)
+{
+  if (b->fd < 0 && !b->reader && b->iov == &b->one)
+    return b->iov->iov_base;
+  size_t len = 0, cap = b->left != SIZE_MAX ? b->left + 1 : LMW_BODY_BUFFER;
+  char *s = malloc(cap);
+  if (!s)
+    return NULL;
+  if (b->fd < 0 && !b->reader) {
+    for (int j = 0; j < b->iovcnt; j++) {
+      memcpy(s + len, b->iov[j].iov_base, b->iov[j].iov_len);
+      len += b->iov[j].iov_len;
+    }
+  } else {
+    ssize_t r;
+    // a body of known size fits exactly; a short one is sent as it is, a failure not at all
+    while (b->left == SIZE_MAX || len < b->left) {
+      if (len + 1 == cap) {
+	char *t = realloc(s, cap *= 2);
+	if (!t) {
+	  free(s);
+	  return NULL;
+	}
+	s = t;
+      }
+      size_t n = cap - 1 - len;
+      if (b->left != SIZE_MAX && n > b->left - len)
+	n = b->left - len;
+      r = __LMW__body_read(b, s + len, n, b->off >= 0 ? b->off + (off_t) len : -1);
+      if (r < 0 && !b->reader && errno == EINTR)
+	continue;
+      if (r < 0) {
+	free(s);
+	return NULL;
+      }
+      if (r == 0)
+	break;
+      len += r;
     }
-    count++;
-    wp = waitpid(pid, &status, WNOHANG);
-  }   while (wp == 0 && count < max_wait);
-  if (wp == 0) {
-    // Still running, force kill
-    LMW_log_error("Killing child emailer, pid %d\n", pid);
-    kill(pid, SIGKILL);
-    waitpid(pid, NULL, 0); // This should not block after SIGKILL
   }
+  s[len] = 0;
+  return s;
 }
 
 /***
@@ -182,146 +2073,183 @@ int LMW_send_email(LMW_config *cfg, char *recipient, char *subject, char *body)
 
 
 int LMW_send_email_argc(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, ...) {
-    char **argv = calloc(sizeof(char *), argc+1);
+    if (argc < 0) {
+      LMW_log_error("Invalid argc passed to LMW_send_email_argc\n");
+      LMW_count_failure();
+      return LMW_ERROR_CANNOT_CALL;
+    }
+    // the arguments are used as they are, but the longer ones, that are
+    // cut to LMW_SEND_EMAIL_MAX_LEN_ARGS in a single buffer
+    char *argv[argc + 1], *cut = NULL;
+    size_t len[argc + 1], cut_len = 0;
+    int null = 0;
     va_list ap;
     va_start(ap, argc);
     for (int j = 0; j < argc; j++) {
-      argv[j] = strndup(va_arg(ap, char *), LMW_SEND_EMAIL_MAX_LEN_ARGS);
+      argv[j] = va_arg(ap, char *);
+      null |= !argv[j];
+      len[j] = argv[j] ? strnlen(argv[j], LMW_SEND_EMAIL_MAX_LEN_ARGS + 1) : 0;
+      if (len[j] > LMW_SEND_EMAIL_MAX_LEN_ARGS)
+	cut_len += LMW_SEND_EMAIL_MAX_LEN_ARGS + 1;
     }
     va_end(ap);
     argv[argc] = NULL;
+    if (null) {
+      LMW_log_error("Null parameter passed to LMW_send_email_argc\n");
+      LMW_count_failure();
+      return LMW_ERROR_CANNOT_CALL;
+    }
+    if (cut_len && !(cut = malloc(cut_len))) {
+      LMW_log_error("Failure in allocating the arguments of the mailer\n");
+      LMW_count_failure();
+      return LMW_ERROR_CANNOT_CALL;
+    }
+    for (int j = 0, k = 0; j < argc; j++)
+      if (len[j] > LMW_SEND_EMAIL_MAX_LEN_ARGS) {
+	char *c = cut + k++ * (LMW_SEND_EMAIL_MAX_LEN_ARGS + 1);
+	memcpy(c, argv[j], LMW_SEND_EMAIL_MAX_LEN_ARGS);
+	c[LMW_SEND_EMAIL_MAX_LEN_ARGS] = 0;
+	argv[j] = c;
+      }
     int ret = LMW_send_email_argv(cfg, recipient, subject, body, argc, argv);
-    for(int j=0; j< argc; j++)
-      free(argv[j]);
-    free(argv);
+    free(cut);
     return ret;
 }
 
-int LMW_send_email_argv(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+// as subject: the body is the whole message, see LMW_send_message_pull()
+static char __LMW_whole_message[] = "";
+
+static int __LMW_run_mailer__(LMW_config *cfg, char *recipient, char *subject, __LMW_body *body, int argc, char *argv[],
+			      LMW_result *res, long long t) {
+    int whole = subject == __LMW_whole_message;
     int pipefd[2];
     pid_t pid;
     char *mailer = cfg ? cfg->mailer : LMW_MAILER;
-    int max_wait = cfg ? cfg->max_wait : LMW_MAX_WAIT;
 
-    // Temporary file descriptors and paths
-    int stdout_fd = -1, stderr_fd = -1;
-    char stdout_path[] = "/tmp/lmw_stdout_XXXXXX";
-    char stderr_path[] = "/tmp/lmw_stderr_XXXXXX";
+    // receive stdout and stderr of the mailer
+    __LMW_capture cap;
 
     // Handle null parameters
     if (!recipient || !subject || !body) {
         LMW_log_error("Null parameter passed to LMW_send_email\n");
-        if (cfg) cfg->failures++;
+        LMW_count_failure();
         return LMW_ERROR_CANNOT_CALL;
     }
 
-    // Create temporary files for stdout and stderr
-    stdout_fd = mkstemp(stdout_path);
-    if (stdout_fd == -1) {
-        LMW_log_error("Failed to create temporary file for stdout: %d %s\n", errno, strerror(errno));
-        if (cfg) cfg->failures++;
+    if (cfg && cfg->backend) {
+      if (whole) {
+        LMW_log_error("A whole message cannot be sent by cfg->backend\n");
+        LMW_count_failure();
+        return LMW_ERROR_CANNOT_CALL;
+      }
+      char *b = __LMW__body_gather(body);
+      if (!b) {
+        LMW_log_error("Failure in reading the body of the email\n");
+        LMW_count_failure();
         return LMW_ERROR_CANNOT_CALL;
+      }
+      int ret = cfg->backend(cfg, recipient, subject, b, argc, argv, res);
+      if (b != body->one.iov_base)
+        free(b);
+      return ret;
     }
-   
-    stderr_fd = mkstemp(stderr_path);
-    if (stderr_fd == -1) {
-        LMW_log_error("Failed to create temporary file for stderr: %d %s\n", errno, strerror(errno));
-        close(stdout_fd);
-        unlink(stdout_path);
-        if (cfg) cfg->failures++;
+
+    if (__LMW__capture_open(&cap, cfg) == -1) {
+        LMW_count_failure();
         return LMW_ERROR_CANNOT_CALL;
     }
+    __LMW__stats_phase(cfg, LMW_PHASE_CAPTURE, &t);
 
     // create the pipe for the body
-    if (pipe(pipefd) == -1) {
+    if (__LMW__pipe_cloexec(pipefd) == -1) {
       LMW_log_error("Failure in creating pipe to send email: %d %s\n", errno, strerror(errno));
-      close(stdout_fd);
-      close(stderr_fd);
-      unlink(stdout_path);
-      unlink(stderr_path);
-      if (cfg) cfg->failures ++;
+      __LMW_clean_up_capture(&cap, res, cfg);
+      LMW_count_failure();
       return LMW_ERROR_CANNOT_CALL;
     }
 
+    __LMW__stats_phase(cfg, LMW_PHASE_PIPE, &t);
+
     // Make write end non-blocking to help avoid SIGPIPE issues
     if (__LMW__make_nonblocking(pipefd[1]) == -1) {
         LMW_log_error("Warning: could not make pipe non-blocking: %d %s\n", errno, strerror(errno));
         // Continue anyway - this is not fatal
     }
     
-    pid = fork();
+    char *args[5+argc];
+    int k = 0;
+    args[k++] = mailer;
+    if (!whole) {
+      args[k++] = "-s";
+      args[k++] = subject;
+    }
+    for(int j=0; j<argc; j++)
+      args[k++] = argv[j];
+    if (!whole)
+      args[k++] = recipient;
+    args[k] = NULL;
+
+    int exec_errno;
+    pid = __LMW__spawn_child__(cfg, args, pipefd[0], pipefd[1], cap.child[0], cap.child[1], &exec_errno);
+    __LMW__capture_spawned(&cap);
     if (pid == -1) {
       LMW_log_error("Failure in forking child that should send email: %d %s\n",
 		    errno, strerror(errno));
       close(pipefd[0]);
       close(pipefd[1]);
-      close(stdout_fd);
-      close(stderr_fd);
-      unlink(stdout_path);
-      unlink(stderr_path);
-      if (cfg) cfg->failures++;
+      __LMW_clean_up_capture(&cap, res, cfg);
+      LMW_count_failure();
       return LMW_ERROR_CANNOT_CALL;
     }
 
-    if (pid == 0) {
-        // Child process
-        close(pipefd[1]);    // Close write end
-        dup2(pipefd[0], STDIN_FILENO); // Redirect pipe read end to stdin
-        close(pipefd[0]);
-
-        // Save original stdout,stderr before redirecting (for error reporting if exec fails)
-        int orig_stdout = dup(STDOUT_FILENO);
-        int orig_stderr = dup(STDERR_FILENO);
-
-        // Redirect stdout and stderr to temporary files
-        dup2(stdout_fd, STDOUT_FILENO);
-        dup2(stderr_fd, STDERR_FILENO);
-        close(stdout_fd);
-        close(stderr_fd);
-
-	char *args[5+argc];
-	args[0] = mailer;
-	args[1] = "-s";
-	args[2] = subject;
-	for(int j=0; j<argc; j++)
-	  args[3+j] = argv[j];
-	args[3 + argc] =  recipient;
-	args[4 + argc] =  NULL;
-
-        execvp(args[0], args);
-        // If we get here, exec failed
-        int saved_errno = errno; // Save errno before any system calls
-	dup2(orig_stdout, STDOUT_FILENO); // Restore original stdout
-        dup2(orig_stderr, STDERR_FILENO); // Restore original stderr
-        close(orig_stdout);
-	close(orig_stderr);
-        LMW_log_error("Failure in exec child that should send email: %d %s\n", saved_errno, strerror(saved_errno));
-	// exit
-        _exit(LMW_CHILD_EXEC_FAILED);
+    if (exec_errno) {
+      LMW_log_error("Failure in exec child that should send email: %d %s\n", exec_errno, strerror(exec_errno));
+      close(pipefd[0]);
+      close(pipefd[1]);
+      __LMW_clean_up_capture(&cap, res, cfg);
+      LMW_count_failure();
+      return LMW_CHILD_EXEC_FAILED;
     }
+
     // Parent process
     close(pipefd[0]); // Close read end
+    int pidfd = __LMW__pidfd_open(pid);
+    __LMW__stats_phase(cfg, LMW_PHASE_SPAWN, &t);
 
-    // Save current SIGPIPE handler and ignore SIGPIPE temporarily
+    // Block SIGPIPE in this thread only
     // We'll detect broken pipe via write() return value
-    void (*old_sigpipe_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    __LMW_sigpipe sp;
+    __LMW__sigpipe_block(&sp);
 
-
-    // count how many time we sleep
-    int count = 0;
+    // sending the body and waiting for the child share the same deadline
+    const size_t body_len = body->left;
+    const int max_wait = __LMW__max_wait(cfg, body_len, NULL);
+    const long long start = __LMW__now_ns();
+    const long long deadline = start + max_wait * 1000000LL;
+    int timed_out = 0;
     int write_error = 0;
-    size_t l = strlen(body);
-    const size_t OL = l;
     ssize_t r;
-    char *b=body;
-    while(l>0 && count < max_wait) {
-      r = write(pipefd[1], b, l);
+    while(body->left>0) {
+      r = __LMW__body_send(pipefd[1], body);
+      if( r == 0)
+	break; // end of file
       if( r == -1) {
 	if (errno == EAGAIN || errno == EWOULDBLOCK) {
-	  // Non-blocking write would block, wait a bit and try again
-	  usleep(1000);
-	  count ++;
+	  // Non-blocking write would block, wait until the pipe drains or the child exits
+	  if (__LMW__now_ns() >= deadline) {
+	    timed_out = 1;
+	    break;
+	  }
+	  if (__LMW__wait_events__(pipefd[1], POLLOUT, pidfd, &cap, deadline) == 0 &&
+	      __LMW__child_exited__(pid)) {
+	    // the child exited, but someone else keeps the pipe open
+	    LMW_log_error("Child that should send email exited before reading the body\n");
+	    write_error = EPIPE;
+	    break;
+	  }
 	  continue;
+	} else if (body->reader_failed) {
+	  break;
 	} else if (errno == EPIPE) {
 	  LMW_log_error("Broken pipe when sending email body (child may have exited early)\n");
 	  write_error = errno;
@@ -332,15 +2260,29 @@ int LMW_send_email_argv(LMW_config *cfg, char *recipient, char *subject, char *b
 	  break;
 	}
       }
-      l += -r;
-      b +=  r;
+    }
+
+    if (body->reader_failed) {
+      // the mailer must not see EOF, or it would send a truncated email
+      LMW_log_error("Failure in the callback that produces the body of the email\n");
+      __LMW__kill_gracefully__(pid, pidfd, cfg);
+      close(pipefd[1]);
+      __LMW__sigpipe_unblock(&sp);
+      if (pidfd >= 0) close(pidfd);
+      LMW_count_failure();
+      __LMW_clean_up_capture(&cap, res, cfg);
+      return LMW_ERROR_CANNOT_CALL;
     }
 
 
     
     // Add a final newline if the body doesn't end with one and we haven't had errors
-    if (!write_error && OL > 0 && body[OL - 1] != '\n') {
-        if (write(pipefd[1], "\n", 1) == -1) {
+    if (!write_error && !timed_out && body->last >= 0 && body->last != '\n') {
+        // the body may have just filled the pipe: unless late, wait for room
+        while ((r = write(pipefd[1], "\n", 1)) == -1 && errno == EAGAIN &&
+               __LMW__now_ns() < deadline)
+            __LMW__wait_events__(pipefd[1], POLLOUT, pidfd, &cap, deadline);
+        if (r == -1) {
             if (errno != EPIPE) {
                 LMW_log_error("Failed to write final newline: %d %s\n", errno, strerror(errno));
             }
@@ -349,62 +2291,1018 @@ int LMW_send_email_argv(LMW_config *cfg, char *recipient, char *subject, char *b
     }
     
     close(pipefd[1]); // EOF for child process input
+    __LMW__stats_phase(cfg, LMW_PHASE_WRITE, &t);
 
-    // Restore previous SIGPIPE handler
-    signal(SIGPIPE, old_sigpipe_handler);
+    // Discard our SIGPIPE, if any, and unblock it
+    __LMW__sigpipe_unblock(&sp);
 
-    if (count == max_wait) {
+    if (timed_out) {
       LMW_log_error("Timeout in piping to child that should send email, only %lu of %lu sent, waited %d ms\n",
-		    OL-l, OL, count);
+		    (unsigned long) body->sent, (unsigned long) (body->sent + body->left),
+		    (int)((__LMW__now_ns() - start) / 1000000));
     }
 
     pid_t wp;
     int status;
-    if (count == max_wait || write_error) {
+    if (timed_out)
+      __LMW__timeout_record(cfg, body_len, __LMW__now_ns() - start);
+    if (timed_out || write_error) {
       // try to obtain the reason why
-      usleep(1000);
-      wp = waitpid(pid, &status, WNOHANG);
+      wp = __LMW__wait_child__(pid, pidfd, &cap, &status,
+			       __LMW__now_ns() + LMW_REASON_WAIT * 1000000LL);
       if (wp == pid ) {
-	__LMW_clean_up_tmp(stdout_fd, stderr_fd, stdout_path, stderr_path, cfg);
+	if (pidfd >= 0) close(pidfd);
+	__LMW_clean_up_capture(&cap, res, cfg);
 	return __LMW__process_exit_status__(status, cfg);
       }
-      __LMW__kill_gracefully__(pid, count, max_wait, cfg);
-      if (cfg) cfg->failures++;
-      __LMW_clean_up_tmp(stdout_fd, stderr_fd, stdout_path, stderr_path, cfg);
+      __LMW__kill_gracefully__(pid, pidfd, cfg);
+      if (pidfd >= 0) close(pidfd);
+      LMW_count_failure();
+      __LMW_clean_up_capture(&cap, res, cfg);
       return write_error ? LMW_ERROR_PIPE : LMW_ERROR_TIMEOUT;
     }
     
     // Wait specifically for the child process
-    wp = waitpid(pid, &status, WNOHANG);
-    while ( wp == 0 && count <  max_wait) {
-      if ( usleep(1000) != 0) {
-	LMW_log_error("Error in usleep: %d %s\n", errno, strerror(errno));
-	break;
-      }
-      wp = waitpid(pid, &status, WNOHANG);
-      count++;
-    }
+    wp = __LMW__wait_child__(pid, pidfd, &cap, &status, deadline);
+    __LMW__stats_phase(cfg, LMW_PHASE_WAIT, &t);
+    int waited = (int)((__LMW__now_ns() - start) / 1000000);
+    if (wp != -1)
+      __LMW__timeout_record(cfg, body_len, __LMW__now_ns() - start);
     
     if ( wp == 0) {
-      LMW_log_error("Timeout in waiting for child that should send email, waited %d ms\n", count);
-      __LMW__kill_gracefully__(pid, count, max_wait, cfg);
-      if (cfg) cfg->failures ++;
-      __LMW_clean_up_tmp(stdout_fd, stderr_fd, stdout_path, stderr_path, cfg);
+      LMW_log_error("Timeout in waiting for child that should send email, waited %d ms\n", waited);
+      __LMW__kill_gracefully__(pid, pidfd, cfg);
+      if (pidfd >= 0) close(pidfd);
+      LMW_count_failure();
+      __LMW_clean_up_capture(&cap, res, cfg);
       return LMW_ERROR_TIMEOUT;
     }
+    if (pidfd >= 0) close(pidfd);
     
 #ifdef LMW_DEBUG
-    LMW_log_error("For child that should send email, waited %d ms\n", count);
+    LMW_log_error("For child that should send email, waited %d ms\n", waited);
 #endif
 	
     if ( wp == -1) {
       LMW_log_error("Failure in waiting for child that should send email\n");
-      if (cfg) cfg->failures++;
-      __LMW_clean_up_tmp(stdout_fd, stderr_fd, stdout_path, stderr_path, cfg);
+      LMW_count_failure();
+      __LMW_clean_up_capture(&cap, res, cfg);
       return LMW_ERROR_CANNOT_CALL;
     }
 
-    __LMW_clean_up_tmp(stdout_fd, stderr_fd, stdout_path, stderr_path, cfg);
+    __LMW_clean_up_capture(&cap, res, cfg);
     return __LMW__process_exit_status__(status, cfg);
 }
 
+/* the subject for the mailer: if cfg->encode_subject and it is not ASCII,
+   encoded as in RFC 2047 in *encoded , that must be freed */
+static char *__LMW__subject(LMW_config *cfg, char *subject, char **encoded)
+{
+  *encoded = NULL;
+  if (cfg && cfg->encode_subject && subject && subject != __LMW_whole_message &&
+      (LMW_text_scan(subject, strlen(subject), 0) & LMW_SCAN_8BIT))
+    *encoded = LMW_header_encode(subject, 0);
+  return *encoded ? *encoded : subject;
+}
+
+/* runs the mailer, and records its total time */
+static int __LMW_send_email__(LMW_config *cfg, char *recipient, char *subject, __LMW_body *body, int argc, char *argv[],
+			      LMW_result *res) {
+  if (__LMW__headers_check(cfg, recipient, subject == __LMW_whole_message ? NULL : subject) != LMW_OK)
+    return LMW_ERROR_INVALID;
+  if (__LMW__rate_check(cfg, recipient) != LMW_OK)
+    return LMW_ERROR_RATE_LIMITED;
+  if (__LMW__breaker_enter(cfg) != LMW_OK) {
+    __LMW__rate_cancel(cfg, recipient);
+    return LMW_ERROR_CIRCUIT_OPEN;
+  }
+  long long t = 0;
+  __LMW__stats_phase(cfg, LMW_PHASE_TOTAL, &t);
+  long long start = t;
+  char *encoded;
+  int ret = __LMW_run_mailer__(cfg, recipient, __LMW__subject(cfg, subject, &encoded), body, argc, argv, res, t);
+  free(encoded);
+  __LMW__stats_phase(cfg, LMW_PHASE_TOTAL, &start);
+  // a body that the caller could not produce says nothing about the mailer
+  if (body && !body->reader_failed)
+    __LMW__breaker_leave(cfg, ret);
+  return ret;
+}
+
+int LMW_send_email_argv(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+  __LMW_body b;
+  if (body)
+    __LMW__body_string(&b, body);
+  return __LMW_send_email__(cfg, recipient, subject, body ? &b : NULL, argc, argv, NULL);
+}
+
+int LMW_send_email_argv_result(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+			       LMW_result *res) {
+  __LMW_body b;
+  if (body)
+    __LMW__body_string(&b, body);
+  *res = (LMW_result) { 0 };
+  res->code = __LMW_send_email__(cfg, recipient, subject, body ? &b : NULL, argc, argv, res);
+  return res->code;
+}
+
+int LMW_send_email_fd(LMW_config *cfg, char *recipient, char *subject, int fd, off_t offset, size_t len,
+		      int argc, char *argv[]) {
+  __LMW_body b;
+  if (__LMW__body_fd(&b, fd, offset, len) == -1) {
+    LMW_log_error("Cannot use file descriptor %d as body of the email: %d %s\n", fd, errno, strerror(errno));
+    LMW_count_failure();
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  int ret = __LMW_send_email__(cfg, recipient, subject, &b, argc, argv, NULL);
+  __LMW__body_free(&b);
+  return ret;
+}
+
+int LMW_send_email_fd_result(LMW_config *cfg, char *recipient, char *subject, int fd, off_t offset, size_t len,
+			     int argc, char *argv[], LMW_result *res) {
+  __LMW_body b;
+  *res = (LMW_result) { 0 };
+  if (__LMW__body_fd(&b, fd, offset, len) == -1) {
+    LMW_log_error("Cannot use file descriptor %d as body of the email: %d %s\n", fd, errno, strerror(errno));
+    LMW_count_failure();
+    return res->code = LMW_ERROR_CANNOT_CALL;
+  }
+  res->code = __LMW_send_email__(cfg, recipient, subject, &b, argc, argv, res);
+  __LMW__body_free(&b);
+  return res->code;
+}
+
+int LMW_send_email_pull(LMW_config *cfg, char *recipient, char *subject, LMW_body_reader reader, void *ctx,
+			int argc, char *argv[]) {
+  __LMW_body b;
+  if (!reader) {
+    LMW_log_error("Null parameter passed to LMW_send_email_pull\n");
+    LMW_count_failure();
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  __LMW__body_reader(&b, reader, ctx);
+  int ret = __LMW_send_email__(cfg, recipient, subject, &b, argc, argv, NULL);
+  __LMW__body_free(&b);
+  return ret;
+}
+
+int LMW_send_message_pull(LMW_config *cfg, char *recipient, LMW_body_reader reader, void *ctx,
+			  int argc, char *argv[]) {
+  __LMW_body b;
+  if (!reader) {
+    LMW_log_error("Null parameter passed to LMW_send_message_pull\n");
+    LMW_count_failure();
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  __LMW__body_reader(&b, reader, ctx);
+  int ret = __LMW_send_email__(cfg, recipient ? recipient : "", __LMW_whole_message, &b, argc, argv, NULL);
+  __LMW__body_free(&b);
+  return ret;
+}
+
+int LMW_send_email_iov(LMW_config *cfg, char *recipient, char *subject, const struct iovec *iov, int iovcnt,
+		       int argc, char *argv[]) {
+  __LMW_body b;
+  if (!iov || iovcnt < 0 || __LMW__body_iov(&b, iov, iovcnt) == -1) {
+    LMW_log_error("Invalid body passed to LMW_send_email_iov\n");
+    LMW_count_failure();
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  int ret = __LMW_send_email__(cfg, recipient, subject, &b, argc, argv, NULL);
+  __LMW__body_free(&b);
+  return ret;
+}
+
+/* ========== IO_URING ========== */
+
+#ifdef LMW_IO_URING
+/*
+  With `make IO_URING=1`, LMW_send_email_batch() drives all its mailers
+  with one io_uring(7): the writes of the bodies and the polls of the pidfds
+  of all mailers are queued together, and a single io_uring_enter(2)
+  submits them and waits for the first completion or deadline.
+  liburing is not needed, the three system calls are made directly;
+  if the kernel refuses the ring (or is older than 5.11), the poll(2)
+  loop is used instead.
+*/
+
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t rings_len, sqes_len;
+  unsigned tail;        // our copy of *sq_tail, published by __LMW__ring_enter()
+} __LMW_ring;
+
+static int __LMW__ring_open(__LMW_ring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd == -1)
+    return -1;
+  // a single mapping for both rings needs Linux 5.4, a timeout in io_uring_enter(2) needs 5.11
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  ring->rings_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  if (ring->rings_len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+    ring->rings_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->rings = mmap(NULL, ring->rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES);
+  if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    int e = errno;
+    if (ring->rings != MAP_FAILED) munmap(ring->rings, ring->rings_len);
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    close(ring->fd);
+    errno = e;
+    return -1;
+  }
+  char *r = ring->rings;
+  ring->sq_head = (unsigned *) (r + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (r + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (r + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (r + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned *) (r + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (r + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (r + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (r + p.cq_off.cqes);
+  ring->tail = *ring->sq_tail;
+  return 0;
+}
+
+static void __LMW__ring_close(__LMW_ring *ring)
+{
+  munmap(ring->sqes, ring->sqes_len);
+  munmap(ring->rings, ring->rings_len);
+  close(ring->fd);
+}
+
+/* queue a request; returns NULL if the submission queue is full */
+static struct io_uring_sqe *__LMW__ring_push(__LMW_ring *ring, int opcode, int fd, unsigned long long data)
+{
+  if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    return NULL;
+  unsigned ix = ring->tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[ix];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = data;
+  ring->sq_array[ix] = ix;
+  ring->tail++;
+  return sqe;
+}
+
+/* submit the queued requests, and wait for a completion until `deadline` */
+static int __LMW__ring_enter(__LMW_ring *ring, long long deadline)
+{
+  long long left = deadline - __LMW__now_ns();
+  if (left < 0)
+    left = 0;
+  struct __kernel_timespec ts = { .tv_sec = left / 1000000000LL, .tv_nsec = left % 1000000000LL };
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (unsigned long long) (uintptr_t) &ts;
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  unsigned queued = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  int r = syscall(__NR_io_uring_enter, ring->fd, queued, 1,
+		  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (r == -1 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+    return 0;
+  return r;
+}
+
+/* the next completion; returns 0 if there is none */
+static int __LMW__ring_cqe(__LMW_ring *ring, unsigned long long *data, int *res)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+#endif // LMW_IO_URING
+
+/* ========== BATCH ========== */
+
+// one email of the batch, while its mailer runs
+typedef struct {
+  LMW_batch_msg *msg;
+  pid_t pid;
+  int pidfd;
+  int fd;              // write end of the pipe, -1 when closed
+  char *b;             // what is left of the body
+  size_t l;
+  size_t body_len;     // all of it, for the adaptive timeout
+  int newline;         // a final newline must still be sent
+  long long start, deadline;
+  int timed_out, write_error;
+  unsigned long long id;  // identifies the io_uring requests of this email
+  int writing, polling;   // io_uring requests in flight
+  int async;              // must not block: a mailer that timed out is killed over later calls
+  int killing;            // 1 after SIGTERM, 2 after SIGKILL, when `async`
+  __LMW_capture cap;      // stdout and stderr of this mailer
+  int cap_pfd, cap_n;     // where its pipes are in the poll(2) set
+  int reading[2];         // io_uring polls of its pipes in flight
+} __LMW_batch_job;
+
+/* start the mailer for one email; returns 0, or -1 and sets msg->code ;
+   the pipe is left blocking for io_uring, that would not wait on a non-blocking one */
+static int __LMW__batch_start(LMW_config *cfg, __LMW_batch_job *j, LMW_batch_msg *m,
+			      int argc, char *argv[], int blocking)
+{
+  int pipefd[2];
+  j->msg = m;
+  if (!m->recipient || !m->subject || !m->body) {
+    LMW_log_error("Null parameter passed to LMW_send_email_batch\n");
+    LMW_count_failure();
+    m->code = LMW_ERROR_CANNOT_CALL;
+    return -1;
+  }
+  if (__LMW__headers_check(cfg, m->recipient, m->subject) != LMW_OK) {
+    m->code = LMW_ERROR_INVALID;
+    return -1;
+  }
+  if (__LMW__rate_check(cfg, m->recipient) != LMW_OK) {
+    m->code = LMW_ERROR_RATE_LIMITED;
+    return -1;
+  }
+  if (__LMW__breaker_enter(cfg) != LMW_OK) {
+    __LMW__rate_cancel(cfg, m->recipient);
+    m->code = LMW_ERROR_CIRCUIT_OPEN;
+    return -1;
+  }
+  if (__LMW__capture_open(&j->cap, cfg) == -1) {
+    LMW_count_failure();
+    m->code = LMW_ERROR_CANNOT_CALL;
+    __LMW__breaker_leave(cfg, m->code);
+    return -1;
+  }
+  if (__LMW__pipe_cloexec(pipefd) == -1) {
+    LMW_log_error("Failure in creating pipe to send email: %d %s\n", errno, strerror(errno));
+    __LMW_clean_up_capture(&j->cap, NULL, cfg);
+    LMW_count_failure();
+    m->code = LMW_ERROR_CANNOT_CALL;
+    __LMW__breaker_leave(cfg, m->code);
+    return -1;
+  }
+  if (!blocking)
+    __LMW__make_nonblocking(pipefd[1]);
+
+  char *args[5+argc], *encoded;
+  args[0] = cfg ? cfg->mailer : LMW_MAILER;
+  args[1] = "-s";
+  args[2] = __LMW__subject(cfg, m->subject, &encoded);
+  for(int k=0; k<argc; k++)
+    args[3+k] = argv[k];
+  args[3 + argc] = m->recipient;
+  args[4 + argc] = NULL;
+
+  int exec_errno;
+  j->start = __LMW__now_ns();
+  j->pid = __LMW__spawn_child__(cfg, args, pipefd[0], pipefd[1], j->cap.child[0], j->cap.child[1], &exec_errno);
+  free(encoded);
+  close(pipefd[0]);
+  __LMW__capture_spawned(&j->cap);
+  if (j->pid == -1 || exec_errno) {
+    if (j->pid == -1) {
+      LMW_log_error("Failure in forking child that should send email: %d %s\n", errno, strerror(errno));
+    } else {
+      LMW_log_error("Failure in exec child that should send email: %d %s\n", exec_errno, strerror(exec_errno));
+    }
+    close(pipefd[1]);
+    __LMW_clean_up_capture(&j->cap, NULL, cfg);
+    LMW_count_failure();
+    m->code = (j->pid == -1) ? LMW_ERROR_CANNOT_CALL : LMW_CHILD_EXEC_FAILED;
+    __LMW__breaker_leave(cfg, m->code);
+    return -1;
+  }
+  j->pidfd = __LMW__pidfd_open(j->pid);
+  j->fd = pipefd[1];
+  j->b = m->body;
+  j->l = j->body_len = strlen(m->body);
+  j->newline = j->l > 0 && m->body[j->l - 1] != '\n';
+  j->deadline = __LMW__now_ns() + __LMW__max_wait(cfg, j->body_len, NULL) * 1000000LL;
+  j->timed_out = j->write_error = 0;
+  j->writing = j->polling = 0;
+  j->reading[0] = j->reading[1] = 0;
+  j->cap_n = 0;
+  j->async = j->killing = 0;
+  return 0;
+}
+
+/* account for a write of `r` bytes of the body (or of the final newline),
+   or for a failed write (r == -1) with error `err` ;
+   closes the pipe when all is sent, or on failure; returns 1 if more must be written */
+static int __LMW__batch_wrote(LMW_config *cfg, __LMW_batch_job *j, ssize_t r, int err)
+{
+  if (r == -1) {
+    if (err == EPIPE) {
+      LMW_log_error("Broken pipe when sending email body (child may have exited early)\n");
+    } else {
+      LMW_log_error("Failure in piping body to send email: %d %s\n", err, strerror(err));
+    }
+    j->write_error = err;
+  } else if (j->l > 0) {
+    j->l -= r;
+    j->b += r;
+  } else
+    j->newline = 0;
+  if (!j->write_error && (j->l > 0 || j->newline))
+    return 1;
+  close(j->fd);
+  j->fd = -1;
+  if (j->write_error) {
+    // wait a bit for the exit status, that explains the failure
+    j->deadline = __LMW__now_ns() + LMW_REASON_WAIT * 1000000LL;
+  }
+  return 0;
+}
+
+/* send as much of the body as the pipe accepts, close it when all is sent */
+static void __LMW__batch_write(LMW_config *cfg, __LMW_batch_job *j)
+{
+  ssize_t r;
+  do {
+    if (j->l > 0)
+      r = write(j->fd, j->b, j->l);
+    else
+      r = j->newline ? write(j->fd, "\n", 1) : 0;
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+  } while ((r == -1 && errno == EINTR) || __LMW__batch_wrote(cfg, j, r, errno));
+}
+
+/* the mailer did not finish in time; returns 1 if the job is over */
+static int __LMW__batch_expired(LMW_config *cfg, __LMW_batch_job *j)
+{
+  if (j->killing) {
+    // it did not terminate in the grace time
+    if (j->killing == 1) {
+      LMW_log_error("Killing child emailer, pid %d\n", j->pid);
+      kill(j->pid, SIGKILL);
+      j->killing = 2;
+    }
+    j->deadline = __LMW__now_ns() + LMW_KILL_GRACE * 1000000LL;
+    return 0;
+  }
+  if (j->fd >= 0) {
+    LMW_log_error("Timeout in piping to child that should send email, only %lu of %lu sent, waited %d ms\n",
+		  (unsigned long) (j->b - j->msg->body), (unsigned long) strlen(j->msg->body),
+		  (int)((__LMW__now_ns() - j->start) / 1000000));
+    close(j->fd);
+    j->fd = -1;
+    j->timed_out = 1;
+    __LMW__timeout_record(cfg, j->body_len, __LMW__now_ns() - j->start);
+    j->deadline = __LMW__now_ns() + LMW_REASON_WAIT * 1000000LL;
+    return 0;
+  }
+  if (!j->timed_out && !j->write_error) {
+    __LMW__timeout_record(cfg, j->body_len, __LMW__now_ns() - j->start);
+    LMW_log_error("Timeout in waiting for child that should send email, waited %d ms\n",
+		  (int)((__LMW__now_ns() - j->start) / 1000000));
+  }
+  LMW_count_failure();
+  j->msg->code = j->write_error ? LMW_ERROR_PIPE : LMW_ERROR_TIMEOUT;
+  if (j->async) {
+    LMW_log_error("Terminating child emailer, pid %d\n", j->pid);
+    kill(j->pid, SIGTERM);
+    j->killing = 1;
+    j->deadline = __LMW__now_ns() + LMW_KILL_GRACE * 1000000LL;
+    return 0;
+  }
+  __LMW__kill_gracefully__(j->pid, j->pidfd, cfg);
+  return 1;
+}
+
+/* collect the mailer if it exited, or expire the job; returns 1 if the job is over */
+static int __LMW__batch_reap(LMW_config *cfg, __LMW_batch_job *j, long long now)
+{
+  int status;
+  pid_t wp = waitpid(j->pid, &status, WNOHANG);
+  if (wp == j->pid) {
+    if (j->killing)
+      return 1;  // the code is already set
+    if (j->fd >= 0) {
+      LMW_log_error("Child that should send email exited before reading the body\n");
+    } else if (!j->timed_out && !j->write_error)
+      __LMW__timeout_record(cfg, j->body_len, now - j->start);
+    j->msg->code = __LMW__process_exit_status__(status, cfg);
+    return 1;
+  }
+  if (wp == -1) {
+    LMW_log_error("Failure in waiting for child that should send email\n");
+    LMW_count_failure();
+    j->msg->code = LMW_ERROR_CANNOT_CALL;
+    return 1;
+  }
+  if (now >= j->deadline)
+    return __LMW__batch_expired(cfg, j);
+  return 0;
+}
+
+/* the job is over: its output goes to `res` , or is logged if NULL */
+static void __LMW__batch_end(LMW_config *cfg, __LMW_batch_job *j, LMW_result *res)
+{
+  if (j->fd >= 0) close(j->fd);
+  if (j->pidfd >= 0) close(j->pidfd);
+  __LMW_clean_up_capture(&j->cap, res, cfg);
+  __LMW__stats_phase(cfg, LMW_PHASE_TOTAL, &j->start);
+  __LMW__breaker_leave(cfg, j->msg->code);
+}
+
+static void __LMW__batch_poll(LMW_config *cfg, LMW_batch_msg *msgs, int n, __LMW_batch_job *jobs, int parallel,
+			      struct pollfd *pfd, int argc, char *argv[])
+{
+  int next = 0, running = 0;
+  while (next < n || running > 0) {
+    // keep `parallel` mailers busy
+    while (running < parallel && next < n) {
+      if (__LMW__batch_start(cfg, &jobs[running], &msgs[next++], argc, argv, 0) == 0) {
+	__LMW__batch_write(cfg, &jobs[running]);
+	running++;
+      }
+    }
+    if (running == 0)
+      break;
+
+    // wait for any pipe to drain, or any output, or any mailer to exit, or the first deadline
+    int np = 0, sigchld = 0;
+    long long deadline = jobs[0].deadline;
+    for (int k = 0; k < running; k++) {
+      __LMW_batch_job *j = &jobs[k];
+      if (j->fd >= 0)
+	pfd[np++] = (struct pollfd) { .fd = j->fd, .events = POLLOUT };
+      j->cap_pfd = np;
+      j->cap_n = __LMW__capture_pollfd(&j->cap, pfd + np);
+      np += j->cap_n;
+      if (j->pidfd >= 0)
+	pfd[np++] = (struct pollfd) { .fd = j->pidfd, .events = POLLIN };
+      else
+	sigchld = 1;
+      if (j->deadline < deadline)
+	deadline = j->deadline;
+    }
+    int timeout = __LMW__remaining_ms(deadline);
+    if (sigchld) {
+      pthread_once(&__LMW_sigchld_once, __LMW__sigchld_init);
+      if (__LMW_sigchld_pipe[0] >= 0)
+	pfd[np++] = (struct pollfd) { .fd = __LMW_sigchld_pipe[0], .events = POLLIN };
+      if (timeout > LMW_SIGCHLD_POLL)
+	timeout = LMW_SIGCHLD_POLL;
+    }
+    if (poll(pfd, np, timeout) == -1 && errno != EINTR) {
+      LMW_log_error("Failure in poll in LMW_send_email_batch: %d %s\n", errno, strerror(errno));
+    }
+    if (sigchld && __LMW_sigchld_pipe[0] >= 0) {
+      char buf[64];
+      while (read(__LMW_sigchld_pipe[0], buf, sizeof(buf)) > 0)
+	;
+    }
+
+    long long now = __LMW__now_ns();
+    for (int k = 0; k < running; k++) {
+      __LMW_batch_job *j = &jobs[k];
+      for (int i = 0; i < j->cap_n; i++)
+	if (pfd[j->cap_pfd + i].revents) {
+	  __LMW__capture_drain(&j->cap);
+	  break;
+	}
+      if (j->fd >= 0)
+	__LMW__batch_write(cfg, j);
+      if (__LMW__batch_reap(cfg, j, now)) {
+	__LMW__batch_end(cfg, j, NULL);
+	jobs[k--] = jobs[--running];
+      }
+    }
+  }
+}
+
+#ifdef LMW_IO_URING
+// the kind of an io_uring request, in the low bits of its user_data
+#define LMW_RING_WRITE  0
+#define LMW_RING_POLL   1
+#define LMW_RING_CANCEL 2
+#define LMW_RING_STDOUT 3 // polls of the output, not counted as in flight: the
+#define LMW_RING_STDERR 4 // kernel holds nothing of the caller for them
+#define LMW_RING_DRAIN  1000 // in milliseconds, waiting for the last requests at the end
+
+/* as __LMW__batch_poll() , with io_uring; returns -1 (and does nothing) if the ring is not available */
+static int __LMW__batch_uring(LMW_config *cfg, LMW_batch_msg *msgs, int n, __LMW_batch_job *jobs, int parallel,
+			      int argc, char *argv[])
+{
+  __LMW_ring ring;
+  // each mailer has at most a write, a poll, a cancel and two polls of its output in flight
+  if (__LMW__ring_open(&ring, 8 * parallel) == -1)
+    return -1;
+
+  unsigned long long ids = 0, data;
+  int next = 0, running = 0, inflight = 0, res;
+  while (next < n || running > 0) {
+    while (running < parallel && next < n) {
+      __LMW_batch_job *j = &jobs[running];
+      if (__LMW__batch_start(cfg, j, &msgs[next++], argc, argv, 1) == 0) {
+	j->id = ++ids;
+	if (j->l == 0 && !j->newline)
+	  __LMW__batch_wrote(cfg, j, 0, 0);   // empty body
+	running++;
+      }
+    }
+    if (running == 0)
+      break;
+
+    // queue the next write of each body, and a poll of each pidfd and of each pipe of the output
+    int sigchld = 0;
+    long long deadline = jobs[0].deadline;
+    for (int k = 0; k < running; k++) {
+      __LMW_batch_job *j = &jobs[k];
+      struct io_uring_sqe *sqe;
+      if (j->fd >= 0 && !j->writing &&
+	  (sqe = __LMW__ring_push(&ring, IORING_OP_WRITE, j->fd, j->id << 3 | LMW_RING_WRITE))) {
+	sqe->addr = (unsigned long long) (uintptr_t) (j->l > 0 ? j->b : "\n");
+	sqe->len = j->l > 0 ? (j->l > UINT_MAX ? UINT_MAX : j->l) : 1;
+	j->writing = 1;
+	inflight++;
+      }
+      if (j->pidfd >= 0 && !j->polling &&
+	  (sqe = __LMW__ring_push(&ring, IORING_OP_POLL_ADD, j->pidfd, j->id << 3 | LMW_RING_POLL))) {
+	sqe->poll32_events = POLLIN;
+	j->polling = 1;
+	inflight++;
+      }
+      for (int s = 0; s < 2; s++)
+	if (!j->cap.path[s][0] && j->cap.fd[s] >= 0 && !j->reading[s] &&
+	    (sqe = __LMW__ring_push(&ring, IORING_OP_POLL_ADD, j->cap.fd[s],
+				    j->id << 3 | (LMW_RING_STDOUT + s)))) {
+	  sqe->poll32_events = POLLIN;
+	  j->reading[s] = 1;
+	}
+      if (j->pidfd < 0)
+	sigchld = 1;
+      if (j->deadline < deadline)
+	deadline = j->deadline;
+    }
+    // without pidfds, exits are only noticed by calling waitpid() now and then
+    if (sigchld && deadline > __LMW__now_ns() + LMW_SIGCHLD_POLL * 1000000LL)
+      deadline = __LMW__now_ns() + LMW_SIGCHLD_POLL * 1000000LL;
+    if (__LMW__ring_enter(&ring, deadline) == -1) {
+      LMW_log_error("Failure in io_uring_enter in LMW_send_email_batch: %d %s\n", errno, strerror(errno));
+    }
+
+    while (__LMW__ring_cqe(&ring, &data, &res)) {
+      int kind = data & 7;
+      if (kind < LMW_RING_STDOUT)
+	inflight--;
+      __LMW_batch_job *j = NULL;
+      for (int k = 0; k < running && !j; k++)
+	if (jobs[k].id == data >> 3)
+	  j = &jobs[k];
+      if (!j || kind == LMW_RING_CANCEL)
+	continue;   // the job is over, or the write was cancelled
+      if (kind >= LMW_RING_STDOUT) {
+	j->reading[kind - LMW_RING_STDOUT] = 0;
+	__LMW__capture_drain(&j->cap);
+	continue;
+      }
+      if (kind == LMW_RING_POLL) {
+	j->polling = 0;   // the mailer exited, see below
+	continue;
+      }
+      j->writing = 0;
+      if (j->fd < 0 || res == -EAGAIN || res == -EINTR)
+	continue;
+      __LMW__batch_wrote(cfg, j, res < 0 ? -1 : res, -res);
+    }
+
+    long long now = __LMW__now_ns();
+    for (int k = 0; k < running; k++) {
+      __LMW_batch_job *j = &jobs[k];
+      struct io_uring_sqe *sqe;
+      // the kernel holds the pipe while writing: cancel, so that the mailer sees EOF
+      if (now >= j->deadline && j->fd >= 0 && j->writing &&
+	  (sqe = __LMW__ring_push(&ring, IORING_OP_ASYNC_CANCEL, -1, j->id << 3 | LMW_RING_CANCEL))) {
+	sqe->addr = j->id << 3 | LMW_RING_WRITE;
+	inflight++;
+      }
+      if (__LMW__batch_reap(cfg, j, now)) {
+	__LMW__batch_end(cfg, j, NULL);
+	jobs[k--] = jobs[--running];
+      }
+    }
+  }
+
+  // the kernel may still read the bodies, that belong to the caller
+  long long deadline = __LMW__now_ns() + LMW_RING_DRAIN * 1000000LL;
+  while (inflight > 0 && __LMW__now_ns() < deadline) {
+    __LMW__ring_enter(&ring, deadline);
+    while (__LMW__ring_cqe(&ring, &data, &res))
+      if ((data & 7) < LMW_RING_STDOUT)
+	inflight--;
+  }
+  __LMW__ring_close(&ring);
+  return 0;
+}
+#endif // LMW_IO_URING
+
+int LMW_send_email_batch(LMW_config *cfg, LMW_batch_msg *msgs, int n, int argc, char *argv[])
+{
+  int parallel = (cfg && cfg->batch_parallel > 0) ? cfg->batch_parallel : LMW_BATCH_PARALLEL;
+  int failed = 0;
+
+  if (cfg && cfg->backend) {
+    for (int k = 0; k < n; k++) {
+      LMW_batch_msg *m = &msgs[k];
+      if (!m->recipient || !m->subject || !m->body)
+	m->code = LMW_ERROR_CANNOT_CALL;
+      else if (__LMW__headers_check(cfg, m->recipient, m->subject) != LMW_OK)
+	m->code = LMW_ERROR_INVALID;
+      else if (__LMW__rate_check(cfg, m->recipient) != LMW_OK)
+	m->code = LMW_ERROR_RATE_LIMITED;
+      else if (__LMW__breaker_enter(cfg) != LMW_OK) {
+	__LMW__rate_cancel(cfg, m->recipient);
+	m->code = LMW_ERROR_CIRCUIT_OPEN;
+      } else {
+	char *encoded;
+	m->code = cfg->backend(cfg, m->recipient, __LMW__subject(cfg, m->subject, &encoded), m->body,
+			       argc, argv, NULL);
+	free(encoded);
+	__LMW__breaker_leave(cfg, m->code);
+      }
+      failed += (m->code != LMW_OK);
+    }
+    return failed;
+  }
+
+  if (parallel > n)
+    parallel = n;
+  // each mailer has its own capture of stdout and stderr
+  __LMW_batch_job *jobs = calloc(parallel, sizeof(__LMW_batch_job));
+  struct pollfd *pfd = calloc(4 * parallel + 1, sizeof(struct pollfd));
+  if (!jobs || !pfd) {
+    free(jobs);
+    free(pfd);
+    for (int k = 0; k < n; k++)
+      msgs[k].code = LMW_ERROR_CANNOT_CALL;
+    LMW_count_failure();
+    return n;
+  }
+
+  __LMW_sigpipe sp;
+  __LMW__sigpipe_block(&sp);
+
+#ifdef LMW_IO_URING
+  if (__LMW__batch_uring(cfg, msgs, n, jobs, parallel, argc, argv) == -1)
+#endif
+    __LMW__batch_poll(cfg, msgs, n, jobs, parallel, pfd, argc, argv);
+
+  __LMW__sigpipe_unblock(&sp);
+  free(jobs);
+  free(pfd);
+  for (int k = 0; k < n; k++)
+    failed += (msgs[k].code != LMW_OK);
+  return failed;
+}
+
+/* ========== ASYNC ========== */
+
+/*
+  An email sent with LMW_send_email_async() is a job of a batch of one,
+  advanced by LMW_async_step() instead of by a loop: its epoll fd watches
+  the pipe (one shot, re-armed while the body is being sent), the pidfd
+  (or, without pidfd, the SIGCHLD self-pipe), and a timerfd set to the
+  deadline of the job. A mailer that times out gets SIGTERM, and SIGKILL
+  at a later step, if it is still running after LMW_KILL_GRACE.
+  cfg->backend may block: it is called in a thread, that writes to an
+  eventfd, watched instead, when the email is done.
+*/
+struct LMW_async {
+  LMW_config *cfg;
+  LMW_batch_msg msg;
+  __LMW_batch_job job;
+  LMW_result *res;
+  int epfd, timerfd;
+  int sigchld;      // the SIGCHLD self-pipe is watched
+  int efd;          // with cfg->backend , the eventfd of the thread; else -1
+  pthread_t thread;
+  int argc;
+  char **argv;
+  int done;
+};
+
+#ifdef __linux__
+/* watch again what the job waits for */
+static void __LMW__async_arm(LMW_async *a)
+{
+  __LMW_batch_job *j = &a->job;
+  if (j->fd >= 0) {
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT };
+    epoll_ctl(a->epfd, EPOLL_CTL_MOD, j->fd, &ev);
+  }
+  long long when = a->done ? __LMW__now_ns() : j->deadline;
+  // without a pidfd, the exit is noticed only by calling waitpid() now and then
+  if (j->pidfd < 0 && !a->done && when > __LMW__now_ns() + LMW_SIGCHLD_POLL * 1000000LL)
+    when = __LMW__now_ns() + LMW_SIGCHLD_POLL * 1000000LL;
+  struct itimerspec it = { .it_value = { .tv_sec = when / 1000000000LL, .tv_nsec = when % 1000000000LL } };
+  if (it.it_value.tv_sec == 0 && it.it_value.tv_nsec == 0)
+    it.it_value.tv_nsec = 1;
+  timerfd_settime(a->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+}
+
+static void __LMW__async_finish(LMW_async *a)
+{
+  LMW_config *cfg = a->cfg;
+  if (a->sigchld) {
+    epoll_ctl(a->epfd, EPOLL_CTL_DEL, __LMW_sigchld_pipe[0], NULL);
+    a->sigchld = 0;
+  }
+  __LMW__batch_end(cfg, &a->job, a->res);
+  if (a->res)
+    a->res->code = a->msg.code;
+  a->done = 1;
+}
+
+static void *__LMW__async_backend(void *p)
+{
+  LMW_async *a = p;
+  LMW_batch_msg *m = &a->msg;
+  if (a->res)
+    m->code = LMW_send_email_argv_result(a->cfg, m->recipient, m->subject, m->body, a->argc, a->argv, a->res);
+  else
+    m->code = LMW_send_email_argv(a->cfg, m->recipient, m->subject, m->body, a->argc, a->argv);
+  if (eventfd_write(a->efd, 1) == -1) {
+    // cannot fail, the counter is far from overflow
+  }
+  return NULL;
+}
+#endif
+
+LMW_async *LMW_send_email_async(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+				LMW_result *res)
+{
+#ifdef __linux__
+  LMW_async *a = calloc(1, sizeof(LMW_async));
+  if (!a)
+    return NULL;
+  a->cfg = cfg;
+  a->res = res;
+  a->efd = -1;
+  a->argc = argc;
+  a->argv = argv;
+  a->msg = (LMW_batch_msg) { .recipient = recipient, .subject = subject, .body = body };
+  if (res)
+    memset(res, 0, sizeof(LMW_result));
+  a->epfd = epoll_create1(EPOLL_CLOEXEC);
+  a->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN };
+  if (a->epfd == -1 || a->timerfd == -1 || epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->timerfd, &ev) == -1) {
+    LMW_log_error("Failure in creating the fd for LMW_send_email_async: %d %s\n", errno, strerror(errno));
+    int e = errno;
+    if (a->epfd >= 0) close(a->epfd);
+    if (a->timerfd >= 0) close(a->timerfd);
+    free(a);
+    errno = e;
+    return NULL;
+  }
+
+  if (cfg && cfg->backend) {
+    a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    if (a->efd >= 0 && epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->efd, &ev) == 0 &&
+	pthread_create(&a->thread, NULL, __LMW__async_backend, a) == 0)
+      return a;
+    LMW_log_error("Failure in starting the thread for cfg->backend in LMW_send_email_async\n");
+    LMW_count_failure();
+    if (a->efd >= 0) close(a->efd);
+    a->efd = -1;
+    a->msg.code = LMW_ERROR_CANNOT_CALL;
+    if (res)
+      res->code = a->msg.code;
+    a->done = 1;
+    __LMW__async_arm(a);
+    return a;
+  }
+
+  __LMW_batch_job *j = &a->job;
+  if (__LMW__batch_start(cfg, j, &a->msg, argc, argv, 0) == -1) {
+    a->done = 1;
+  } else {
+    j->async = 1;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    epoll_ctl(a->epfd, EPOLL_CTL_ADD, j->fd, &ev);
+    ev.events = EPOLLIN;
+    // the output is read at each step; a pipe is closed, and so unwatched, at its end
+    struct pollfd cp[2];
+    for (int i = __LMW__capture_pollfd(&j->cap, cp); i-- > 0; )
+      epoll_ctl(a->epfd, EPOLL_CTL_ADD, cp[i].fd, &ev);
+    if (j->pidfd >= 0)
+      epoll_ctl(a->epfd, EPOLL_CTL_ADD, j->pidfd, &ev);
+    else {
+      pthread_once(&__LMW_sigchld_once, __LMW__sigchld_init);
+      if (__LMW_sigchld_pipe[0] >= 0 && epoll_ctl(a->epfd, EPOLL_CTL_ADD, __LMW_sigchld_pipe[0], &ev) == 0)
+	a->sigchld = 1;
+    }
+  }
+  if (a->done && res)
+    res->code = a->msg.code;
+  // the first step sends what the pipe accepts at once
+  __LMW__async_arm(a);
+  return a;
+#else
+  LMW_log_error("LMW_send_email_async is only available on Linux\n");
+  LMW_count_failure();
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+int LMW_async_fd(LMW_async *a)
+{
+  return a ? a->epfd : -1;
+}
+
+int LMW_async_step(LMW_async *a)
+{
+#ifdef __linux__
+  if (!a || a->done)
+    return 1;
+  LMW_config *cfg = a->cfg;
+  __LMW_batch_job *j = &a->job;
+  if (a->efd >= 0) {
+    eventfd_t v;
+    if (eventfd_read(a->efd, &v) == 0) {
+      pthread_join(a->thread, NULL);
+      a->done = 1;
+    }
+    return a->done;
+  }
+  unsigned long long expirations;
+  if (read(a->timerfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+    LMW_log_error("Failure in reading the timer of LMW_send_email_async: %d %s\n", errno, strerror(errno));
+  }
+  if (a->sigchld) {
+    // another waiter may drain it too, so the timer still checks now and then
+    char buf[64];
+    while (read(__LMW_sigchld_pipe[0], buf, sizeof(buf)) > 0)
+      ;
+  }
+  __LMW__capture_drain(&j->cap);
+  if (j->fd >= 0) {
+    __LMW_sigpipe sp;
+    __LMW__sigpipe_block(&sp);
+    __LMW__batch_write(cfg, j);
+    __LMW__sigpipe_unblock(&sp);
+  }
+  if (__LMW__batch_reap(cfg, j, __LMW__now_ns()))
+    __LMW__async_finish(a);
+  __LMW__async_arm(a);
+  return a->done;
+#else
+  return 1;
+#endif
+}
+
+int LMW_async_code(LMW_async *a)
+{
+  return (a && a->done) ? a->msg.code : LMW_ERROR_CANNOT_CALL;
+}
+
+void LMW_async_free(LMW_async *a)
+{
+#ifdef __linux__
+  if (!a)
+    return;
+  LMW_config *cfg = a->cfg;
+  if (!a->done && a->efd >= 0) {
+    LMW_log_error("Email not sent yet when calling LMW_async_free, waiting for cfg->backend\n");
+    pthread_join(a->thread, NULL);
+    a->done = 1;
+  }
+  if (a->efd >= 0)
+    close(a->efd);
+  if (!a->done) {
+    LMW_log_error("Email not sent yet when calling LMW_async_free\n");
+    __LMW__kill_gracefully__(a->job.pid, a->job.pidfd, cfg);
+    LMW_count_failure();
+    a->msg.code = LMW_ERROR_CANNOT_CALL;
+    __LMW__async_finish(a);
+  }
+  close(a->epfd);
+  close(a->timerfd);
+  free(a);
+#endif
+}
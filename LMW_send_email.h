@@ -23,6 +23,9 @@
 #define  __LMW_SEND_EMAIL_H__
 
 #include <errno.h>          // <-- This provides ENOEXEC
+#include <sys/types.h>      // off_t
+#include <sys/uio.h>        // struct iovec
+#include <stdio.h>          // FILE
 
 // Error code definitions, as returned by LMW_send_email()
 #define LMW_OK                    0   // All ok
@@ -30,23 +33,72 @@
 #define LMW_ERROR_PIPE           -2   // PIPE ERROR when sending body
 #define LMW_ERROR_TIMEOUT        -3   // Waiting timeout, child did not finish
 #define LMW_ERROR_SIGNAL         -4   // Child process was terminated by signal
+#define LMW_ERROR_RATE_LIMITED   -5   // Refused by cfg->ratelimit , the mailer was not started;
+                                      // it is not deferred: an LMW_outbox retries it later
+#define LMW_ERROR_CIRCUIT_OPEN   -6   // Refused by cfg->breaker , the mailer is failing
+#define LMW_ERROR_INVALID        -7   // Refused, recipient or subject contain control characters
+#define LMW_ERROR_EXPIRED        -8   // Dropped, its deadline passed while it was queued in a LMW_pool
 // Positive values (>0) are error codes from /bin/mail
 #define LMW_CHILD_EXEC_FAILED    ENOEXEC   // Standard exit code for "cannot exec"
 
+// How the mailer process is started, see LMW_config.spawn
+#define LMW_SPAWN_FORK          0   // fork() + execvp() , copies the page tables of the caller
+#define LMW_SPAWN_POSIX_SPAWN   1   // posix_spawnp() , file actions redirect stdin/stdout/stderr
+#define LMW_SPAWN_VFORK         2   // clone(CLONE_VM|CLONE_VFORK) on Linux, posix_spawnp() elsewhere
+
 // defaults
 #define LMW_MAILER "/bin/mail"
 #define LMW_MAX_WAIT 900 // in milliseconds
+#define LMW_SPAWN LMW_SPAWN_POSIX_SPAWN
+#define LMW_CAPTURE_MAX 4096 // in bytes
+#define LMW_SMTP_RELAY "localhost:25"
+#define LMW_BATCH_PARALLEL 8 // mailers running at once in LMW_send_email_batch()
 
 // maximum length of extra string arguments for LMW_send_email_argc()
 #define LMW_SEND_EMAIL_MAX_LEN_ARGS 512
 
-typedef struct {
+typedef struct LMW_config LMW_config;
+typedef struct LMW_result LMW_result;
+typedef struct LMW_stats LMW_stats;
+typedef struct LMW_async LMW_async;
+typedef struct LMW_ratelimit LMW_ratelimit;
+typedef struct LMW_breaker LMW_breaker;
+typedef struct LMW_mailer_cache LMW_mailer_cache;
+typedef struct LMW_timeout LMW_timeout;
+
+typedef struct LMW_config {
   char *mailer;
   int max_wait;  // in milliseconds
-  int failures; // keeps count of successive failures
+  int failures; // keeps count of successive failures (incremented atomically)
   void (*log_error)(const char *msg, ...); // function pointer for logging errors
+  int spawn; // how to start the mailer, one of LMW_SPAWN_*
+  size_t capture_max; // at most these bytes of stdout (and of stderr) of the mailer are kept
+  int capture_to_disk; // if nonzero, stdout and stderr of the mailer are kept in files in /tmp
+  // if not NULL, emails are delivered by this function instead of cfg->mailer ,
+  // with the same return codes; `res` may be NULL. See LMW_send_email_smtp.h
+  int (*backend)(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+		 LMW_result *res);
+  char *smtp_relay; // "host:port" of the relay, for LMW_backend_smtp()
+  char *smtp_from;  // envelope sender for LMW_backend_smtp(), NULL for user@hostname
+  int batch_parallel; // at most these mailers run at once in LMW_send_email_batch()
+  LMW_stats *stats;   // if not NULL, the time of each phase of sending is recorded here
+  LMW_ratelimit *ratelimit; // if not NULL, emails beyond its rates are refused
+  LMW_breaker *breaker;     // if not NULL, emails are refused while the mailer keeps failing
+  LMW_mailer_cache *mailer_cache; // if not NULL, the mailer as found and opened by LMW_mailer_cache_new()
+  int encode_subject; // if nonzero, a subject that is not ASCII is passed RFC 2047 encoded, see LMW_header_encode()
+  LMW_timeout *timeout; // if not NULL, max_wait is replaced by a deadline adapted to the times of the mailer
 } LMW_config;
 
+// what the mailer wrote, see LMW_send_email_argv_result()
+typedef struct LMW_result {
+  int code;           // same as the return value
+  char *out;          // stdout of the mailer, null terminated, or NULL if empty
+  size_t out_len;
+  char *err;          // stderr of the mailer, null terminated, or NULL if empty
+  size_t err_len;
+  int truncated;      // nonzero if some output exceeded cfg->capture_max
+} LMW_result;
+
 /* initialize pre-allocated config */
 void LMW_config_init(LMW_config *cfg);
 
@@ -61,10 +113,26 @@ void LMW_config_init(LMW_config *cfg);
 
    (Both the implementations in GNU mailutils and BSD work fine).
 
+   The mailer is started as specified by cfg->spawn ; with LMW_SPAWN_POSIX_SPAWN
+   and LMW_SPAWN_VFORK the caller's memory is not duplicated, so the cost
+   does not grow with the size of the calling process; if the mailer cannot
+   be executed, LMW_CHILD_EXEC_FAILED is returned directly.
+
    It can be called with cfg=NULL (defaults will be used);
    
+   What the mailer writes to stdout and stderr is captured in memory
+   (in files in /tmp, if cfg->capture_to_disk is set; empty files are removed);
+   if not empty, it is logged (at most cfg->capture_max bytes).
+   In memory, it comes through pipes that are read while waiting for
+   the mailer: the first cfg->capture_max bytes are kept, the rest is
+   read and discarded, so the writes of the mailer never fail.
+
    It will wait for at most cfg->max_wait milliseconds
    (to avoid hanging the caller, if /bin/mail hangs).
+
+   The recipient and the subject must not contain newlines or other control
+   characters (but for tabs), and the recipient must not start with '-' ,
+   so that they cannot add headers or options; else the mailer is not started.
    
    It will return an exit value: 
    LMW_OK (0)                = all ok 
@@ -72,6 +140,9 @@ void LMW_config_init(LMW_config *cfg);
    LMW_ERROR_PIPE (-2)        = PIPE ERROR when sending body
    LMW_ERROR_TIMEOUT (-3)     = waiting timeout, child did not finish in less than max_wait milliseconds
    LMW_ERROR_SIGNAL (-4)      = child process was terminated by signal
+   LMW_ERROR_RATE_LIMITED (-5) = refused by cfg->ratelimit (see LMW_ratelimit_new())
+   LMW_ERROR_CIRCUIT_OPEN (-6) = refused by cfg->breaker (see LMW_breaker_new())
+   LMW_ERROR_INVALID (-7)     = refused, invalid recipient or subject
    >0                         = error code from /bin/mail
 */
 
@@ -98,4 +169,395 @@ int LMW_send_email_argc(LMW_config *cfg, char *recipient, char *subject, char *b
 */
 int LMW_send_email_argv(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
 
+/**
+   LMW_send_email_argv_result() is as LMW_send_email_argv() ,
+
+   but what the mailer wrote to stdout and stderr (at most cfg->capture_max bytes each)
+   is not logged, and is instead returned in `res`, that must be freed
+   with LMW_result_free()
+
+*/
+int LMW_send_email_argv_result(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+			       LMW_result *res);
+
+void LMW_result_free(LMW_result *res);
+
+/**
+   LMW_send_email_fd() is as LMW_send_email_argv() ,
+
+   but the body is `len` bytes of the file `fd` , starting at `offset`
+   (len == 0 means: up to the end of the file); on Linux they are moved
+   to the mailer with splice(2), without copying them in user space.
+   `fd` may also be a pipe, that is read from its current position until EOF.
+   The position of a regular file is not changed.
+
+*/
+int LMW_send_email_fd(LMW_config *cfg, char *recipient, char *subject, int fd, off_t offset, size_t len,
+		      int argc, char *argv[]);
+/* as LMW_send_email_fd() , returning the output of the mailer as LMW_send_email_argv_result() */
+int LMW_send_email_fd_result(LMW_config *cfg, char *recipient, char *subject, int fd, off_t offset, size_t len,
+			     int argc, char *argv[], LMW_result *res);
+
+/**
+   LMW_send_email_iov() is as LMW_send_email_argv() ,
+
+   but the body is the concatenation of the `iovcnt` buffers in `iov`
+   (e.g. a region mapped with mmap(2)); on Linux they are moved to the
+   mailer with vmsplice(2), without copying them in user space,
+   so they must not be modified until this function returns.
+
+*/
+int LMW_send_email_iov(LMW_config *cfg, char *recipient, char *subject, const struct iovec *iov, int iovcnt,
+		       int argc, char *argv[]);
+
+// produces the next part of the body, in `buf` ; see LMW_send_email_pull()
+typedef ssize_t (*LMW_body_reader)(void *ctx, char *buf, size_t n);
+
+/**
+   LMW_send_email_pull() is as LMW_send_email_argv() ,
+
+   but the body is produced by `reader`, that is called (with `ctx`)
+   whenever the pipe to the mailer can accept more; it must write at most `n`
+   bytes in `buf` and return how many it wrote, 0 at the end of the body,
+   or -1 on failure (then the mailer is killed, so that it does not send
+   a truncated email, and LMW_ERROR_CANNOT_CALL is returned).
+
+   Only a small buffer is used, so the body need not be in memory all at once;
+   the timeout of cfg->max_wait is checked between calls, so `reader`
+   should not block for long.
+
+*/
+int LMW_send_email_pull(LMW_config *cfg, char *recipient, char *subject, LMW_body_reader reader, void *ctx,
+			int argc, char *argv[]);
+
+/**
+   LMW_send_message_pull() is as LMW_send_email_pull() , but the mailer
+   is called as  "mailer argv..."  without "-s subject" and recipient:
+   `reader` produces the whole message, headers and body, for mailers
+   as "sendmail -t -i" that take the recipients from the headers.
+   `recipient` is only used by cfg->ratelimit , and may be NULL.
+   cfg->backend is not supported. See LMW_send_email_mime.h
+*/
+int LMW_send_message_pull(LMW_config *cfg, char *recipient, LMW_body_reader reader, void *ctx,
+			  int argc, char *argv[]);
+
+// one email for LMW_send_email_batch()
+typedef struct {
+  char *recipient;
+  char *subject;
+  char *body;
+  int code;           // the result, as the return value of LMW_send_email()
+} LMW_batch_msg;
+
+/***
+   LMW_send_email_batch()
+
+   Sends the `n` emails in `msgs`, each with its own mailer
+   (with the `argc` extra arguments in `argv`);
+   up to cfg->batch_parallel mailers run at once, and a single thread feeds
+   all their pipes and waits for all of them.
+   Each email has its own timeout of cfg->max_wait milliseconds.
+
+   The result of each email is stored in msgs[i].code , with the same
+   codes as LMW_send_email(); what the mailers write to stdout and stderr
+   is collected together and logged at the end.
+
+   With cfg->backend set, the emails are passed to it one after the other.
+
+   If the library is built with `make IO_URING=1`, the pipes and the
+   mailers are driven with one io_uring(7) instead of poll(2), when the
+   kernel allows it.
+
+   Returns: the number of emails that failed
+*/
+int LMW_send_email_batch(LMW_config *cfg, LMW_batch_msg *msgs, int n, int argc, char *argv[]);
+
+/***
+   LMW_send_email_async()
+
+   Starts the mailer for one email, as LMW_send_email_argv_result() ,
+   and returns at once, without threads (but see cfg->backend below);
+   the email is then advanced
+   by calling LMW_async_step() whenever the file descriptor
+   LMW_async_fd() is readable, e.g. from an epoll, poll or libevent loop:
+
+     LMW_async *a = LMW_send_email_async(&cfg, to, subject, body, 0, NULL, NULL);
+     ... when LMW_async_fd(a) is readable:
+     if (LMW_async_step(a)) {
+       int code = LMW_async_code(a);
+       LMW_async_free(a);
+     }
+
+   The fd becomes readable when the pipe to the mailer can accept more
+   of the body, when the mailer exits, and at the timeout of cfg->max_wait ;
+   LMW_async_step() never blocks: a mailer that timed out gets SIGTERM,
+   and at a later step SIGKILL, if it is still running shortly after.
+
+   With cfg->backend , that may block, the backend is called in a thread
+   of the handle, and the fd becomes readable when it returns;
+   LMW_async_free() of an email that is not done waits for it.
+
+   On kernels without pidfd, the exit of the mailer is signalled by a
+   SIGCHLD handler, so the caller's epoll_wait() may fail with EINTR.
+
+   `cfg`, `body` and `argv` must remain valid until the email is done.
+   If `res` is not NULL, what the mailer wrote is stored there
+   (see LMW_send_email_argv_result()) when LMW_async_step() returns 1.
+   If the mailer cannot be started, the email is done at once: the fd is
+   readable and LMW_async_step() returns 1.
+
+   Linux only.
+
+   Returns: the handle, or NULL (and errno) if it could not be allocated
+*/
+LMW_async *LMW_send_email_async(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+				LMW_result *res);
+
+/* the fd to poll for readability; it does not change while the email is sent */
+int LMW_async_fd(LMW_async *a);
+
+/* advance the email, without blocking; returns 1 if it is done, else 0 */
+int LMW_async_step(LMW_async *a);
+
+/* the result of an email that is done, with the same codes as LMW_send_email() */
+int LMW_async_code(LMW_async *a);
+
+/* frees the handle; if the email is not done, the mailer is killed */
+void LMW_async_free(LMW_async *a);
+
+// the phases of sending an email, timed when cfg->stats is set
+#define LMW_PHASE_CAPTURE  0   // opening the capture of stdout and stderr (pipes or mkstemp)
+#define LMW_PHASE_PIPE     1   // creating the pipe for the body
+#define LMW_PHASE_SPAWN    2   // starting the mailer
+#define LMW_PHASE_WRITE    3   // sending the body
+#define LMW_PHASE_WAIT     4   // waiting for the mailer to exit
+#define LMW_PHASE_CLEANUP  5   // reading and closing the capture
+#define LMW_PHASE_TOTAL    6   // the whole call (also with cfg->backend)
+#define LMW_PHASES         7
+
+#define LMW_HIST_BUCKETS 640
+
+// the statistics of one phase, in nanoseconds
+typedef struct {
+  unsigned long long count;
+  unsigned long long sum_ns, max_ns;
+  unsigned long long p50_ns, p99_ns, p999_ns;  // percentiles, within 1/16
+} LMW_phase_snapshot;
+
+typedef struct {
+  LMW_phase_snapshot phase[LMW_PHASES];   // indexed by LMW_PHASE_*
+} LMW_stats_snapshot;
+
+/***
+   Statistics
+
+   Set cfg->stats = LMW_stats_new() to record, for each email, how long
+   each phase took, in histograms with logarithmic buckets; recording
+   is lock free, so one LMW_stats may be shared by many threads and
+   configs, and costs a few clock readings per email.
+   LMW_send_email_batch() records only LMW_PHASE_TOTAL.
+*/
+LMW_stats *LMW_stats_new(void);
+void LMW_stats_free(LMW_stats *st);
+/* counts, sums and percentiles of all phases */
+void LMW_stats_get(LMW_stats *st, LMW_stats_snapshot *snap);
+void LMW_stats_reset(LMW_stats *st);
+/* print a table of the phases, in microseconds; returns 0, or -1 on error */
+int LMW_stats_print(LMW_stats *st, FILE *f);
+
+// defaults for LMW_ratelimit_config
+#define LMW_RATE_BURST 10
+#define LMW_RATE_SLOTS 4096
+
+typedef struct {
+  double rate;          // emails per second, in all; 0 for no limit
+  double burst;         // emails that may be sent at once, after a quiet time
+  double domain_rate;   // emails per second, to each domain; 0 for no limit
+  double domain_burst;
+  int per_address;      // if nonzero, domain_rate and domain_burst apply to each address instead
+  int slots;            // domains tracked at once (rounded up to a power of 2)
+} LMW_ratelimit_config;
+
+/* initialize pre-allocated rate limit config: no limits, bursts of LMW_RATE_BURST */
+void LMW_ratelimit_config_init(LMW_ratelimit_config *rcfg);
+
+/***
+   Rate limits
+
+   Set cfg->ratelimit = LMW_ratelimit_new(&rcfg) to refuse, with
+   LMW_ERROR_RATE_LIMITED and without starting the mailer, the emails
+   beyond rcfg.rate per second in all, or beyond rcfg.domain_rate per
+   second to the same domain (the part after '@', in lowercase; each
+   address of a comma separated `recipient` is counted; with
+   rcfg.per_address , of "Name <address>" only the address counts).
+   If one address is beyond its limit, the email is refused, and the
+   tokens taken for the others are given back.
+
+   Each limit is a token bucket, that holds up to `burst` emails and
+   refills at `rate`; checking it is lock free (a clock reading and
+   a compare-and-swap), so one LMW_ratelimit may be shared by many
+   threads and configs. The domains are kept in a fixed table of
+   rcfg.slots entries; when it is crowded, new domains are only
+   subject to the global limit.
+
+   Refused emails do not count in cfg->failures ; to send them later
+   instead, use an LMW_outbox , that retries.
+*/
+LMW_ratelimit *LMW_ratelimit_new(LMW_ratelimit_config *rcfg);
+void LMW_ratelimit_free(LMW_ratelimit *rl);
+/* how many emails were refused */
+unsigned long long LMW_ratelimit_rejected(LMW_ratelimit *rl);
+
+// defaults for LMW_breaker_config
+#define LMW_BREAKER_THRESHOLD 5     // successive failures
+#define LMW_BREAKER_OPEN 30000      // milliseconds between probes
+#define LMW_BREAKER_PROBES 1        // successes needed to close again
+
+typedef struct {
+  int threshold;  // after these successive failures the circuit opens
+  int open;       // while open, one email is let through every `open` milliseconds, as a probe
+  int probes;     // after these successive successful probes the circuit closes
+} LMW_breaker_config;
+
+// states of the circuit, see LMW_breaker_state()
+#define LMW_CIRCUIT_CLOSED    0   // emails are sent
+#define LMW_CIRCUIT_OPEN      1   // emails are refused, but for probes
+#define LMW_CIRCUIT_HALF_OPEN 2   // a probe succeeded, more are let through
+
+/* initialize pre-allocated circuit breaker config with the defaults above */
+void LMW_breaker_config_init(LMW_breaker_config *bcfg);
+
+/***
+   Circuit breaker
+
+   Set cfg->breaker = LMW_breaker_new(&bcfg) to stop calling a mailer
+   that keeps failing: after bcfg.threshold successive failures (see
+   below) the circuit "opens", and emails are refused at once with
+   LMW_ERROR_CIRCUIT_OPEN , without starting the mailer and waiting
+   cfg->max_wait for it.
+   Every bcfg.open milliseconds one email is let through as a probe;
+   if it fails the circuit stays open, else it is "half open" and
+   further emails are let through one at a time, until bcfg.probes
+   have succeeded and the circuit closes again.
+
+   Only the results that mean that the mailer is failing count:
+   LMW_ERROR_CANNOT_CALL , LMW_ERROR_PIPE , LMW_ERROR_TIMEOUT ,
+   LMW_ERROR_SIGNAL , LMW_CHILD_EXEC_FAILED and exit statuses; not
+   the refusals of a recipient (exit statuses EX_USAGE , EX_DATAERR ,
+   EX_NOUSER , EX_NOHOST of sysexits(3), SMTP replies 450 and 550-553),
+   nor a body that LMW_send_email_pull() could not read. Emails refused
+   with LMW_ERROR_CIRCUIT_OPEN do not take tokens of cfg->ratelimit .
+
+   The changes of state are reported to cfg->log_error ; refused emails
+   do not count in cfg->failures . One LMW_breaker may be shared by many
+   threads and configs that use the same mailer; to send the refused
+   emails later, use an LMW_outbox , that retries.
+*/
+LMW_breaker *LMW_breaker_new(LMW_breaker_config *bcfg);
+void LMW_breaker_free(LMW_breaker *br);
+/* one of LMW_CIRCUIT_CLOSED, LMW_CIRCUIT_OPEN, LMW_CIRCUIT_HALF_OPEN */
+int LMW_breaker_state(LMW_breaker *br);
+
+/***
+   Mailer cache
+
+   cfg->mailer_cache = LMW_mailer_cache_new(cfg) looks up cfg->mailer in
+   PATH, resolves its symlinks and opens it, once; the mailers are then
+   started from the open file (with execveat(2) on Linux, or from the
+   resolved path), without searching PATH and following symlinks for
+   each email. The file is checked again every second, and reopened if
+   it changed. It is used only while cfg->mailer is the same string.
+
+   Returns NULL, with errno set and an error logged, if the mailer
+   does not exist or is not executable: so it validates the config
+   before any email is sent. One cache may be shared by threads.
+*/
+LMW_mailer_cache *LMW_mailer_cache_new(LMW_config *cfg);
+void LMW_mailer_cache_free(LMW_mailer_cache *mc);
+
+// what LMW_text_scan() found
+#define LMW_SCAN_NEWLINE     1   // a CR or a LF
+#define LMW_SCAN_CONTROL     2   // another control character but TAB, or DEL
+#define LMW_SCAN_8BIT        4   // a byte >= 128
+#define LMW_SCAN_LONG_LINE   8   // a line longer than `max_line` bytes
+
+/***
+   LMW_text_scan()
+
+   Scans `n` bytes of `s` in one pass, and returns the LMW_SCAN_* flags
+   of what it found; `max_line` == 0 means that lines are not measured.
+   Uses AVX2 or SSE2 on x86, as the CPU supports, 32 or 16 bytes at a
+   time, so it is about as fast as reading the memory.
+   A header must not have LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL ; a body
+   with LMW_SCAN_8BIT | LMW_SCAN_CONTROL or lines longer than 998 bytes
+   may be mangled by mail servers, unless it is encoded, as by
+   LMW_qp_encode() in LMW_send_email_mime.h .
+*/
+unsigned LMW_text_scan(const char *s, size_t n, size_t max_line);
+/* the same, a byte at a time */
+unsigned LMW_text_scan_scalar(const char *s, size_t n, size_t max_line);
+
+/***
+   LMW_header_encode()
+
+   Returns a copy of `s` , that is a text in UTF-8, as encoded words of
+   RFC 2047 ("=?UTF-8?Q?...?=", at most 75 characters each, a character
+   is never split between two) if it is not ASCII; the words are
+   separated by a space, or by a newline and a space if `fold` (in a
+   header that is written in a message). The copy must be freed.
+
+   Returns NULL, and sets errno, if `s` contains newlines or control
+   characters (EINVAL), or on failure
+*/
+char *LMW_header_encode(const char *s, int fold);
+
+// defaults for LMW_timeout_config
+#define LMW_TIMEOUT_MIN 100       // milliseconds
+#define LMW_TIMEOUT_MAX 10000     // milliseconds
+#define LMW_TIMEOUT_FACTOR 2.0
+#define LMW_TIMEOUT_WARMUP 5      // samples
+
+typedef struct {
+  int min;        // the deadline is at least `min` milliseconds
+  int max;        // and at most `max` milliseconds, that is also used until there are `warmup` samples
+  double factor;  // the deadline is `factor` times the estimate of the 99th percentile
+  int warmup;
+} LMW_timeout_config;
+
+/* initialize pre-allocated timeout config with the defaults above */
+void LMW_timeout_config_init(LMW_timeout_config *tcfg);
+
+// the estimate of LMW_timeout_get()
+typedef struct {
+  unsigned long long samples;
+  double mean_ms;     // moving average of the time from the start of the mailer to its exit
+  double dev_ms;      // moving average of the deviation from it
+  double p99_ms;      // mean_ms + 4 * dev_ms
+  int deadline_ms;    // what is used instead of cfg->max_wait
+} LMW_timeout_estimate;
+
+/***
+   Adaptive timeouts
+
+   Set cfg->timeout = LMW_timeout_new(&tcfg) to replace the fixed
+   cfg->max_wait with a deadline that follows how long the mailer takes,
+   from its start to its exit, for bodies of about the same size
+   (< 4 kB, < 64 kB, < 1 MB, < 16 MB, larger, or unknown as for
+   LMW_send_email_pull()); each mailer (by cfg->mailer) has its own
+   times. As TCP does for its retransmission timeout (RFC 6298), a
+   moving average of the times (weight 1/8) and of their deviation
+   (weight 1/4) are kept, and their sum, with 4 deviations, estimates
+   the 99th percentile; the deadline is that times tcfg.factor , between
+   tcfg.min and tcfg.max milliseconds. A mailer that times out counts
+   with the time it was given, so the deadline grows while the mailer
+   is slow, up to tcfg.max .
+   Updates are lock free, so one LMW_timeout may be shared by threads
+   and configs; backends, as LMW_backend_smtp() , still use cfg->max_wait .
+*/
+LMW_timeout *LMW_timeout_new(LMW_timeout_config *tcfg);
+void LMW_timeout_free(LMW_timeout *to);
+/* the estimate for cfg->mailer and bodies of `body_len` bytes (SIZE_MAX if unknown);
+   returns the deadline in milliseconds, as e->deadline_ms ; `e` may be NULL */
+int LMW_timeout_get(LMW_config *cfg, size_t body_len, LMW_timeout_estimate *e);
+
 #endif // __LMW_SEND_EMAIL_H__
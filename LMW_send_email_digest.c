@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Digests for LMW_send_email()
+ *
+ * The keys are in a hash table with open addressing and linear probing,
+ * allocated at open with all the room for their strings and samples;
+ * a removed key is filled by shifting back the keys that follow it, so
+ * there are no tombstones. A thread sends the digests at the end of
+ * their windows; the emails are built under the lock, and sent without it.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "LMW_send_email.h"
+#include "LMW_send_email_digest.h"
+
+// warning: this assumes that there is a variable called "cfg"
+// of type  "LMW_config *cfg"
+#define LMW_log_error( msg, ...) \
+  { if (cfg && cfg->log_error ) cfg->log_error(msg, ##__VA_ARGS__);}
+
+typedef struct {
+  uint64_t hash;             // of recipient and key, 0 if the slot is free
+  long long window_end;      // monotonic time, in nanoseconds
+  unsigned long count;       // emails in the digest
+  time_t first_time, last_time;
+  size_t first_len, last_len;  // of the whole bodies, the samples may be shorter
+  char *recipient, *subject, *key, *first, *last;  // in the arena
+} __LMW_digest_slot;
+
+// an email built from a slot, to be sent without the lock
+typedef struct {
+  char recipient[LMW_DIGEST_FIELD];
+  char subject[LMW_DIGEST_FIELD + 32];
+  char *body;
+} __LMW_digest_email;
+
+struct LMW_digest {
+  LMW_config *cfg;
+  LMW_digest_config dcfg;
+  __LMW_digest_slot *slot;
+  unsigned mask;             // slots - 1
+  unsigned used;
+  char *arena;
+  unsigned long pending;     // emails in all digests
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t sender;
+};
+
+void LMW_digest_config_init(LMW_digest_config *dcfg)
+{
+  *dcfg = (LMW_digest_config) {
+    .window = LMW_DIGEST_WINDOW,
+    .slots = LMW_DIGEST_SLOTS,
+    .sample_max = LMW_DIGEST_SAMPLE,
+    .send_first = LMW_DIGEST_SEND_FIRST,
+  };
+}
+
+static long long __LMW__now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct timespec __LMW__ns_to_timespec(long long ns)
+{
+  return (struct timespec) { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+}
+
+/* ========== TABLE ========== */
+
+/* FNV-1a of recipient and key */
+static uint64_t __LMW_digest_hash(const char *recipient, const char *key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = recipient; ; p++) {
+    h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+    if (!*p) break;
+  }
+  for (const char *p = key; *p; p++)
+    h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+  return h ? h : 1;
+}
+
+/* the slot of the key; or, if it is not there, -1 and the free slot where it would go in `*free_slot` */
+static int __LMW_digest_find(LMW_digest *dg, uint64_t h, const char *recipient, const char *key,
+			     unsigned *free_slot)
+{
+  unsigned i = h & dg->mask;
+  for (; dg->slot[i].hash; i = (i + 1) & dg->mask) {
+    __LMW_digest_slot *s = &dg->slot[i];
+    if (s->hash == h && !strcmp(s->recipient, recipient) && !strcmp(s->key, key))
+      return i;
+  }
+  *free_slot = i;
+  return -1;
+}
+
+/* frees slot `i` , moving back the keys that were displaced past it */
+static void __LMW_digest_remove(LMW_digest *dg, unsigned i)
+{
+  unsigned j = i;
+  for (;;) {
+    dg->slot[i].hash = 0;
+    unsigned home;
+    do {
+      j = (j + 1) & dg->mask;
+      if (!dg->slot[j].hash) {
+	dg->used--;
+	return;
+      }
+      home = dg->slot[j].hash & dg->mask;
+      // the key in j stays if its home is cyclically in (i, j]
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    // swap, so that each slot keeps a whole set of buffers
+    __LMW_digest_slot t = dg->slot[i];
+    dg->slot[i] = dg->slot[j];
+    dg->slot[j] = t;
+    i = j;
+  }
+}
+
+static void __LMW_digest_sample(LMW_digest *dg, char *to, size_t *len, const char *body)
+{
+  *len = strlen(body);
+  size_t n = *len < dg->dcfg.sample_max ? *len : dg->dcfg.sample_max;
+  memcpy(to, body, n);
+  to[n] = 0;
+}
+
+static void __LMW_digest_append_sample(char **p, char *end, const char *what, const char *sample, size_t len)
+{
+  size_t kept = strlen(sample);
+  *p += snprintf(*p, end - *p, "----- %s email -----\n%s%s", what, sample,
+		 (kept && sample[kept - 1] != '\n') ? "\n" : "");
+  if (*p < end && len > kept)
+    *p += snprintf(*p, end - *p, "[... %lu more bytes]\n", (unsigned long) (len - kept));
+  if (*p > end)
+    *p = end;
+}
+
+/*
+  Builds the email of the digest in slot `s` , and empties it;
+  a digest of a single email, whose body was kept whole, is that email.
+  Returns: 0, or -1 if there is nothing to send (or no memory)
+*/
+static int __LMW_digest_take(LMW_digest *dg, __LMW_digest_slot *s, __LMW_digest_email *e)
+{
+  unsigned long count = s->count;
+  if (count == 0)
+    return -1;
+  dg->pending -= count;
+  s->count = 0;
+  strcpy(e->recipient, s->recipient);
+  if (count == 1 && s->first_len <= dg->dcfg.sample_max) {
+    strcpy(e->subject, s->subject);
+    e->body = strdup(s->first);
+    return e->body ? 0 : -1;
+  }
+  snprintf(e->subject, sizeof(e->subject), "%s (%lu times)", s->subject, count);
+  size_t size = 2 * dg->dcfg.sample_max + LMW_DIGEST_FIELD + 256;
+  e->body = malloc(size);
+  if (!e->body)
+    return -1;
+  char first[32], last[32], *p = e->body, *end = e->body + size;
+  struct tm tm;
+  strftime(first, sizeof(first), "%Y-%m-%d %H:%M:%S", localtime_r(&s->first_time, &tm));
+  strftime(last, sizeof(last), "%Y-%m-%d %H:%M:%S", localtime_r(&s->last_time, &tm));
+  p += snprintf(p, end - p, "%lu emails to %s with this subject, from %s to %s, are collapsed in this digest.\n\n",
+		count, s->recipient, first, last);
+  __LMW_digest_append_sample(&p, end, "first", s->first, s->first_len);
+  if (count > 1)
+    __LMW_digest_append_sample(&p, end, "last", s->last, s->last_len);
+  return 0;
+}
+
+static void __LMW_digest_deliver(LMW_digest *dg, __LMW_digest_email *e)
+{
+  LMW_config *cfg = dg->cfg;
+  int r = LMW_send_email(cfg, e->recipient, e->subject, e->body);
+  if (r != LMW_OK) {
+    LMW_log_error("Digest to %s could not be sent, error %d\n", e->recipient, r);
+  }
+  free(e->body);
+}
+
+/* ========== THREAD ========== */
+
+static void* __LMW_digest_sender(void *arg)
+{
+  LMW_digest *dg = arg;
+  pthread_mutex_lock(&dg->mutex);
+  while (!dg->stop) {
+    long long now = __LMW__now_ns(), next = LLONG_MAX;
+    int due = -1;
+    for (unsigned i = 0; i <= dg->mask && due < 0; i++) {
+      __LMW_digest_slot *s = &dg->slot[i];
+      if (s->hash && s->window_end <= now)
+	due = i;
+      else if (s->hash && s->window_end < next)
+	next = s->window_end;
+    }
+    if (due < 0) {
+      if (next == LLONG_MAX) {
+	pthread_cond_wait(&dg->cond, &dg->mutex);
+      } else {
+	struct timespec ts = __LMW__ns_to_timespec(next);
+	pthread_cond_timedwait(&dg->cond, &dg->mutex, &ts);
+      }
+      continue;
+    }
+
+    // a window with repeats is followed by another; a quiet key is forgotten
+    __LMW_digest_slot *s = &dg->slot[due];
+    __LMW_digest_email e;
+    int ready = __LMW_digest_take(dg, s, &e) == 0;
+    if (ready)
+      s->window_end = now + dg->dcfg.window * 1000000LL;
+    else
+      __LMW_digest_remove(dg, due);
+    if (ready) {
+      pthread_mutex_unlock(&dg->mutex);
+      __LMW_digest_deliver(dg, &e);
+      pthread_mutex_lock(&dg->mutex);
+    }
+  }
+  pthread_mutex_unlock(&dg->mutex);
+  return NULL;
+}
+
+/* ========== API ========== */
+
+LMW_digest* LMW_digest_open(LMW_config *cfg, LMW_digest_config *dcfg)
+{
+  LMW_digest *dg = calloc(1, sizeof(LMW_digest));
+  if (!dg) return NULL;
+  dg->cfg = cfg;
+  if (dcfg)
+    dg->dcfg = *dcfg;
+  else
+    LMW_digest_config_init(&dg->dcfg);
+  if (dg->dcfg.window < 1)
+    dg->dcfg.window = 1;
+  unsigned slots = 2;
+  while (slots < (unsigned) dg->dcfg.slots && slots < (1U << 30))
+    slots *= 2;
+  dg->mask = slots - 1;
+
+  size_t per_slot = 3 * LMW_DIGEST_FIELD + 2 * (dg->dcfg.sample_max + 1);
+  dg->slot = calloc(slots, sizeof(__LMW_digest_slot));
+  dg->arena = malloc(slots * per_slot);
+  if (!dg->slot || !dg->arena) {
+    LMW_log_error("Cannot allocate the table of the digest: %d %s\n", errno, strerror(errno));
+    goto fail;
+  }
+  for (unsigned i = 0; i < slots; i++) {
+    char *a = dg->arena + i * per_slot;
+    __LMW_digest_slot *s = &dg->slot[i];
+    s->recipient = a;
+    s->subject = a + LMW_DIGEST_FIELD;
+    s->key = a + 2 * LMW_DIGEST_FIELD;
+    s->first = a + 3 * LMW_DIGEST_FIELD;
+    s->last = s->first + dg->dcfg.sample_max + 1;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&dg->mutex, NULL);
+  pthread_cond_init(&dg->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&dg->sender, NULL, __LMW_digest_sender, dg) != 0) {
+    pthread_mutex_destroy(&dg->mutex);
+    pthread_cond_destroy(&dg->cond);
+    goto fail;
+  }
+  return dg;
+
+ fail:
+  {
+    int saved_errno = errno;
+    free(dg->slot);
+    free(dg->arena);
+    free(dg);
+    errno = saved_errno;
+  }
+  return NULL;
+}
+
+int LMW_digest_send(LMW_digest *dg, char *recipient, char *subject, char *body, const char *key)
+{
+  LMW_config *cfg = dg ? dg->cfg : NULL;
+  if (!dg || !recipient || !subject || !body) {
+    LMW_log_error("Null parameter passed to LMW_digest_send\n");
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  if (!key)
+    key = subject;
+  if (strlen(recipient) >= LMW_DIGEST_FIELD || strlen(subject) >= LMW_DIGEST_FIELD ||
+      strlen(key) >= LMW_DIGEST_FIELD)
+    return LMW_send_email(cfg, recipient, subject, body);
+
+  uint64_t h = __LMW_digest_hash(recipient, key);
+  unsigned i;
+  time_t wall = time(NULL);
+  pthread_mutex_lock(&dg->mutex);
+  int found = __LMW_digest_find(dg, h, recipient, key, &i);
+  if (found >= 0) {
+    __LMW_digest_slot *s = &dg->slot[found];
+    if (s->count++ == 0) {
+      __LMW_digest_sample(dg, s->first, &s->first_len, body);
+      s->first_time = wall;
+    }
+    __LMW_digest_sample(dg, s->last, &s->last_len, body);
+    s->last_time = wall;
+    dg->pending++;
+    pthread_mutex_unlock(&dg->mutex);
+    return LMW_OK;
+  }
+  // keep a quarter of the table free, so that probe sequences stay short
+  if (dg->used >= (dg->mask + 1) - (dg->mask + 1) / 4) {
+    pthread_mutex_unlock(&dg->mutex);
+    return LMW_send_email(cfg, recipient, subject, body);
+  }
+  __LMW_digest_slot *s = &dg->slot[i];
+  s->hash = h;
+  strcpy(s->recipient, recipient);
+  strcpy(s->subject, subject);
+  strcpy(s->key, key);
+  s->window_end = __LMW__now_ns() + dg->dcfg.window * 1000000LL;
+  s->count = 0;
+  dg->used++;
+  int send_now = dg->dcfg.send_first;
+  if (!send_now) {
+    s->count = 1;
+    __LMW_digest_sample(dg, s->first, &s->first_len, body);
+    s->first_time = s->last_time = wall;
+    dg->pending++;
+  }
+  // the sender may be waiting for a later window
+  pthread_cond_signal(&dg->cond);
+  pthread_mutex_unlock(&dg->mutex);
+  return send_now ? LMW_send_email(cfg, recipient, subject, body) : LMW_OK;
+}
+
+void LMW_digest_flush(LMW_digest *dg)
+{
+  if (!dg) return;
+  pthread_mutex_lock(&dg->mutex);
+  __LMW_digest_email *e = malloc((dg->mask + 1) * sizeof(__LMW_digest_email));
+  int n = 0;
+  long long now = __LMW__now_ns();
+  for (unsigned i = 0; e && i <= dg->mask; i++) {
+    __LMW_digest_slot *s = &dg->slot[i];
+    if (s->hash && __LMW_digest_take(dg, s, &e[n]) == 0) {
+      s->window_end = now + dg->dcfg.window * 1000000LL;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&dg->mutex);
+  for (int k = 0; k < n; k++)
+    __LMW_digest_deliver(dg, &e[k]);
+  free(e);
+}
+
+unsigned long LMW_digest_pending(LMW_digest *dg)
+{
+  if (!dg) return 0;
+  pthread_mutex_lock(&dg->mutex);
+  unsigned long n = dg->pending;
+  pthread_mutex_unlock(&dg->mutex);
+  return n;
+}
+
+void LMW_digest_close(LMW_digest *dg)
+{
+  if (!dg) return;
+  pthread_mutex_lock(&dg->mutex);
+  dg->stop = 1;
+  pthread_cond_signal(&dg->cond);
+  pthread_mutex_unlock(&dg->mutex);
+  // the sender may be in the middle of sending a digest
+  pthread_join(dg->sender, NULL);
+  LMW_digest_flush(dg);
+
+  pthread_mutex_destroy(&dg->mutex);
+  pthread_cond_destroy(&dg->cond);
+  free(dg->slot);
+  free(dg->arena);
+  free(dg);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LMW_SEND_EMAIL_DIGEST_H__
+#define __LMW_SEND_EMAIL_DIGEST_H__
+
+#include <stddef.h>
+#include "LMW_send_email.h"
+
+// defaults
+#define LMW_DIGEST_WINDOW     60000  // in milliseconds
+#define LMW_DIGEST_SLOTS      1024   // keys coalesced at once
+#define LMW_DIGEST_SAMPLE     2048   // in bytes
+#define LMW_DIGEST_SEND_FIRST 1
+
+// longest recipient, subject and key that are coalesced, in bytes;
+// emails with longer ones are sent at once
+#define LMW_DIGEST_FIELD 256
+
+// coalesces repeated emails into digests
+typedef struct LMW_digest LMW_digest;
+
+typedef struct {
+  int window;         // repeats within this time are collapsed in one digest, in milliseconds
+  int slots;          // size of the table of keys (rounded up to a power of 2)
+  size_t sample_max;  // at most these bytes of the first and of the last body are kept
+  int send_first;     // if nonzero, the first email of a key is sent at once, not in the digest
+} LMW_digest_config;
+
+/* initialize pre-allocated digest config */
+void LMW_digest_config_init(LMW_digest_config *dcfg);
+
+/***
+   LMW_digest_open()
+
+   Creates a digest, that coalesces emails with the same recipient and key:
+   the first email of a key opens a window of dcfg->window milliseconds
+   (and is sent at once, if dcfg->send_first is set); the repeats within
+   the window are counted, and at the end of the window a single digest
+   is sent with LMW_send_email() and `cfg` , with the count, the times
+   of the first and last repeat, and samples of their bodies.
+   If there were repeats, a new window starts; otherwise the key is forgotten.
+
+   All the memory is allocated here: a table of dcfg->slots keys, each
+   with room for its strings and two samples; when the table is full,
+   emails with new keys are sent at once.
+
+   A thread sends the digests when their windows end.
+
+   `dcfg` may be NULL (defaults will be used); `cfg` must stay valid until LMW_digest_close().
+
+   Returns: the digest, or NULL on failure (and errno is set)
+*/
+LMW_digest* LMW_digest_open(LMW_config *cfg, LMW_digest_config *dcfg);
+
+/***
+   LMW_digest_send()
+
+   Sends the email, or adds it to the digest of (recipient, key);
+   if `key` is NULL, the subject is the key.
+
+   Returns: LMW_OK if the email was added to a digest, else the result
+   of LMW_send_email()
+*/
+int LMW_digest_send(LMW_digest *dg, char *recipient, char *subject, char *body, const char *key);
+
+/* sends at once the digests of all open windows, that then restart */
+void LMW_digest_flush(LMW_digest *dg);
+
+/* number of emails waiting in digests */
+unsigned long LMW_digest_pending(LMW_digest *dg);
+
+/* sends the pending digests, stops the thread and frees the digest */
+void LMW_digest_close(LMW_digest *dg);
+
+#endif // __LMW_SEND_EMAIL_DIGEST_H__
@@ -9,56 +9,179 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
 #include "LMW_send_email.h"
 #include "LMW_send_email_in_thread.h"
 
 
-/* ========== PTHREAD-BASED APPROACH ========== */
+/* ========== ARENAS ========== */
+
+/*
+ * A context, its argv and the copies of all its strings are packed in
+ * one block, the arena; blocks of up to 256 << (LMW_ARENA_CLASSES - 1)
+ * bytes are rounded up to a power of 2, and when freed are kept in a
+ * free list of the thread, at most LMW_ARENA_CACHED of each size;
+ * the lists are freed when the thread exits
+ */
+#define LMW_ARENA_CLASSES 8
+#define LMW_ARENA_CACHED  16
+
+typedef union __LMW_arena {
+    struct {
+        union __LMW_arena *next;   // in the free list
+        int cls;                   // size class, or -1 if larger
+    };
+    max_align_t align;             // for the context that follows
+} __LMW_arena;
+
+typedef struct {
+    __LMW_arena *head[LMW_ARENA_CLASSES];
+    int count[LMW_ARENA_CLASSES];
+} __LMW_arena_cache;
+
+static _Thread_local __LMW_arena_cache __LMW_cache;
+static _Thread_local int __LMW_cache_registered;
+static pthread_key_t __LMW_cache_key;
+static pthread_once_t __LMW_cache_once = PTHREAD_ONCE_INIT;
+
+static atomic_ullong __LMW_arena_mallocs, __LMW_arena_reused, __LMW_arena_freed;
+
+static void __LMW_cache_destroy(void *p) {
+    __LMW_arena_cache *c = p;
+    for (int k = 0; k < LMW_ARENA_CLASSES; k++) {
+        while (c->head[k]) {
+            __LMW_arena *a = c->head[k];
+            c->head[k] = a->next;
+            free(a);
+            atomic_fetch_add_explicit(&__LMW_arena_freed, 1, memory_order_relaxed);
+        }
+        c->count[k] = 0;
+    }
+}
+
+static void __LMW_cache_key_init(void) {
+    pthread_key_create(&__LMW_cache_key, __LMW_cache_destroy);
+}
+
+/* Returns: `size` usable bytes, or NULL */
+static void* __LMW_arena_get(size_t size) {
+    int cls = 0;
+    while (cls < LMW_ARENA_CLASSES && ((size_t)256 << cls) < size + sizeof(__LMW_arena))
+        cls++;
+    __LMW_arena *a;
+    if (cls < LMW_ARENA_CLASSES && (a = __LMW_cache.head[cls])) {
+        __LMW_cache.head[cls] = a->next;
+        __LMW_cache.count[cls]--;
+        atomic_fetch_add_explicit(&__LMW_arena_reused, 1, memory_order_relaxed);
+        return a + 1;
+    }
+    a = malloc(cls < LMW_ARENA_CLASSES ? (size_t)256 << cls : size + sizeof(__LMW_arena));
+    if (!a)
+        return NULL;
+    a->cls = cls < LMW_ARENA_CLASSES ? cls : -1;
+    atomic_fetch_add_explicit(&__LMW_arena_mallocs, 1, memory_order_relaxed);
+    return a + 1;
+}
+
+/* gives back the arena to the free list of the calling thread */
+static void __LMW_arena_put(void *p) {
+    __LMW_arena *a = (__LMW_arena*)p - 1;
+    if (a->cls >= 0 && __LMW_cache.count[a->cls] < LMW_ARENA_CACHED) {
+        if (!__LMW_cache_registered) {
+            pthread_once(&__LMW_cache_once, __LMW_cache_key_init);
+            // so that the list is freed when the thread exits
+            __LMW_cache_registered = pthread_setspecific(__LMW_cache_key, &__LMW_cache) == 0;
+        }
+        if (__LMW_cache_registered) {
+            a->next = __LMW_cache.head[a->cls];
+            __LMW_cache.head[a->cls] = a;
+            __LMW_cache.count[a->cls]++;
+            return;
+        }
+    }
+    free(a);
+    atomic_fetch_add_explicit(&__LMW_arena_freed, 1, memory_order_relaxed);
+}
+
+void LMW_pool_alloc_counts(LMW_alloc_counts *counts) {
+    counts->mallocs = atomic_load_explicit(&__LMW_arena_mallocs, memory_order_relaxed);
+    counts->reused = atomic_load_explicit(&__LMW_arena_reused, memory_order_relaxed);
+    counts->freed = atomic_load_explicit(&__LMW_arena_freed, memory_order_relaxed);
+}
+
+
+/* ========== THREAD CONTEXTS ========== */
 
 
 /**
- * Initialize a thread context with given parameters
- * Returns: 0 on success, -1 on failure
+ * Create a thread context in an arena; unless `borrow`, the strings
+ * are copied after it, else only pointed to
+ * Returns: the context, or NULL on failure
  */
-static int __LMW_ctx_init(LMW_thread_context *ctx, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
-    if (!recipient || !subject || !body) {
-        return -1;
+static LMW_thread_context* __LMW_ctx_new(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[], int borrow) {
+    if (!recipient || !subject || !body || argc < 0 || (argc > 0 && !argv)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t lr = strlen(recipient) + 1, ls = strlen(subject) + 1, lb = strlen(body) + 1;
+    size_t size = sizeof(LMW_thread_context);
+    if (!borrow) {
+        size += argc * sizeof(char*) + lr + ls + lb;
+        for (int i = 0; i < argc; i++)
+            size += strlen(argv[i]) + 1;
     }
+    LMW_thread_context *ctx = __LMW_arena_get(size);
+    if (!ctx)
+        return NULL;
 
     // Initialize basic fields
     ctx->cfg = cfg;
     ctx->argc = argc;
+    ctx->pool = NULL;
+    ctx->priority = LMW_PRIO_NORMAL;
+    ctx->queued_ns = 0;
+    ctx->deadline_ns = 0;
     ctx->result = LMW_ERROR_CANNOT_CALL;
     ctx->completed = 0;
 
-    // Duplicate argv array and its strings
-    if (argc > 0) {
-        ctx->argv = malloc(sizeof(char*) * argc);
-        if (!ctx->argv) {
-            return -1;
-        }
-        
+    if (borrow) {
+        ctx->recipient = recipient;
+        ctx->subject = subject;
+        ctx->body = body;
+        ctx->argv = argv;
+    } else {
+        // the argv array, then the strings
+        char **v = (char**)(ctx + 1);
+        char *p = (char*)(v + argc);
+        ctx->recipient = memcpy(p, recipient, lr);
+        ctx->subject = memcpy(p += lr, subject, ls);
+        ctx->body = memcpy(p += ls, body, lb);
+        p += lb;
         for (int i = 0; i < argc; i++) {
-            ctx->argv[i] = strdup(argv[i]);
-            if (!ctx->argv[i]) {
-                return -1;
-            }
+            size_t l = strlen(argv[i]) + 1;
+            v[i] = memcpy(p, argv[i], l);
+            p += l;
         }
-    } else {
-        ctx->argv = NULL;
+        ctx->argv = argc > 0 ? v : NULL;
     }
-    
-    // Initialize mutex
+
+    // Initialize mutex and condition
     if (pthread_mutex_init(&ctx->mutex, NULL) != 0) {
-        return -1;
+        __LMW_arena_put(ctx);
+        return NULL;
     }
-    // Duplicate strings
-    ctx->recipient = strdup(recipient);
-    ctx->subject = strdup(subject);
-    ctx->body = strdup(body);
-
-    
-    return 0;
+    if (pthread_cond_init(&ctx->cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->mutex);
+        __LMW_arena_put(ctx);
+        return NULL;
+    }
+    return ctx;
 }
 
 /**
@@ -66,61 +189,463 @@ static int __LMW_ctx_init(LMW_thread_context *ctx, LMW_config *cfg, char *recipi
  */
 static void __LMW_ctx_free(LMW_thread_context *ctx) {
     if (!ctx) return;
-    
-    // Free strings
-    free(ctx->recipient);
-    free(ctx->subject);  
-    free(ctx->body);
-    
-    // Free argv array
-    for (int i = 0; i < ctx->argc; i++) {
-        free(ctx->argv[i]);
-    }
-    free(ctx->argv);
-    
-    // Destroy mutex
+
+    // Destroy mutex and condition
     pthread_mutex_destroy(&ctx->mutex);
-    
-    // Free the context itself
-    free(ctx);
+    pthread_cond_destroy(&ctx->cond);
+
+    // the strings are in the same arena, or borrowed
+    __LMW_arena_put(ctx);
 }
 
-static void* __LMW_thread_worker(void *arg) {
-    LMW_thread_context *ctx = (LMW_thread_context*)arg;
-    
+/**
+ * Send the email in the context, then wake up whoever waits for it;
+ * the context may be freed as soon as this returns
+ */
+static void __LMW_thread_run(LMW_thread_context *ctx) {
     int result = LMW_send_email_argv(ctx->cfg, ctx->recipient, ctx->subject, ctx->body, ctx->argc, ctx->argv);
     
     pthread_mutex_lock(&ctx->mutex);
     ctx->result = result;
     ctx->completed = 1;
+    pthread_cond_signal(&ctx->cond);
     pthread_mutex_unlock(&ctx->mutex);
-    
+}
+
+
+/* ========== WORKER POOL ========== */
+
+/*
+ * Each priority class has its queue, a bounded lock-free MPMC ring
+ * (D. Vyukov), each cell holding the sequence number of the turn it is
+ * ready for, and a semaphore counting its free cells; one semaphore
+ * counts the queued contexts of all classes, so that submitters and
+ * workers sleep instead of spinning.
+ * A worker takes the class of the next turn of a smooth weighted round
+ * robin schedule, each class appearing `weight` times in it, spread
+ * out; if that queue is empty, it takes the most urgent that is not
+ */
+typedef struct {
+    atomic_size_t seq;
+    LMW_thread_context *ctx;
+} __LMW_cell;
+
+typedef struct {
+    __LMW_cell *cells;
+    size_t mask;
+    atomic_size_t head;   // next cell to dequeue
+    atomic_size_t tail;   // next cell to enqueue
+    sem_t slots;          // free cells
+    int weight;
+    int expiry;           // one of LMW_EXPIRED_*
+    atomic_ulong depth, submitted, sent, expired, downgraded;
+    atomic_ullong wait_ns, wait_max_ns;
+} __LMW_class;
+
+struct LMW_pool {
+    __LMW_class classes[LMW_POOL_CLASSES];
+    unsigned char schedule[LMW_POOL_CLASSES * LMW_POOL_MAX_WEIGHT];
+    int schedule_len;
+    atomic_ulong turn;    // next turn of the schedule
+    sem_t items;          // queued contexts, plus one per worker at shutdown
+    atomic_int stopping;
+    int nworkers;
+    pthread_t *workers;
+    int borrow;           // the strings of the emails are not copied
+    atomic_ulong submitted;
+    atomic_ulong completed;
+    pthread_mutex_t drain_mutex;
+    pthread_cond_t drain_cond;
+};
+
+static long long __LMW_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Returns: 0 on success, -1 if the ring is full */
+static int __LMW_ring_push(__LMW_class *q, LMW_thread_context *ctx) {
+    __LMW_cell *cell;
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    cell->ctx = ctx;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+/* Returns: 0 on success, -1 if the ring is empty */
+static int __LMW_ring_pop(__LMW_class *q, LMW_thread_context **ctx) {
+    __LMW_cell *cell;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    *ctx = cell->ctx;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Queue the context in its class, after a slot was reserved in its `slots`
+ */
+static void __LMW_class_push(LMW_pool *pool, LMW_thread_context *ctx) {
+    __LMW_class *q = &pool->classes[ctx->priority];
+    ctx->queued_ns = __LMW_now_ns();
+    atomic_fetch_add(&q->submitted, 1);
+    atomic_fetch_add(&q->depth, 1);
+    // cannot fail, the slot is reserved
+    __LMW_ring_push(q, ctx);
+    sem_post(&pool->items);
+}
+
+/**
+ * Take a queued context, after one was counted in `pool->items`
+ * Returns: 0 on success, -1 if the pool is shutting down
+ */
+static int __LMW_class_pop(LMW_pool *pool, LMW_thread_context **ctx) {
+    for (;;) {
+        unsigned long t = atomic_fetch_add_explicit(&pool->turn, 1, memory_order_relaxed);
+        int first = pool->schedule[t % pool->schedule_len];
+        if (__LMW_ring_pop(&pool->classes[first], ctx) == 0)
+            return 0;
+        for (int c = 0; c < LMW_POOL_CLASSES; c++)
+            if (c != first && __LMW_ring_pop(&pool->classes[c], ctx) == 0)
+                return 0;
+        if (atomic_load(&pool->stopping))
+            return -1;
+        // the context counted is behind one that is still being pushed
+        sched_yield();
+    }
+}
+
+/**
+ * Spread each class `weight` times over the turns (as in nginx)
+ */
+static void __LMW_pool_schedule(LMW_pool *pool) {
+    int current[LMW_POOL_CLASSES] = {0}, total = 0;
+    for (int c = 0; c < LMW_POOL_CLASSES; c++)
+        total += pool->classes[c].weight;
+    for (int n = 0; n < total; n++) {
+        int best = 0;
+        for (int c = 0; c < LMW_POOL_CLASSES; c++) {
+            current[c] += pool->classes[c].weight;
+            if (current[c] > current[best])
+                best = c;
+        }
+        current[best] -= total;
+        pool->schedule[n] = best;
+    }
+    pool->schedule_len = total;
+}
+
+/**
+ * Count a context as done, and wake up LMW_pool_drain()
+ */
+static void __LMW_pool_done(LMW_pool *pool) {
+    unsigned long done = atomic_fetch_add(&pool->completed, 1) + 1;
+    if (done == atomic_load(&pool->submitted)) {
+        pthread_mutex_lock(&pool->drain_mutex);
+        pthread_cond_broadcast(&pool->drain_cond);
+        pthread_mutex_unlock(&pool->drain_mutex);
+    }
+}
+
+/**
+ * The deadline of the context passed while it was queued: move it to
+ * the next class if its class downgrades and there is room there,
+ * else complete it with LMW_ERROR_EXPIRED, without starting the mailer
+ */
+static void __LMW_pool_expire(LMW_pool *pool, LMW_thread_context *ctx) {
+    __LMW_class *q = &pool->classes[ctx->priority];
+    if (q->expiry == LMW_EXPIRED_DOWNGRADE && ctx->priority + 1 < LMW_POOL_CLASSES
+        && sem_trywait(&pool->classes[ctx->priority + 1].slots) == 0) {
+        atomic_fetch_add(&q->downgraded, 1);
+        ctx->priority++;
+        ctx->deadline_ns = 0;
+        __LMW_class_push(pool, ctx);
+        return;
+    }
+    atomic_fetch_add(&q->expired, 1);
+    LMW_config *cfg = ctx->cfg;
+    if (cfg) {
+        __atomic_fetch_add(&cfg->failures, 1, __ATOMIC_RELAXED);
+        if (cfg->log_error)
+            cfg->log_error("email to %s expired in the queue\n", ctx->recipient);
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->result = LMW_ERROR_EXPIRED;
+    ctx->completed = 1;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    __LMW_pool_done(pool);
+}
+
+static void* __LMW_pool_worker(void *arg) {
+    LMW_pool *pool = (LMW_pool*)arg;
+    LMW_thread_context *ctx;
+
+    for (;;) {
+        while (sem_wait(&pool->items) == -1 && errno == EINTR)
+            ;
+        if (__LMW_class_pop(pool, &ctx) != 0)
+            break;
+        __LMW_class *q = &pool->classes[ctx->priority];
+        atomic_fetch_sub(&q->depth, 1);
+        sem_post(&q->slots);
+
+        long long now = __LMW_now_ns();
+        if (ctx->deadline_ns && now > ctx->deadline_ns) {
+            __LMW_pool_expire(pool, ctx);
+            continue;
+        }
+        unsigned long long wait = now - ctx->queued_ns;
+        unsigned long long max = atomic_load_explicit(&q->wait_max_ns, memory_order_relaxed);
+        while (wait > max && !atomic_compare_exchange_weak_explicit(&q->wait_max_ns, &max, wait,
+                                                                    memory_order_relaxed, memory_order_relaxed))
+            ;
+        atomic_fetch_add_explicit(&q->wait_ns, wait, memory_order_relaxed);
+        atomic_fetch_add(&q->sent, 1);
+
+        __LMW_thread_run(ctx);
+        __LMW_pool_done(pool);
+    }
     return NULL;
 }
 
+LMW_pool* LMW_pool_create(int workers, int queue_size) {
+    if (workers < 1 || queue_size < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    LMW_pool *pool = calloc(1, sizeof(LMW_pool));
+    if (!pool) return NULL;
+
+    size_t size = 1;
+    while (size < (size_t)queue_size)
+        size <<= 1;
+    static const int weights[LMW_POOL_CLASSES] = { LMW_POOL_WEIGHT_URGENT, LMW_POOL_WEIGHT_NORMAL, LMW_POOL_WEIGHT_BULK };
+    int ok = 1;
+    for (int c = 0; c < LMW_POOL_CLASSES; c++) {
+        __LMW_class *q = &pool->classes[c];
+        q->mask = size - 1;
+        q->weight = weights[c];
+        q->expiry = LMW_EXPIRED_DROP;
+        q->cells = calloc(size, sizeof(__LMW_cell));
+        ok = ok && q->cells;
+    }
+    pool->workers = calloc(workers, sizeof(pthread_t));
+    if (!ok || !pool->workers) {
+        for (int c = 0; c < LMW_POOL_CLASSES; c++)
+            free(pool->classes[c].cells);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    for (int c = 0; c < LMW_POOL_CLASSES; c++) {
+        __LMW_class *q = &pool->classes[c];
+        for (size_t i = 0; i < size; i++)
+            atomic_init(&q->cells[i].seq, i);
+        atomic_init(&q->head, 0);
+        atomic_init(&q->tail, 0);
+        sem_init(&q->slots, 0, size);
+    }
+    __LMW_pool_schedule(pool);
+    atomic_init(&pool->turn, 0);
+    atomic_init(&pool->stopping, 0);
+    atomic_init(&pool->submitted, 0);
+    atomic_init(&pool->completed, 0);
+    sem_init(&pool->items, 0, 0);
+    pthread_mutex_init(&pool->drain_mutex, NULL);
+    pthread_cond_init(&pool->drain_cond, NULL);
+
+    for (pool->nworkers = 0; pool->nworkers < workers; pool->nworkers++) {
+        if (pthread_create(&pool->workers[pool->nworkers], NULL, __LMW_pool_worker, pool) != 0) {
+            if (pool->nworkers == 0) {
+                LMW_pool_destroy(pool);
+                return NULL;
+            }
+            break;
+        }
+    }
+    return pool;
+}
+
 /**
- * Start sending email asynchronously using pthread with extra arguments
+ * Queue the email, after a slot was reserved in the `slots` of class `prio`
  * Returns: context pointer on success, NULL on failure
  */
-LMW_thread_context* LMW_send_email_argv_thread_start(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
-    LMW_thread_context *ctx = malloc(sizeof(LMW_thread_context));
-    if (!ctx) return NULL;
-    
-    // Initialize context
-    if (__LMW_ctx_init(ctx, cfg, recipient, subject, body, argc, argv) != 0) {
-        __LMW_ctx_free(ctx);
+static LMW_thread_context* __LMW_pool_enqueue(LMW_pool *pool, int prio, const struct timespec *deadline, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    LMW_thread_context *ctx = __LMW_ctx_new(cfg, recipient, subject, body, argc, argv, pool->borrow);
+    if (!ctx) {
+        sem_post(&pool->classes[prio].slots);
         return NULL;
     }
-    
-    // Start worker thread
-    if (pthread_create(&ctx->thread, NULL, __LMW_thread_worker, ctx) != 0) {
-        __LMW_ctx_free(ctx);
+    ctx->pool = pool;
+    ctx->priority = prio;
+    ctx->deadline_ns = deadline ? deadline->tv_sec * 1000000000LL + deadline->tv_nsec : 0;
+
+    atomic_fetch_add(&pool->submitted, 1);
+    __LMW_class_push(pool, ctx);
+    return ctx;
+}
+
+LMW_thread_context* LMW_pool_submit_prio(LMW_pool *pool, int prio, const struct timespec *deadline, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    if (!pool) return NULL;
+    if (prio < 0 || prio >= LMW_POOL_CLASSES) {
+        errno = EINVAL;
         return NULL;
     }
-    
-    return ctx;
+    while (sem_wait(&pool->classes[prio].slots) == -1)
+        if (errno != EINTR)
+            return NULL;
+    return __LMW_pool_enqueue(pool, prio, deadline, cfg, recipient, subject, body, argc, argv);
+}
+
+LMW_thread_context* LMW_pool_try_submit_prio(LMW_pool *pool, int prio, const struct timespec *deadline, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    if (!pool) return NULL;
+    if (prio < 0 || prio >= LMW_POOL_CLASSES) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // sets errno to EAGAIN if no slot is free
+    if (sem_trywait(&pool->classes[prio].slots) == -1)
+        return NULL;
+    return __LMW_pool_enqueue(pool, prio, deadline, cfg, recipient, subject, body, argc, argv);
+}
+
+LMW_thread_context* LMW_pool_submit(LMW_pool *pool, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    return LMW_pool_submit_prio(pool, LMW_PRIO_NORMAL, NULL, cfg, recipient, subject, body, argc, argv);
+}
+
+LMW_thread_context* LMW_pool_try_submit(LMW_pool *pool, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    return LMW_pool_try_submit_prio(pool, LMW_PRIO_NORMAL, NULL, cfg, recipient, subject, body, argc, argv);
+}
+
+int LMW_pool_set_weight(LMW_pool *pool, int prio, int weight) {
+    if (!pool || prio < 0 || prio >= LMW_POOL_CLASSES || weight < 1 || weight > LMW_POOL_MAX_WEIGHT) {
+        errno = EINVAL;
+        return -1;
+    }
+    pool->classes[prio].weight = weight;
+    __LMW_pool_schedule(pool);
+    return 0;
+}
+
+int LMW_pool_set_expiry(LMW_pool *pool, int prio, int action) {
+    if (!pool || prio < 0 || prio >= LMW_POOL_CLASSES
+        || (action != LMW_EXPIRED_DROP && action != LMW_EXPIRED_DOWNGRADE)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pool->classes[prio].expiry = action;
+    return 0;
+}
+
+int LMW_pool_stats(LMW_pool *pool, int prio, LMW_pool_class_stats *st) {
+    if (!pool || !st || prio < 0 || prio >= LMW_POOL_CLASSES) {
+        errno = EINVAL;
+        return -1;
+    }
+    __LMW_class *q = &pool->classes[prio];
+    st->depth = atomic_load(&q->depth);
+    st->submitted = atomic_load(&q->submitted);
+    st->sent = atomic_load(&q->sent);
+    st->expired = atomic_load(&q->expired);
+    st->downgraded = atomic_load(&q->downgraded);
+    st->wait_mean_ms = st->sent ? atomic_load(&q->wait_ns) / 1e6 / st->sent : 0;
+    st->wait_max_ms = atomic_load(&q->wait_max_ns) / 1e6;
+    return 0;
+}
+
+void LMW_pool_set_borrow(LMW_pool *pool, int borrow) {
+    if (pool) pool->borrow = borrow;
+}
+
+void LMW_pool_drain(LMW_pool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->drain_mutex);
+    while (atomic_load(&pool->completed) != atomic_load(&pool->submitted))
+        pthread_cond_wait(&pool->drain_cond, &pool->drain_mutex);
+    pthread_mutex_unlock(&pool->drain_mutex);
+}
+
+void LMW_pool_destroy(LMW_pool *pool) {
+    if (!pool) return;
+    LMW_pool_drain(pool);
+    // each worker stops when it finds the queues empty
+    atomic_store(&pool->stopping, 1);
+    for (int i = 0; i < pool->nworkers; i++)
+        sem_post(&pool->items);
+    for (int i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    for (int c = 0; c < LMW_POOL_CLASSES; c++) {
+        sem_destroy(&pool->classes[c].slots);
+        free(pool->classes[c].cells);
+    }
+    sem_destroy(&pool->items);
+    pthread_mutex_destroy(&pool->drain_mutex);
+    pthread_cond_destroy(&pool->drain_cond);
+    free(pool->workers);
+    free(pool);
+}
+
+
+/* ========== DEFAULT POOL ========== */
+
+static _Atomic(LMW_pool*) __LMW_default_pool = NULL;
+static pthread_mutex_t __LMW_default_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void LMW_thread_set_pool(LMW_pool *pool) {
+    atomic_store(&__LMW_default_pool, pool);
+}
+
+static LMW_pool* __LMW_get_default_pool(void) {
+    LMW_pool *pool = atomic_load(&__LMW_default_pool);
+    if (pool) return pool;
+    pthread_mutex_lock(&__LMW_default_pool_mutex);
+    pool = atomic_load(&__LMW_default_pool);
+    if (!pool) {
+        pool = LMW_pool_create(LMW_POOL_WORKERS, LMW_POOL_QUEUE);
+        atomic_store(&__LMW_default_pool, pool);
+    }
+    pthread_mutex_unlock(&__LMW_default_pool_mutex);
+    return pool;
 }
 
+/**
+ * Start sending email asynchronously using pthread with extra arguments
+ * Returns: context pointer on success, NULL on failure
+ */
+LMW_thread_context* LMW_send_email_argv_thread_start(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]) {
+    return LMW_pool_submit(__LMW_get_default_pool(), cfg, recipient, subject, body, argc, argv);
+}
 /**
  * Convenience wrapper for the simple case (no extra args)
  * Returns: context pointer on success, NULL on failure
@@ -136,10 +661,10 @@ LMW_thread_context* LMW_send_email_thread_start(LMW_config *cfg, char *recipient
 int LMW_send_email_thread_wait(LMW_thread_context *ctx) {
     if (!ctx) return LMW_ERROR_CANNOT_CALL;
     
-    // Wait for thread to complete
-    pthread_join(ctx->thread, NULL);
-    
+    // Wait for the email to be sent
     pthread_mutex_lock(&ctx->mutex);
+    while (!ctx->completed)
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
     int result = ctx->result;
     pthread_mutex_unlock(&ctx->mutex);
     
@@ -1,3 +1,32 @@
+#ifndef __LMW_SEND_EMAIL_IN_THREAD_H__
+#define __LMW_SEND_EMAIL_IN_THREAD_H__
+
+#include <pthread.h>
+#include <time.h>
+#include "LMW_send_email.h"
+
+// defaults for the pool used by LMW_send_email_argv_thread_start()
+#define LMW_POOL_WORKERS 8
+#define LMW_POOL_QUEUE   1024
+
+// priority classes of a pool, each with its own queue; 0 is the most urgent
+#define LMW_PRIO_URGENT   0
+#define LMW_PRIO_NORMAL   1   // used by LMW_pool_submit() and LMW_pool_try_submit()
+#define LMW_PRIO_BULK     2
+#define LMW_POOL_CLASSES  3
+
+// default weights of the classes, see LMW_pool_set_weight()
+#define LMW_POOL_WEIGHT_URGENT  8
+#define LMW_POOL_WEIGHT_NORMAL  4
+#define LMW_POOL_WEIGHT_BULK    1
+#define LMW_POOL_MAX_WEIGHT     64
+
+// what is done with an email whose deadline passes while it is queued
+#define LMW_EXPIRED_DROP       0   // it completes with LMW_ERROR_EXPIRED (the default)
+#define LMW_EXPIRED_DOWNGRADE  1   // it is queued again in the next class, without deadline
+
+// a fixed set of threads sending emails, fed by bounded queues
+typedef struct LMW_pool LMW_pool;
 
 typedef struct {
     LMW_config *cfg;
@@ -6,14 +35,20 @@ typedef struct {
     char *body;
     int argc;
     char **argv;
-    pthread_t thread;
+    LMW_pool *pool;
+    int priority;           // the class it is queued in
+    long long queued_ns;    // when it was queued, CLOCK_MONOTONIC
+    long long deadline_ns;  // CLOCK_MONOTONIC, 0 if none
     int result;
     int completed;
     pthread_mutex_t mutex;
+    pthread_cond_t cond;
 } LMW_thread_context;
 
 /**
- * Start sending email asynchronously using pthread with extra arguments
+ * Start sending email asynchronously using pthread with extra arguments;
+ * the email is queued in the default pool (see LMW_thread_set_pool()),
+ * this call blocks while its queue is full
  * Returns: context pointer on success, NULL on failure
  */
 LMW_thread_context* LMW_send_email_argv_thread_start(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
@@ -38,6 +73,115 @@ int LMW_send_email_thread_wait(LMW_thread_context *ctx);
 int LMW_send_email_thread_check(LMW_thread_context *ctx);
 
 
+/**
+ * Create a pool of `workers` threads, sending the emails queued
+ * in LMW_POOL_CLASSES queues of `queue_size` entries (rounded up to a power of 2)
+ * Returns: the pool, or NULL on failure
+ */
+LMW_pool* LMW_pool_create(int workers, int queue_size);
+
+/**
+ * Queue an email in the pool, blocking while the queue is full;
+ * then use LMW_send_email_thread_check() and LMW_send_email_thread_wait()
+ * on the returned context
+ * Returns: context pointer on success, NULL on failure
+ */
+LMW_thread_context* LMW_pool_submit(LMW_pool *pool, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
+
+/**
+ * As LMW_pool_submit() , but does not block
+ * Returns: context pointer on success, NULL on failure, and errno is EAGAIN if the queue is full
+ */
+LMW_thread_context* LMW_pool_try_submit(LMW_pool *pool, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
+
+/**
+ * As LMW_pool_submit() , in the queue of class `prio` (one of LMW_PRIO_*),
+ * blocking while that queue is full; if `deadline` is not NULL, it is an
+ * absolute CLOCK_MONOTONIC time: if a worker takes the email after it,
+ * the mailer is not started, and the email is dropped or downgraded
+ * as set by LMW_pool_set_expiry()
+ * Returns: context pointer on success, NULL on failure
+ */
+LMW_thread_context* LMW_pool_submit_prio(LMW_pool *pool, int prio, const struct timespec *deadline, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
+
+/**
+ * As LMW_pool_submit_prio() , but does not block
+ * Returns: context pointer on success, NULL on failure, and errno is EAGAIN if the queue is full
+ */
+LMW_thread_context* LMW_pool_try_submit_prio(LMW_pool *pool, int prio, const struct timespec *deadline, LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[]);
+
+/**
+ * Idle workers take the emails of the classes in proportion to their
+ * weights, from 1 to LMW_POOL_MAX_WEIGHT, interleaved; the queue of
+ * a class that is empty is skipped. Call it before submitting emails
+ * Returns: 0 on success, -1 (and errno EINVAL) on bad arguments
+ */
+int LMW_pool_set_weight(LMW_pool *pool, int prio, int weight);
+
+/**
+ * What is done with the emails of class `prio` that expire while
+ * queued, one of LMW_EXPIRED_* ; an email is downgraded only if the
+ * queue of the next class has room, and the last class always drops
+ * Returns: 0 on success, -1 (and errno EINVAL) on bad arguments
+ */
+int LMW_pool_set_expiry(LMW_pool *pool, int prio, int action);
+
+// the counters of a class of a pool, see LMW_pool_stats()
+typedef struct {
+    unsigned long depth;        // emails in the queue now
+    unsigned long submitted;    // emails queued, also by downgrade from the previous class
+    unsigned long sent;         // emails taken by a worker and sent
+    unsigned long expired;      // emails dropped with LMW_ERROR_EXPIRED
+    unsigned long downgraded;   // emails moved to the next class
+    double wait_mean_ms;        // time in the queue of the emails sent
+    double wait_max_ms;
+} LMW_pool_class_stats;
+
+/**
+ * Read the counters of class `prio` of the pool, since it was created
+ * Returns: 0 on success, -1 (and errno EINVAL) on bad arguments
+ */
+int LMW_pool_stats(LMW_pool *pool, int prio, LMW_pool_class_stats *st);
+
+/**
+ * If `borrow` is nonzero, the strings and argv given to LMW_pool_submit()
+ * and LMW_pool_try_submit() are not copied: the caller must keep them
+ * valid and unchanged until LMW_send_email_thread_wait() returns.
+ * Otherwise (the default) they are copied, in one allocation with the context
+ */
+void LMW_pool_set_borrow(LMW_pool *pool, int borrow);
+
+/**
+ * Wait until all emails queued in the pool have been sent
+ */
+void LMW_pool_drain(LMW_pool *pool);
+
+/**
+ * Send the emails still queued, then stop the threads and free the pool;
+ * no email must be submitted while the pool is being destroyed
+ */
+void LMW_pool_destroy(LMW_pool *pool);
+
+/**
+ * Use `pool` in LMW_send_email_argv_thread_start() and LMW_send_email_thread_start() ;
+ * if this is not called, a pool of LMW_POOL_WORKERS threads
+ * and a queue of LMW_POOL_QUEUE entries is created at first use
+ */
+void LMW_thread_set_pool(LMW_pool *pool);
 
+// allocations of the contexts by all pools, see LMW_pool_alloc_counts()
+typedef struct {
+    unsigned long long mallocs;   // arenas obtained with malloc()
+    unsigned long long reused;    // arenas taken again from a free list of the thread
+    unsigned long long freed;     // arenas given back with free()
+} LMW_alloc_counts;
 
+/**
+ * Each context, with the copies of its strings, is a single allocation,
+ * that is kept in a free list of the thread that frees it (with
+ * LMW_send_email_thread_wait()) and reused by its next submissions;
+ * this counts them, since the program started
+ */
+void LMW_pool_alloc_counts(LMW_alloc_counts *counts);
 
+#endif // __LMW_SEND_EMAIL_IN_THREAD_H__
@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MIME messages for mailers as sendmail -t
+ *
+ * The message is produced piece by piece by LMW_mime_read() : the headers,
+ * then each part, reading and encoding an attachment LMW_MIME_CHUNK bytes
+ * at a time. Base64 is encoded by a kernel chosen once for the CPU:
+ * on x86 with the pshufb method of W. Mula and D. Lemire (12 bytes to 16
+ * characters per 128 bit lane), on ARM64 with table lookups of NEON.
+ * Text parts are scanned by LMW_text_scan() , and encoded in quoted-printable
+ * only if they are not short lines of ASCII.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LMW_BASE64_X86
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define LMW_BASE64_NEON
+#endif
+#include "LMW_send_email.h"
+#include "LMW_send_email_mime.h"
+
+/* ========== BASE64 ========== */
+
+static const char __LMW_b64_table[64] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t LMW_base64_encode_scalar(const void *in, size_t n, char *out)
+{
+  const unsigned char *s = in;
+  char *o = out;
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    uint32_t v = (uint32_t) s[i] << 16 | (uint32_t) s[i + 1] << 8 | s[i + 2];
+    *o++ = __LMW_b64_table[v >> 18];
+    *o++ = __LMW_b64_table[(v >> 12) & 63];
+    *o++ = __LMW_b64_table[(v >> 6) & 63];
+    *o++ = __LMW_b64_table[v & 63];
+  }
+  if (i < n) {
+    uint32_t v = (uint32_t) s[i] << 16 | (i + 1 < n ? (uint32_t) s[i + 1] << 8 : 0);
+    *o++ = __LMW_b64_table[v >> 18];
+    *o++ = __LMW_b64_table[(v >> 12) & 63];
+    *o++ = i + 1 < n ? __LMW_b64_table[(v >> 6) & 63] : '=';
+    *o++ = '=';
+  }
+  return o - out;
+}
+
+#ifdef LMW_BASE64_X86
+/*
+  Each 32 bit lane gets 3 input bytes as [b1 b0 b2 b1]; two multiplications
+  move the four 6 bit fields to the low bits of the four bytes; then
+  the index is mapped to its character by adding an offset, that depends
+  on the range of the index and is looked up with pshufb.
+*/
+__attribute__((target("ssse3")))
+static inline __m128i __LMW__b64_sse_fields(__m128i v)
+{
+  v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i __LMW__b64_sse_chars(__m128i idx)
+{
+  // 0..25 -> 13 , 26..51 -> 0 , 52..61 -> 1..10 , 62 -> 11 , 63 -> 12
+  __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				      '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t __LMW__b64_ssse3(const void *in, size_t n, char *out)
+{
+  const unsigned char *s = in;
+  size_t i = 0, o = 0;
+  // each step reads 16 bytes, and uses 12
+  for (; i + 16 <= n; i += 12, o += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    _mm_storeu_si128((__m128i *) (out + o), __LMW__b64_sse_chars(__LMW__b64_sse_fields(v)));
+  }
+  return o + LMW_base64_encode_scalar(s + i, n - i, out + o);
+}
+
+__attribute__((target("avx2")))
+static size_t __LMW__b64_avx2(const void *in, size_t n, char *out)
+{
+  const unsigned char *s = in;
+  size_t i = 0, o = 0;
+  const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+				       10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					 '/' - 63, 'A', 0, 0,
+					 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					 '/' - 63, 'A', 0, 0);
+  // each step reads 12 + 16 bytes, and uses 24: 12 in each 128 bit lane
+  for (; i + 28 <= n; i += 24, o += 32) {
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (s + i))),
+					_mm_loadu_si128((const __m128i *) (s + i + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuf);
+    __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i *) (out + o), _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx));
+  }
+  return o + __LMW__b64_ssse3(s + i, n - i, out + o);
+}
+#endif // LMW_BASE64_X86
+
+#ifdef LMW_BASE64_NEON
+static size_t __LMW__b64_neon(const void *in, size_t n, char *out)
+{
+  const unsigned char *s = in;
+  size_t i = 0, o = 0;
+  const uint8_t *t = (const uint8_t *) __LMW_b64_table;
+  uint8x16x4_t table = { { vld1q_u8(t), vld1q_u8(t + 16), vld1q_u8(t + 32), vld1q_u8(t + 48) } };
+  const uint8x16_t m6 = vdupq_n_u8(0x3f);
+  // 48 bytes, split in their first, second and third of each 3, give 64 characters
+  for (; i + 48 <= n; i += 48, o += 64) {
+    uint8x16x3_t v = vld3q_u8(s + i);
+    uint8x16x4_t c;
+    c.val[0] = vshrq_n_u8(v.val[0], 2);
+    c.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[1], 4), vshlq_n_u8(v.val[0], 4)), m6);
+    c.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[2], 6), vshlq_n_u8(v.val[1], 2)), m6);
+    c.val[3] = vandq_u8(v.val[2], m6);
+    for (int k = 0; k < 4; k++)
+      c.val[k] = vqtbl4q_u8(table, c.val[k]);
+    vst4q_u8((uint8_t *) (out + o), c);
+  }
+  return o + LMW_base64_encode_scalar(s + i, n - i, out + o);
+}
+#endif // LMW_BASE64_NEON
+
+typedef size_t (*__LMW_b64_fn)(const void *in, size_t n, char *out);
+
+static __LMW_b64_fn __LMW_b64 = LMW_base64_encode_scalar;
+static const char *__LMW_b64_name = "scalar";
+static pthread_once_t __LMW_b64_once = PTHREAD_ONCE_INIT;
+
+static void __LMW__b64_init(void)
+{
+  const char *force = getenv("LMW_BASE64");
+  if (force && !*force)
+    force = NULL;
+  if (force && !strcmp(force, "scalar"))
+    return;
+#ifdef LMW_BASE64_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (!force || !strcmp(force, "avx2"))) {
+    __LMW_b64 = __LMW__b64_avx2;
+    __LMW_b64_name = "avx2";
+  } else if (__builtin_cpu_supports("ssse3") && (!force || !strcmp(force, "ssse3") || !strcmp(force, "avx2"))) {
+    __LMW_b64 = __LMW__b64_ssse3;
+    __LMW_b64_name = "ssse3";
+  }
+#endif
+#ifdef LMW_BASE64_NEON
+  __LMW_b64 = __LMW__b64_neon;
+  __LMW_b64_name = "neon";
+#endif
+}
+
+size_t LMW_base64_encode(const void *in, size_t n, char *out)
+{
+  pthread_once(&__LMW_b64_once, __LMW__b64_init);
+  return __LMW_b64(in, n, out);
+}
+
+const char *LMW_base64_kernel(void)
+{
+  pthread_once(&__LMW_b64_once, __LMW__b64_init);
+  return __LMW_b64_name;
+}
+
+/* encodes in lines of 76 characters, each ending in a newline; returns the length */
+static size_t __LMW__base64_lines(const void *in, size_t n, char *out)
+{
+  size_t k = LMW_base64_encode(in, n, out);
+  size_t lines = (k + 75) / 76;
+  // spread the lines from the last, that moves the most
+  for (size_t l = lines; l-- > 0; ) {
+    size_t len = k - l * 76 < 76 ? k - l * 76 : 76;
+    memmove(out + l * 77, out + l * 76, len);
+    out[l * 77 + len] = '\n';
+  }
+  return k + lines;
+}
+
+/* ========== QUOTED-PRINTABLE ========== */
+
+// the bytes that stand for themselves, but for spaces and tabs at the end of a line
+static const unsigned char __LMW_qp_plain[256] = {
+  ['\t'] = 1, [' '] = 1,
+  [33 ... 60] = 1, [62 ... 126] = 1,     // not '='
+};
+
+size_t LMW_qp_encode(const char *in, size_t n, char *out)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char *s = (const unsigned char *) in;
+  char *o = out;
+  size_t col = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if (c == '\n' || (c == '\r' && i + 1 < n && s[i + 1] == '\n')) {
+      i += (c == '\r');
+      *o++ = '\n';
+      col = 0;
+      continue;
+    }
+    // a space or tab at the end of a line would be removed in transit
+    int plain = __LMW_qp_plain[c] &&
+      !((c == ' ' || c == '\t') && (i + 1 == n || s[i + 1] == '\n' || s[i + 1] == '\r'));
+    size_t k = plain ? 1 : 3;
+    if (col + k > 75) {
+      *o++ = '=';
+      *o++ = '\n';
+      col = 0;
+    }
+    if (plain)
+      *o++ = c;
+    else {
+      *o++ = '=';
+      *o++ = hex[c >> 4];
+      *o++ = hex[c & 15];
+    }
+    col += k;
+  }
+  return o - out;
+}
+
+/* ========== MESSAGE ========== */
+
+typedef struct {
+  char *head;    // the boundary and the headers of the part
+  char *text;    // the content of a text part, or NULL
+  int fd;        // or the attachment
+} __LMW_mime_part;
+
+// what LMW_mime_read() produces next
+enum { __LMW_MIME_HEAD, __LMW_MIME_PART_HEAD, __LMW_MIME_PART_BODY, __LMW_MIME_END, __LMW_MIME_DONE };
+
+struct LMW_mime {
+  char *to;
+  char *head;                 // headers of the message
+  char boundary[32];
+  __LMW_mime_part *part;
+  int nparts, cap;
+  // while producing
+  int state, cur;
+  const char *out;            // ready to be copied
+  size_t out_len;
+  unsigned char *raw;         // a chunk of an attachment
+  char *enc;                  // and its encoding
+  char end[48];               // the closing boundary
+};
+
+LMW_mime *LMW_mime_new(const char *from, const char *to, const char *subject)
+{
+  const unsigned bad = LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL;
+  if (!to || !subject || (LMW_text_scan(to, strlen(to), 0) & bad) ||
+      (from && (LMW_text_scan(from, strlen(from), 0) & bad))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  char *subj = LMW_header_encode(subject, 1);
+  if (!subj)
+    return NULL;
+  LMW_mime *m = calloc(1, sizeof(LMW_mime));
+  if (!m) {
+    free(subj);
+    return NULL;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  unsigned long long r = ((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+    ((unsigned long long) getpid() << 40) ^ (unsigned long long) (uintptr_t) m;
+  // '=' and '_' do not occur in base64 lines
+  snprintf(m->boundary, sizeof(m->boundary), "=_LMW_%016llx", r * 0x9E3779B97F4A7C15ULL);
+  snprintf(m->end, sizeof(m->end), "\n--%s--\n", m->boundary);
+  m->to = strdup(to);
+  size_t l = strlen(to) + strlen(subj) + (from ? strlen(from) : 0) + 200;
+  m->head = malloc(l);
+  if (!m->to || !m->head) {
+    free(subj);
+    LMW_mime_free(m);
+    errno = ENOMEM;
+    return NULL;
+  }
+  snprintf(m->head, l, "%s%s%sTo: %s\nSubject: %s\nMIME-Version: 1.0\n"
+	   "Content-Type: multipart/mixed; boundary=\"%s\"\n\n"
+	   "This is a message in MIME format.\n",
+	   from ? "From: " : "", from ? from : "", from ? "\n" : "", to, subj, m->boundary);
+  free(subj);
+  return m;
+}
+
+static __LMW_mime_part *__LMW__mime_part(LMW_mime *m, size_t head_len)
+{
+  if (m->nparts == m->cap) {
+    int cap = m->cap ? 2 * m->cap : 4;
+    __LMW_mime_part *p = realloc(m->part, cap * sizeof(__LMW_mime_part));
+    if (!p)
+      return NULL;
+    m->part = p;
+    m->cap = cap;
+  }
+  __LMW_mime_part *p = &m->part[m->nparts];
+  *p = (__LMW_mime_part) { .fd = -1 };
+  if (!(p->head = malloc(head_len + sizeof(m->boundary) + 8)))
+    return NULL;
+  m->nparts++;
+  return p;
+}
+
+int LMW_mime_add_text(LMW_mime *m, const char *text)
+{
+  if (!m || !text) {
+    errno = EINVAL;
+    return -1;
+  }
+  // short lines of ASCII are sent as they are, else in quoted-printable
+  size_t n = strlen(text);
+  int qp = LMW_text_scan(text, n, 998) & (LMW_SCAN_8BIT | LMW_SCAN_CONTROL | LMW_SCAN_LONG_LINE);
+  char *t = malloc(qp ? 4 * n + 1 : n + 1);
+  if (t && qp)
+    t[LMW_qp_encode(text, n, t)] = 0;
+  else if (t)
+    memcpy(t, text, n + 1);
+  const char *h = qp ? "Content-Type: text/plain; charset=utf-8\nContent-Transfer-Encoding: quoted-printable\n\n"
+    : "Content-Type: text/plain; charset=utf-8\nContent-Transfer-Encoding: 7bit\n\n";
+  __LMW_mime_part *p = t ? __LMW__mime_part(m, strlen(h)) : NULL;
+  if (!p) {
+    free(t);
+    errno = ENOMEM;
+    return -1;
+  }
+  sprintf(p->head, "\n--%s\n%s", m->boundary, h);
+  p->text = t;
+  return 0;
+}
+
+int LMW_mime_add_fd(LMW_mime *m, int fd, const char *filename, const char *content_type)
+{
+  if (!m || fd < 0 || !filename || strchr(filename, '"') ||
+      (LMW_text_scan(filename, strlen(filename), 0) & (LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL)) ||
+      (content_type && (LMW_text_scan(content_type, strlen(content_type), 0) & (LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL)))) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!content_type)
+    content_type = "application/octet-stream";
+  size_t l = 2 * strlen(filename) + strlen(content_type) + 128;
+  __LMW_mime_part *p = __LMW__mime_part(m, l);
+  if (!p) {
+    errno = ENOMEM;
+    return -1;
+  }
+  sprintf(p->head, "\n--%s\nContent-Type: %s; name=\"%s\"\nContent-Transfer-Encoding: base64\n"
+	  "Content-Disposition: attachment; filename=\"%s\"\n\n", m->boundary, content_type, filename, filename);
+  p->fd = fd;
+  return 0;
+}
+
+/* reads a whole chunk, or up to the end of file; returns as read(2) */
+static ssize_t __LMW__mime_fill(int fd, unsigned char *buf, size_t n)
+{
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = read(fd, buf + got, n - got);
+    if (r == 0)
+      break;
+    if (r == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    got += r;
+  }
+  return got;
+}
+
+/* prepares the next piece in m->out ; returns 1, 0 at the end, or -1 */
+static int __LMW__mime_next(LMW_mime *m)
+{
+  for (;;) {
+    switch (m->state) {
+    case __LMW_MIME_HEAD:
+      m->out = m->head;
+      m->out_len = strlen(m->head);
+      m->state = __LMW_MIME_PART_HEAD;
+      return 1;
+    case __LMW_MIME_PART_HEAD:
+      if (m->cur == m->nparts) {
+	m->state = __LMW_MIME_END;
+	continue;
+      }
+      m->out = m->part[m->cur].head;
+      m->out_len = strlen(m->out);
+      m->state = __LMW_MIME_PART_BODY;
+      return 1;
+    case __LMW_MIME_PART_BODY: {
+      __LMW_mime_part *p = &m->part[m->cur];
+      if (p->text) {
+	m->out = p->text;
+	m->out_len = strlen(p->text);
+	m->state = __LMW_MIME_PART_HEAD;
+	m->cur++;
+	return 1;
+      }
+      if (!m->raw) {
+	m->raw = malloc(LMW_MIME_CHUNK);
+	m->enc = malloc(LMW_MIME_CHUNK / 3 * 4 + LMW_MIME_CHUNK / 57);
+	if (!m->raw || !m->enc)
+	  return -1;
+      }
+      ssize_t r = __LMW__mime_fill(p->fd, m->raw, LMW_MIME_CHUNK);
+      if (r == -1)
+	return -1;
+      if (r == 0) {
+	m->state = __LMW_MIME_PART_HEAD;
+	m->cur++;
+	continue;
+      }
+      m->out = m->enc;
+      m->out_len = __LMW__base64_lines(m->raw, r, m->enc);
+      return 1;
+    }
+    case __LMW_MIME_END:
+      m->out = m->end;
+      m->out_len = strlen(m->end);
+      m->state = __LMW_MIME_DONE;
+      return 1;
+    default:
+      return 0;
+    }
+  }
+}
+
+ssize_t LMW_mime_read(void *ctx, char *buf, size_t n)
+{
+  LMW_mime *m = ctx;
+  size_t got = 0;
+  while (got < n) {
+    if (m->out_len == 0) {
+      int r = __LMW__mime_next(m);
+      if (r == -1)
+	return -1;
+      if (r == 0)
+	break;
+      continue;
+    }
+    size_t k = m->out_len < n - got ? m->out_len : n - got;
+    memcpy(buf + got, m->out, k);
+    m->out += k;
+    m->out_len -= k;
+    got += k;
+  }
+  return got;
+}
+
+int LMW_mime_send(LMW_config *cfg, LMW_mime *m, int argc, char *argv[])
+{
+  char *args[argc + 2];
+  args[0] = "-t";
+  args[1] = "-i";
+  for (int j = 0; j < argc; j++)
+    args[2 + j] = argv[j];
+  return LMW_send_message_pull(cfg, m ? m->to : NULL, m ? LMW_mime_read : NULL, m, argc + 2, args);
+}
+
+void LMW_mime_free(LMW_mime *m)
+{
+  if (!m)
+    return;
+  for (int j = 0; j < m->nparts; j++) {
+    free(m->part[j].head);
+    free(m->part[j].text);
+  }
+  free(m->part);
+  free(m->to);
+  free(m->head);
+  free(m->raw);
+  free(m->enc);
+  free(m);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LMW_SEND_EMAIL_MIME_H__
+#define __LMW_SEND_EMAIL_MIME_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "LMW_send_email.h"
+
+// bytes of an attachment that are read and encoded at once; a multiple of 57,
+// the bytes of a line of 76 base64 characters
+#define LMW_MIME_CHUNK (57 * 1024)
+
+// a multipart/mixed message, produced piece by piece
+typedef struct LMW_mime LMW_mime;
+
+/***
+   LMW_mime_new()
+
+   Creates a message with these headers (`from` may be NULL, for the
+   default of the mailer); the strings are copied, and the subject is
+   encoded by LMW_header_encode() if it is not ASCII.
+
+   Returns: the message, or NULL on failure (and errno is set, to EINVAL
+   if a header contains newlines or control characters)
+*/
+LMW_mime *LMW_mime_new(const char *from, const char *to, const char *subject);
+
+/* adds a text/plain part, in UTF-8; the text is copied, in quoted-printable
+   if it has bytes >= 128, control characters or lines longer than 998 bytes.
+   Returns 0, or -1 and errno */
+int LMW_mime_add_text(LMW_mime *m, const char *text);
+
+/***
+   LMW_mime_add_fd()
+
+   Adds an attachment, that is read from `fd` until the end of file only
+   when the message is produced, and encoded in base64 LMW_MIME_CHUNK
+   bytes at a time; `fd` is not closed. `content_type` may be NULL, for
+   "application/octet-stream". They must not contain newlines, control
+   characters, and `filename` double quotes.
+
+   Returns: 0, or -1 and errno
+*/
+int LMW_mime_add_fd(LMW_mime *m, int fd, const char *filename, const char *content_type);
+
+/***
+   LMW_mime_read()
+
+   An LMW_body_reader (with `ctx` the message) that produces the whole
+   message, headers included; it returns 0 at the end, and -1 if an
+   attachment cannot be read. A message can be produced only once.
+*/
+ssize_t LMW_mime_read(void *ctx, char *buf, size_t n);
+
+/***
+   LMW_mime_send()
+
+   Sends the message with LMW_send_message_pull() , calling
+   "cfg->mailer -t -i argv..." , as with sendmail(8); so cfg->mailer
+   must be such a mailer, e.g. "/usr/sbin/sendmail".
+   The message is not kept in memory, only a chunk of it at a time.
+
+   Returns: as LMW_send_email()
+*/
+int LMW_mime_send(LMW_config *cfg, LMW_mime *m, int argc, char *argv[]);
+
+void LMW_mime_free(LMW_mime *m);
+
+/***
+   LMW_base64_encode()
+
+   Encodes `n` bytes in base64, without line breaks, in `out` , that must
+   have room for 4 * ((n + 2) / 3) characters (no null is appended).
+   Uses AVX2 or SSSE3 on x86, NEON on ARM64, as the CPU supports; the
+   environment variable LMW_BASE64 may force one of them, or "scalar".
+
+   Returns: the characters written
+*/
+size_t LMW_base64_encode(const void *in, size_t n, char *out);
+/* the same, a byte at a time */
+size_t LMW_base64_encode_scalar(const void *in, size_t n, char *out);
+/* the name of the kernel used by LMW_base64_encode() */
+const char *LMW_base64_kernel(void);
+
+/***
+   LMW_qp_encode()
+
+   Encodes `n` bytes in quoted-printable (RFC 2045) in `out` , that must
+   have room for 4 * n characters (no null is appended): in lines of at
+   most 76 characters, the newlines (or CR LF) of the text as newlines.
+
+   Returns: the characters written
+*/
+size_t LMW_qp_encode(const char *in, size_t n, char *out);
+
+#endif // __LMW_SEND_EMAIL_MIME_H__
@@ -0,0 +1,852 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent outbox for LMW_send_email_argv()
+ *
+ * The journal is a file, mapped in memory, that starts with a header
+ * and continues with records, appended one after the other: an EMAIL record
+ * when an email is enqueued, a DONE record when it was sent (or dropped).
+ * At open, the EMAIL records without a DONE record are sent again.
+ *
+ * Each record has a CRC and the generation of the journal: the scan stops
+ * at the first record that is torn, or that is left from a previous generation.
+ * When no email is pending, the journal is emptied by starting a new generation.
+ * When most of it is taken by emails already sent, the pending ones are
+ * copied in a new generation, in a new file that is synced and then
+ * renamed over the journal (so that a crash leaves either journal whole).
+ * The copy is written and synced without the mutex, so that enqueueing
+ * does not wait for it; the records appended meanwhile follow it.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "LMW_send_email.h"
+#include "LMW_send_email_outbox.h"
+
+// warning: this assumes that there is a variable called "cfg"
+// of type  "LMW_config *cfg"
+#define LMW_log_error( msg, ...) \
+  { if (cfg && cfg->log_error ) cfg->log_error(msg, ##__VA_ARGS__);}
+
+#define LMW_OUTBOX_MAGIC    0x584f424cU   // "LBOX"
+#define LMW_RECORD_MAGIC    0x4345524cU   // "LREC"
+#define LMW_OUTBOX_VERSION  1
+#define LMW_OUTBOX_DATA     64            // offset of the first record
+#define LMW_OUTBOX_INITIAL  (1 << 20)     // initial size of the journal
+#define LMW_OUTBOX_COMPACT  2             // compact when less than 1/2 of the journal is pending
+
+#define LMW_REC_EMAIL 1
+#define LMW_REC_DONE  2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t generation;
+} __LMW_journal_header;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;        // LMW_REC_EMAIL or LMW_REC_DONE
+  uint64_t generation;
+  uint64_t id;          // of the email
+  uint32_t len;         // of the payload that follows
+  uint32_t crc;         // of this header (with crc=0) and of the payload
+} __LMW_record;
+
+// records are aligned to 8 bytes
+#define LMW_RECORD_SIZE(len) ((sizeof(__LMW_record) + (len) + 7) & ~(size_t)7)
+
+typedef struct {
+  uint64_t id;
+  size_t offset;        // of the EMAIL record
+  int attempts;
+  long long next_try;   // monotonic time, in nanoseconds
+} __LMW_pending;
+
+struct LMW_outbox {
+  LMW_config *cfg;
+  LMW_outbox_config ocfg;
+  char *path;
+  int fd;
+  char *map;            // maps ocfg.max_size bytes, only file_size are backed by the file
+  size_t file_size;
+  size_t tail;          // end of the last record
+  uint64_t generation;
+  uint64_t next_id;
+  __LMW_pending *pending;
+  int npending, apending;
+  unsigned long long written, synced; // bytes ever appended, and written to disk
+  int flush_requested;
+  int sync_error;
+  int stop;
+  int compacting;       // a compaction is writing the new file, without the mutex
+  unsigned long long compact_mark; // written, when that compaction started
+  unsigned int seed;    // for the jitter
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;   // for the drainer
+  pthread_cond_t dirty_cond;  // for the flusher
+  pthread_cond_t synced_cond; // for LMW_outbox_flush()
+  pthread_cond_t compact_cond; // for the end of a compaction
+  pthread_t drainer, flusher;
+};
+
+void LMW_outbox_config_init(LMW_outbox_config *ocfg)
+{
+  *ocfg = (LMW_outbox_config) {
+    .sync_interval = LMW_OUTBOX_SYNC_INTERVAL,
+    .retry_min = LMW_OUTBOX_RETRY_MIN,
+    .retry_max = LMW_OUTBOX_RETRY_MAX,
+    .max_attempts = LMW_OUTBOX_MAX_ATTEMPTS,
+    .max_size = LMW_OUTBOX_MAX_SIZE,
+  };
+}
+
+/* ========== UTILITIES ========== */
+
+static uint32_t __LMW_crc_table[256];
+static pthread_once_t __LMW_crc_once = PTHREAD_ONCE_INIT;
+
+static void __LMW__crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    __LMW_crc_table[i] = c;
+  }
+}
+
+static uint32_t __LMW__crc32(uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  crc = ~crc;
+  while (len--)
+    crc = __LMW_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t __LMW__record_crc(const __LMW_record *rec)
+{
+  __LMW_record h = *rec;
+  h.crc = 0;
+  uint32_t crc = __LMW__crc32(0, &h, sizeof(h));
+  return __LMW__crc32(crc, rec + 1, rec->len);
+}
+
+static long long __LMW__now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct timespec __LMW__ns_to_timespec(long long ns)
+{
+  return (struct timespec) { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+}
+
+/* ========== JOURNAL ========== */
+
+static int __LMW_journal_compact(LMW_outbox *ob);
+
+/* make room for `size` more bytes; returns 0, or -1 if the journal is full */
+static int __LMW_journal_reserve(LMW_outbox *ob, size_t size)
+{
+  if (ob->tail + size <= ob->file_size)
+    return 0;
+  if (ob->tail + size > ob->ocfg.max_size) {
+    // another thread may be compacting it already
+    while (ob->compacting)
+      pthread_cond_wait(&ob->compact_cond, &ob->mutex);
+    if (ob->tail + size > ob->ocfg.max_size)
+      __LMW_journal_compact(ob);
+  }
+  if (ob->tail + size <= ob->file_size)
+    return 0;
+  size_t new_size = ob->file_size;
+  while (ob->tail + size > new_size)
+    new_size *= 2;
+  if (new_size > ob->ocfg.max_size)
+    new_size = ob->ocfg.max_size;
+  if (ob->tail + size > new_size) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if (ftruncate(ob->fd, new_size) == -1)
+    return -1;
+  ob->file_size = new_size;
+  return 0;
+}
+
+/* append a record; `payload` may be NULL to leave it uninitialized,
+   returns the offset of the record, or -1 */
+static long __LMW_journal_append(LMW_outbox *ob, uint32_t type, uint64_t id,
+				 const void *payload, uint32_t len)
+{
+  size_t size = LMW_RECORD_SIZE(len);
+  if (__LMW_journal_reserve(ob, size) == -1)
+    return -1;
+  size_t offset = ob->tail;
+  __LMW_record *rec = (__LMW_record *) (ob->map + offset);
+  *rec = (__LMW_record) {
+    .magic = LMW_RECORD_MAGIC, .type = type, .generation = ob->generation,
+    .id = id, .len = len, .crc = 0,
+  };
+  if (payload)
+    memcpy(rec + 1, payload, len);
+  ob->tail += size;
+  ob->written += size;
+  pthread_cond_signal(&ob->dirty_cond);
+  return (long) offset;
+}
+
+static void __LMW_journal_write_header(LMW_outbox *ob)
+{
+  __LMW_journal_header *h = (__LMW_journal_header *) ob->map;
+  *h = (__LMW_journal_header) {
+    .magic = LMW_OUTBOX_MAGIC, .version = LMW_OUTBOX_VERSION, .generation = ob->generation,
+  };
+  ob->written += sizeof(*h);
+  pthread_cond_signal(&ob->dirty_cond);
+}
+
+static int __LMW_pending_find(LMW_outbox *ob, uint64_t id)
+{
+  for (int i = 0; i < ob->npending; i++)
+    if (ob->pending[i].id == id)
+      return i;
+  return -1;
+}
+
+static int __LMW_pending_add(LMW_outbox *ob, uint64_t id, size_t offset)
+{
+  if (ob->npending == ob->apending) {
+    int n = ob->apending ? 2 * ob->apending : 64;
+    __LMW_pending *p = realloc(ob->pending, n * sizeof(__LMW_pending));
+    if (!p) return -1;
+    ob->pending = p;
+    ob->apending = n;
+  }
+  ob->pending[ob->npending++] = (__LMW_pending) {
+    .id = id, .offset = offset, .attempts = 0, .next_try = 0,
+  };
+  return 0;
+}
+
+static void __LMW_pending_remove(LMW_outbox *ob, int i)
+{
+  ob->pending[i] = ob->pending[--ob->npending];
+}
+
+/* read the journal and rebuild the list of pending emails; returns 0, or -1 */
+static int __LMW_journal_replay(LMW_outbox *ob)
+{
+  LMW_config *cfg = ob->cfg;
+  __LMW_journal_header *h = (__LMW_journal_header *) ob->map;
+  if (h->magic != LMW_OUTBOX_MAGIC) {
+    // new journal
+    ob->generation = 1;
+    __LMW_journal_write_header(ob);
+    return 0;
+  }
+  if (h->version != LMW_OUTBOX_VERSION) {
+    LMW_log_error("Outbox journal has unknown version %u\n", h->version);
+    errno = EINVAL;
+    return -1;
+  }
+  ob->generation = h->generation;
+
+  size_t offset = LMW_OUTBOX_DATA;
+  while (offset + sizeof(__LMW_record) <= ob->file_size) {
+    __LMW_record *rec = (__LMW_record *) (ob->map + offset);
+    if (rec->magic != LMW_RECORD_MAGIC || rec->generation != ob->generation ||
+	offset + LMW_RECORD_SIZE(rec->len) > ob->file_size ||
+	rec->crc != __LMW__record_crc(rec))
+      break;
+    if (rec->type == LMW_REC_EMAIL) {
+      if (__LMW_pending_add(ob, rec->id, offset) == -1)
+	return -1;
+    } else if (rec->type == LMW_REC_DONE) {
+      int i = __LMW_pending_find(ob, rec->id);
+      if (i >= 0)
+	__LMW_pending_remove(ob, i);
+    }
+    if (rec->id >= ob->next_id)
+      ob->next_id = rec->id + 1;
+    offset += LMW_RECORD_SIZE(rec->len);
+  }
+  ob->tail = offset;
+  if (ob->npending)
+    LMW_log_error("Outbox journal has %d emails to be sent\n", ob->npending);
+  return 0;
+}
+
+/* write the record `rec` to `fd` at `offset`, in generation `generation`; returns 0, or -1 */
+static int __LMW_journal_copy(int fd, const __LMW_record *rec, uint64_t generation, size_t offset)
+{
+  __LMW_record h = *rec;
+  h.generation = generation;
+  h.crc = 0;
+  h.crc = __LMW__crc32(__LMW__crc32(0, &h, sizeof(h)), rec + 1, rec->len);
+  if (pwrite(fd, &h, sizeof(h), offset) != (ssize_t) sizeof(h) ||
+      pwrite(fd, rec + 1, rec->len, offset + sizeof(h)) != (ssize_t) rec->len)
+    return -1;
+  return 0;
+}
+
+static int __LMW__offset_cmp(const void *a, const void *b)
+{
+  size_t x = *(const size_t *) a, y = *(const size_t *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+  Write the pending emails in a new generation of the journal, in a new
+  file that replaces it; returns 0, or -1 (and the journal is unchanged).
+
+  It is called with ob->mutex held, and releases it while the new file is
+  written and synced: the records before ob->tail do not change meanwhile,
+  since they are only appended, and __LMW_journal_reset() waits.
+  Then, with the mutex held again, the records appended meanwhile are
+  copied after the pending ones, and the new file replaces the journal.
+*/
+static int __LMW_journal_compact(LMW_outbox *ob)
+{
+  LMW_config *cfg = ob->cfg;
+  if (ob->compacting)
+    return -1;
+  size_t live = LMW_OUTBOX_DATA;
+  for (int i = 0; i < ob->npending; i++) {
+    __LMW_record *rec = (__LMW_record *) (ob->map + ob->pending[i].offset);
+    live += LMW_RECORD_SIZE(rec->len);
+  }
+  if (live >= ob->tail)
+    return -1;
+  // where the pending EMAIL records are, in the order of the journal, and where they go
+  int n = ob->npending;
+  size_t *from = malloc((2 * (size_t) n + 1) * sizeof(size_t)), *to = from + n;
+  if (!from) {
+    LMW_log_error("Out of memory in outbox, cannot compact journal %s\n", ob->path);
+    return -1;
+  }
+  for (int i = 0; i < n; i++)
+    from[i] = ob->pending[i].offset;
+  qsort(from, n, sizeof(size_t), __LMW__offset_cmp);
+  size_t base = ob->tail;
+  uint64_t generation = ob->generation + 1;
+  ob->compacting = 1;
+  ob->compact_mark = ob->written;
+  pthread_mutex_unlock(&ob->mutex);
+
+  size_t size = LMW_OUTBOX_INITIAL;
+  while (size < live)
+    size *= 2;
+  if (size > ob->ocfg.max_size)
+    size = ob->ocfg.max_size;
+
+  size_t plen = strlen(ob->path);
+  char tmp[plen + 16], dir[plen + 1];
+  snprintf(tmp, sizeof(tmp), "%s.compact", ob->path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1)
+    goto fail_unlocked;
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1 || ftruncate(fd, size) == -1)
+    goto fail_unlocked;
+
+  char header[LMW_OUTBOX_DATA] = {0};
+  *(__LMW_journal_header *) header = (__LMW_journal_header) {
+    .magic = LMW_OUTBOX_MAGIC, .version = LMW_OUTBOX_VERSION, .generation = generation,
+  };
+  if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header))
+    goto fail_unlocked;
+  size_t offset = LMW_OUTBOX_DATA;
+  for (int i = 0; i < n; i++) {
+    __LMW_record *rec = (__LMW_record *) (ob->map + from[i]);
+    if (__LMW_journal_copy(fd, rec, generation, offset) == -1)
+      goto fail_unlocked;
+    to[i] = offset;
+    offset += LMW_RECORD_SIZE(rec->len);
+  }
+  if (fdatasync(fd) == -1)
+    goto fail_unlocked;
+
+  pthread_mutex_lock(&ob->mutex);
+  // the records appended meanwhile, both EMAIL and DONE ones
+  size_t tail = offset + (ob->tail - base);
+  if (tail > size) {
+    while (size < tail)
+      size *= 2;
+    if (size > ob->ocfg.max_size)
+      size = ob->ocfg.max_size;
+    if (ftruncate(fd, size) == -1)
+      goto fail;
+  }
+  for (size_t o = base; o < ob->tail; ) {
+    __LMW_record *rec = (__LMW_record *) (ob->map + o);
+    if (__LMW_journal_copy(fd, rec, generation, offset + (o - base)) == -1)
+      goto fail;
+    o += LMW_RECORD_SIZE(rec->len);
+  }
+
+  // the same address range, now backed by the new file
+  if (mmap(ob->map, ob->ocfg.max_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    goto fail;
+  if (rename(tmp, ob->path) == -1) {
+    int e = errno;
+    if (mmap(ob->map, ob->ocfg.max_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ob->fd, 0) == MAP_FAILED)
+      LMW_log_error("Cannot map again outbox journal %s: %d %s\n", ob->path, errno, strerror(errno));
+    errno = e;
+    goto fail;
+  }
+  // the flusher may be syncing ob->fd: it is replaced, not closed
+  if (dup2(fd, ob->fd) == -1) {
+    LMW_log_error("Cannot replace outbox journal descriptor: %d %s\n", errno, strerror(errno));
+  } else {
+    close(fd);
+  }
+
+  for (int i = 0; i < ob->npending; i++) {
+    size_t o = ob->pending[i].offset;
+    if (o >= base)
+      ob->pending[i].offset = offset + (o - base);
+    else
+      ob->pending[i].offset = to[(size_t *) bsearch(&o, from, n, sizeof(size_t), __LMW__offset_cmp) - from];
+  }
+  ob->generation = generation;
+  ob->tail = tail;
+  ob->file_size = size;
+  pthread_mutex_unlock(&ob->mutex);
+
+  memcpy(dir, ob->path, plen + 1);
+  int dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd != -1) {
+    fsync(dfd);
+    close(dfd);
+  }
+
+  pthread_mutex_lock(&ob->mutex);
+  // what was written before the compaction started is on disk; the flusher syncs the rest
+  if (ob->synced < ob->compact_mark)
+    ob->synced = ob->compact_mark;
+  pthread_cond_broadcast(&ob->synced_cond);
+  ob->compacting = 0;
+  pthread_cond_broadcast(&ob->compact_cond);
+  pthread_cond_signal(&ob->dirty_cond);
+  free(from);
+  return 0;
+
+ fail_unlocked:
+  pthread_mutex_lock(&ob->mutex);
+ fail:
+  LMW_log_error("Cannot compact outbox journal %s: %d %s\n", ob->path, errno, strerror(errno));
+  if (fd != -1) {
+    close(fd);
+    unlink(tmp);
+  }
+  ob->compacting = 0;
+  pthread_cond_broadcast(&ob->compact_cond);
+  pthread_cond_signal(&ob->dirty_cond);
+  free(from);
+  return -1;
+}
+
+/* start a new generation and shrink the journal when no email is pending,
+   or compact it when most of it is taken by emails already sent */
+static void __LMW_journal_reset(LMW_outbox *ob)
+{
+  if (ob->compacting || ob->tail <= LMW_OUTBOX_INITIAL)
+    return;
+  if (ob->npending) {
+    size_t live = LMW_OUTBOX_DATA;
+    for (int i = 0; i < ob->npending; i++)
+      live += LMW_RECORD_SIZE(((__LMW_record *) (ob->map + ob->pending[i].offset))->len);
+    if (live * LMW_OUTBOX_COMPACT < ob->tail)
+      __LMW_journal_compact(ob);
+    return;
+  }
+  ob->generation++;
+  ob->tail = LMW_OUTBOX_DATA;
+  __LMW_journal_write_header(ob);
+  if (ftruncate(ob->fd, LMW_OUTBOX_INITIAL) == 0)
+    ob->file_size = LMW_OUTBOX_INITIAL;
+}
+
+/* ========== THREADS ========== */
+
+static void* __LMW_outbox_flusher(void *arg)
+{
+  LMW_outbox *ob = arg;
+  pthread_mutex_lock(&ob->mutex);
+  for (;;) {
+    while (!ob->stop && ob->written == ob->synced)
+      pthread_cond_wait(&ob->dirty_cond, &ob->mutex);
+    if (ob->written == ob->synced)
+      break;
+    // wait a bit, so that many records are written together
+    long long until = __LMW__now_ns() + ob->ocfg.sync_interval * 1000000LL;
+    struct timespec ts = __LMW__ns_to_timespec(until);
+    while (!ob->stop && !ob->flush_requested && __LMW__now_ns() < until)
+      pthread_cond_timedwait(&ob->dirty_cond, &ob->mutex, &ts);
+    unsigned long long target = ob->written;
+    uint64_t generation = ob->generation;
+    ob->flush_requested = 0;
+    pthread_mutex_unlock(&ob->mutex);
+
+    // this also writes the pages modified through the mapping
+    int r = fdatasync(ob->fd);
+
+    pthread_mutex_lock(&ob->mutex);
+    if (r == -1)
+      ob->sync_error = errno;
+    // while a compaction runs, or if it replaced the file just synced, what was
+    // written after it started may be on disk only in the file that is replaced
+    if ((ob->compacting || ob->generation != generation) && target > ob->compact_mark)
+      target = ob->compact_mark;
+    // a compaction may have synced more meanwhile
+    if (target > ob->synced)
+      ob->synced = target;
+    pthread_cond_broadcast(&ob->synced_cond);
+  }
+  pthread_mutex_unlock(&ob->mutex);
+  return NULL;
+}
+
+/* delay before next retry: exponential, with jitter in [delay/2, delay] */
+static long long __LMW_outbox_backoff(LMW_outbox *ob, int attempts)
+{
+  long long delay = ob->ocfg.retry_min;
+  while (--attempts > 0 && delay < ob->ocfg.retry_max)
+    delay *= 2;
+  if (delay > ob->ocfg.retry_max)
+    delay = ob->ocfg.retry_max;
+  delay = delay / 2 + rand_r(&ob->seed) % (delay / 2 + 1);
+  return delay * 1000000LL;
+}
+
+/* decode the payload of an EMAIL record and send it */
+static int __LMW_outbox_send(LMW_outbox *ob, char *payload, uint32_t len)
+{
+  LMW_config *cfg = ob->cfg;
+  uint32_t argc;
+  memcpy(&argc, payload, sizeof(argc));
+  char *strings[3 + argc];
+  char *p = payload + sizeof(argc), *end = payload + len;
+  for (uint32_t j = 0; j < 3 + argc; j++) {
+    char *nul = memchr(p, 0, end - p);
+    if (!nul) {
+      LMW_log_error("Outbox journal has a malformed email, dropped\n");
+      return LMW_OK;
+    }
+    strings[j] = p;
+    p = nul + 1;
+  }
+  return LMW_send_email_argv(cfg, strings[0], strings[1], strings[2], argc, strings + 3);
+}
+
+static void* __LMW_outbox_drainer(void *arg)
+{
+  LMW_outbox *ob = arg;
+  LMW_config *cfg = ob->cfg;
+  pthread_mutex_lock(&ob->mutex);
+  while (!ob->stop) {
+    int next = -1;
+    for (int i = 0; i < ob->npending; i++)
+      if (next < 0 || ob->pending[i].next_try < ob->pending[next].next_try)
+	next = i;
+    if (next < 0) {
+      pthread_cond_wait(&ob->work_cond, &ob->mutex);
+      continue;
+    }
+    if (ob->pending[next].next_try > __LMW__now_ns()) {
+      struct timespec ts = __LMW__ns_to_timespec(ob->pending[next].next_try);
+      pthread_cond_timedwait(&ob->work_cond, &ob->mutex, &ts);
+      continue;
+    }
+
+    // copy the email, since the journal may change while it is sent
+    uint64_t id = ob->pending[next].id;
+    __LMW_record *rec = (__LMW_record *) (ob->map + ob->pending[next].offset);
+    uint32_t len = rec->len;
+    char *payload = malloc(len);
+    if (!payload) {
+      ob->pending[next].next_try = __LMW__now_ns() + __LMW_outbox_backoff(ob, 1);
+      continue;
+    }
+    memcpy(payload, rec + 1, len);
+    pthread_mutex_unlock(&ob->mutex);
+
+    int result = __LMW_outbox_send(ob, payload, len);
+    free(payload);
+
+    pthread_mutex_lock(&ob->mutex);
+    int i = __LMW_pending_find(ob, id);
+    if (i < 0)
+      continue;
+    int attempts = ++ob->pending[i].attempts;
+    // an invalid email fails the same way at each attempt
+    int final = result == LMW_ERROR_INVALID;
+    if (final) {
+      LMW_log_error("Outbox dropped email %llu, its recipient or subject is invalid\n",
+		    (unsigned long long) id);
+    } else if (result != LMW_OK && ob->ocfg.max_attempts > 0 && attempts >= ob->ocfg.max_attempts) {
+      LMW_log_error("Outbox dropped email %llu after %d attempts, last error %d\n",
+		    (unsigned long long) id, attempts, result);
+    }
+    if (result == LMW_OK || final || (ob->ocfg.max_attempts > 0 && attempts >= ob->ocfg.max_attempts)) {
+      // removed first: appending may compact the journal, without the mutex
+      __LMW_pending_remove(ob, i);
+      int32_t r32 = result;
+      long off = __LMW_journal_append(ob, LMW_REC_DONE, id, &r32, sizeof(r32));
+      if (off >= 0) {
+	__LMW_record *done = (__LMW_record *) (ob->map + off);
+	done->crc = __LMW__record_crc(done);
+      } else {
+	LMW_log_error("Outbox journal is full, email %llu will be sent again at next open\n",
+		      (unsigned long long) id);
+      }
+      __LMW_journal_reset(ob);
+    } else {
+      ob->pending[i].next_try = __LMW__now_ns() + __LMW_outbox_backoff(ob, attempts);
+    }
+  }
+  pthread_mutex_unlock(&ob->mutex);
+  return NULL;
+}
+
+/* ========== API ========== */
+
+LMW_outbox* LMW_outbox_open(LMW_config *cfg, const char *path, LMW_outbox_config *ocfg)
+{
+  pthread_once(&__LMW_crc_once, __LMW__crc_init);
+
+  LMW_outbox *ob = calloc(1, sizeof(LMW_outbox));
+  if (!ob) return NULL;
+  ob->cfg = cfg;
+  if (ocfg)
+    ob->ocfg = *ocfg;
+  else
+    LMW_outbox_config_init(&ob->ocfg);
+  if (ob->ocfg.max_size < LMW_OUTBOX_INITIAL)
+    ob->ocfg.max_size = LMW_OUTBOX_INITIAL;
+  if (ob->ocfg.retry_min < 1)
+    ob->ocfg.retry_min = 1;
+  ob->seed = (unsigned int) __LMW__now_ns() ^ (unsigned int) getpid();
+  ob->fd = -1;
+  ob->map = MAP_FAILED;
+  ob->next_id = 1;
+  ob->path = strdup(path);
+  if (!ob->path) {
+    free(ob);
+    return NULL;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&ob->mutex, NULL);
+  pthread_cond_init(&ob->work_cond, &attr);
+  pthread_cond_init(&ob->dirty_cond, &attr);
+  pthread_cond_init(&ob->synced_cond, &attr);
+  pthread_cond_init(&ob->compact_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  ob->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (ob->fd == -1) {
+    LMW_log_error("Cannot open outbox journal %s: %d %s\n", path, errno, strerror(errno));
+    goto fail;
+  }
+  if (flock(ob->fd, LOCK_EX | LOCK_NB) == -1) {
+    LMW_log_error("Outbox journal %s is in use: %d %s\n", path, errno, strerror(errno));
+    goto fail;
+  }
+  struct stat st;
+  if (fstat(ob->fd, &st) == -1)
+    goto fail;
+  ob->file_size = st.st_size;
+  if (ob->file_size < LMW_OUTBOX_INITIAL) {
+    if (ftruncate(ob->fd, LMW_OUTBOX_INITIAL) == -1)
+      goto fail;
+    ob->file_size = LMW_OUTBOX_INITIAL;
+  }
+  if (ob->file_size > ob->ocfg.max_size)
+    ob->ocfg.max_size = ob->file_size;
+  // the whole address range is reserved now, the journal grows by ftruncate() only
+  ob->map = mmap(NULL, ob->ocfg.max_size, PROT_READ | PROT_WRITE, MAP_SHARED, ob->fd, 0);
+  if (ob->map == MAP_FAILED) {
+    LMW_log_error("Cannot map outbox journal %s: %d %s\n", path, errno, strerror(errno));
+    goto fail;
+  }
+
+  ob->tail = LMW_OUTBOX_DATA;
+  if (__LMW_journal_replay(ob) == -1)
+    goto fail;
+
+  if (pthread_create(&ob->flusher, NULL, __LMW_outbox_flusher, ob) != 0)
+    goto fail;
+  if (pthread_create(&ob->drainer, NULL, __LMW_outbox_drainer, ob) != 0) {
+    pthread_mutex_lock(&ob->mutex);
+    ob->stop = 1;
+    pthread_cond_signal(&ob->dirty_cond);
+    pthread_mutex_unlock(&ob->mutex);
+    pthread_join(ob->flusher, NULL);
+    goto fail;
+  }
+  return ob;
+
+ fail:
+  {
+    int saved_errno = errno;
+    pthread_mutex_destroy(&ob->mutex);
+    pthread_cond_destroy(&ob->work_cond);
+    pthread_cond_destroy(&ob->dirty_cond);
+    pthread_cond_destroy(&ob->synced_cond);
+  pthread_cond_destroy(&ob->compact_cond);
+    if (ob->map != MAP_FAILED) munmap(ob->map, ob->ocfg.max_size);
+    if (ob->fd != -1) close(ob->fd);
+    free(ob->pending);
+    free(ob->path);
+    free(ob);
+    errno = saved_errno;
+  }
+  return NULL;
+}
+
+int LMW_outbox_enqueue(LMW_outbox *ob, char *recipient, char *subject, char *body, int argc, char *argv[])
+{
+  LMW_config *cfg = ob ? ob->cfg : NULL;
+  if (!ob || !recipient || !subject || !body || argc < 0) {
+    LMW_log_error("Null parameter passed to LMW_outbox_enqueue\n");
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  // as LMW_send_email() does: it would never be sent, so it is not kept
+  const unsigned bad = LMW_SCAN_NEWLINE | LMW_SCAN_CONTROL;
+  if (recipient[0] == '-' || (LMW_text_scan(recipient, strlen(recipient), 0) & bad) ||
+      (LMW_text_scan(subject, strlen(subject), 0) & bad)) {
+    LMW_log_error("Invalid recipient or subject of the email, it is not put in the outbox\n");
+    return LMW_ERROR_INVALID;
+  }
+
+  // payload: argc, then recipient, subject, body, argv[] , null terminated
+  size_t lens[3 + argc];
+  char *strings[3 + argc];
+  strings[0] = recipient;
+  strings[1] = subject;
+  strings[2] = body;
+  for (int j = 0; j < argc; j++)
+    strings[3 + j] = argv[j];
+  size_t len = sizeof(uint32_t);
+  for (int j = 0; j < 3 + argc; j++) {
+    lens[j] = strlen(strings[j]) + 1;
+    len += lens[j];
+  }
+  if (len > UINT32_MAX) {
+    LMW_log_error("Email too large for the outbox\n");
+    return LMW_ERROR_CANNOT_CALL;
+  }
+
+  pthread_mutex_lock(&ob->mutex);
+  uint64_t id = ob->next_id++;
+  long off = __LMW_journal_append(ob, LMW_REC_EMAIL, id, NULL, len);
+  if (off < 0) {
+    pthread_mutex_unlock(&ob->mutex);
+    LMW_log_error("Outbox journal is full: %d %s\n", errno, strerror(errno));
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  __LMW_record *rec = (__LMW_record *) (ob->map + off);
+  char *p = (char *) (rec + 1);
+  uint32_t argc32 = argc;
+  memcpy(p, &argc32, sizeof(argc32));
+  p += sizeof(argc32);
+  for (int j = 0; j < 3 + argc; j++) {
+    memcpy(p, strings[j], lens[j]);
+    p += lens[j];
+  }
+  rec->crc = __LMW__record_crc(rec);
+  if (__LMW_pending_add(ob, id, off) == -1) {
+    // not lost, it will be sent at next open
+    LMW_log_error("Out of memory in outbox, email %llu will be sent at next open\n",
+		  (unsigned long long) id);
+  }
+  pthread_cond_signal(&ob->work_cond);
+  pthread_mutex_unlock(&ob->mutex);
+  return LMW_OK;
+}
+
+int LMW_outbox_flush(LMW_outbox *ob)
+{
+  if (!ob) return -1;
+  pthread_mutex_lock(&ob->mutex);
+  unsigned long long target = ob->written;
+  ob->flush_requested = 1;
+  pthread_cond_signal(&ob->dirty_cond);
+  while (ob->synced < target)
+    pthread_cond_wait(&ob->synced_cond, &ob->mutex);
+  int r = ob->sync_error ? -1 : 0;
+  errno = ob->sync_error;
+  ob->sync_error = 0;
+  pthread_mutex_unlock(&ob->mutex);
+  return r;
+}
+
+int LMW_outbox_pending(LMW_outbox *ob)
+{
+  if (!ob) return 0;
+  pthread_mutex_lock(&ob->mutex);
+  int n = ob->npending;
+  pthread_mutex_unlock(&ob->mutex);
+  return n;
+}
+
+void LMW_outbox_close(LMW_outbox *ob)
+{
+  if (!ob) return;
+  pthread_mutex_lock(&ob->mutex);
+  ob->stop = 1;
+  pthread_cond_signal(&ob->work_cond);
+  pthread_cond_signal(&ob->dirty_cond);
+  pthread_mutex_unlock(&ob->mutex);
+  // the drainer may be in the middle of sending an email
+  pthread_join(ob->drainer, NULL);
+  pthread_join(ob->flusher, NULL);
+
+  munmap(ob->map, ob->ocfg.max_size);
+  fdatasync(ob->fd);
+  close(ob->fd);
+  pthread_mutex_destroy(&ob->mutex);
+  pthread_cond_destroy(&ob->work_cond);
+  pthread_cond_destroy(&ob->dirty_cond);
+  pthread_cond_destroy(&ob->synced_cond);
+  pthread_cond_destroy(&ob->compact_cond);
+  free(ob->pending);
+  free(ob->path);
+  free(ob);
+}
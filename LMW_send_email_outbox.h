@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LMW_SEND_EMAIL_OUTBOX_H__
+#define __LMW_SEND_EMAIL_OUTBOX_H__
+
+#include <stddef.h>
+#include "LMW_send_email.h"
+
+// defaults
+#define LMW_OUTBOX_SYNC_INTERVAL  50        // in milliseconds
+#define LMW_OUTBOX_RETRY_MIN      1000      // in milliseconds
+#define LMW_OUTBOX_RETRY_MAX      600000    // in milliseconds
+#define LMW_OUTBOX_MAX_ATTEMPTS   0         // 0 means: retry forever
+#define LMW_OUTBOX_MAX_SIZE       (64 << 20) // in bytes
+
+// an on-disk queue of emails, sent in background
+typedef struct LMW_outbox LMW_outbox;
+
+typedef struct {
+  int sync_interval;  // the journal is written to disk at most this often, in milliseconds
+  int retry_min;      // delay before the first retry, in milliseconds
+  int retry_max;      // the delay doubles at each retry, up to this, in milliseconds
+  int max_attempts;   // after these many failures the email is dropped; 0 for never
+  size_t max_size;    // largest size of the journal, in bytes
+} LMW_outbox_config;
+
+/* initialize pre-allocated outbox config */
+void LMW_outbox_config_init(LMW_outbox_config *ocfg);
+
+/***
+   LMW_outbox_open()
+
+   Opens (creating it if needed) the journal in file `path`, and starts
+   a thread that sends, with LMW_send_email_argv() and `cfg` ,
+   the emails that are queued in it; the emails that were
+   left in the journal by a previous run are sent again.
+
+   Failed emails are retried, with a delay growing exponentially
+   from ocfg->retry_min to ocfg->retry_max , and random jitter;
+   those refused with LMW_ERROR_INVALID are dropped at once.
+
+   `ocfg` may be NULL (defaults will be used); `cfg` must stay valid until LMW_outbox_close().
+
+   The journal is locked, so that only one process at a time uses it.
+   It is compacted, by writing the pending emails to the file
+   `path`.compact that then replaces it, when more than half of it
+   holds emails already sent; so the directory must be writable.
+   LMW_outbox_enqueue() does not wait while that file is written.
+
+   Returns: the outbox, or NULL on failure (and errno is set)
+*/
+LMW_outbox* LMW_outbox_open(LMW_config *cfg, const char *path, LMW_outbox_config *ocfg);
+
+/***
+   LMW_outbox_enqueue()
+
+   Appends the email to the journal, and returns at once;
+   the journal is written to disk within ocfg->sync_interval milliseconds.
+
+   Returns: LMW_OK , or LMW_ERROR_CANNOT_CALL if the journal is full,
+   or LMW_ERROR_INVALID if the recipient or the subject would be refused
+   by LMW_send_email() (see LMW_ERROR_INVALID); an email that is refused
+   so when it is sent is dropped, not retried.
+*/
+int LMW_outbox_enqueue(LMW_outbox *ob, char *recipient, char *subject, char *body, int argc, char *argv[]);
+
+/* wait until all enqueued emails are written to disk; returns 0, or -1 on I/O error */
+int LMW_outbox_flush(LMW_outbox *ob);
+
+/* number of emails in the journal that were not yet sent */
+int LMW_outbox_pending(LMW_outbox *ob);
+
+/* stops sending, writes the journal to disk and closes it; the unsent emails stay in the journal */
+void LMW_outbox_close(LMW_outbox *ob);
+
+#endif // __LMW_SEND_EMAIL_OUTBOX_H__
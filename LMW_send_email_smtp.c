@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SMTP submission backend, see LMW_send_email_smtp.h
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "LMW_send_email.h"
+#include "LMW_send_email_smtp.h"
+
+// warning: this assumes that there is a variable called "cfg"
+// of type  "LMW_config *cfg"
+#define LMW_log_error( msg, ...) \
+  { if (cfg && cfg->log_error ) cfg->log_error(msg, ##__VA_ARGS__);}
+// the config may be shared by threads
+#define LMW_count_failure() \
+  { if (cfg) __atomic_fetch_add(&cfg->failures, 1, __ATOMIC_RELAXED);}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LMW_SMTP_BUFFER 65536
+#define LMW_SMTP_LINE   1024
+
+// internal: the connection failed before the relay answered MAIL, so nothing was sent
+#define LMW_SMTP_STALE  (-100)
+
+typedef struct {
+  int fd;
+  int pipelining;           // the relay announced PIPELINING
+  char relay[256];
+  char in[LMW_SMTP_BUFFER]; // received, not yet parsed
+  size_t in_len;
+  char out[LMW_SMTP_BUFFER]; // to be sent
+  size_t out_len;
+  char reply[LMW_SMTP_LINE]; // text of the last reply
+} __LMW_smtp_conn;
+
+/* ========== CONNECTION POOL ========== */
+
+static __LMW_smtp_conn *__LMW_smtp_idle[LMW_SMTP_POOL];
+static int __LMW_smtp_nidle = 0;
+static pthread_mutex_t __LMW_smtp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long __LMW__now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int __LMW__remaining_ms(long long deadline)
+{
+  long long left = deadline - __LMW__now_ns();
+  if (left <= 0) return 0;
+  return (int) ((left + 999999) / 1000000);
+}
+
+static void __LMW_smtp_free(__LMW_smtp_conn *c)
+{
+  if (!c) return;
+  if (c->fd >= 0) close(c->fd);
+  free(c);
+}
+
+/* a pooled connection to `relay` , or NULL; connections closed by the relay are dropped */
+static __LMW_smtp_conn* __LMW_smtp_take(const char *relay)
+{
+  __LMW_smtp_conn *found = NULL;
+  pthread_mutex_lock(&__LMW_smtp_mutex);
+  for (int i = __LMW_smtp_nidle - 1; i >= 0 && !found; i--) {
+    __LMW_smtp_conn *c = __LMW_smtp_idle[i];
+    if (strcmp(c->relay, relay) != 0)
+      continue;
+    __LMW_smtp_idle[i] = __LMW_smtp_idle[--__LMW_smtp_nidle];
+    // an idle connection should have nothing to read: else it is EOF or a 421
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) == 0)
+      found = c;
+    else
+      __LMW_smtp_free(c);
+  }
+  pthread_mutex_unlock(&__LMW_smtp_mutex);
+  return found;
+}
+
+static void __LMW_smtp_put(__LMW_smtp_conn *c)
+{
+  pthread_mutex_lock(&__LMW_smtp_mutex);
+  if (__LMW_smtp_nidle < LMW_SMTP_POOL) {
+    __LMW_smtp_idle[__LMW_smtp_nidle++] = c;
+    c = NULL;
+  }
+  pthread_mutex_unlock(&__LMW_smtp_mutex);
+  if (c) {
+    if (send(c->fd, "QUIT\r\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+      // closing anyway
+    }
+    __LMW_smtp_free(c);
+  }
+}
+
+void LMW_smtp_close_all(void)
+{
+  pthread_mutex_lock(&__LMW_smtp_mutex);
+  while (__LMW_smtp_nidle > 0) {
+    __LMW_smtp_conn *c = __LMW_smtp_idle[--__LMW_smtp_nidle];
+    if (send(c->fd, "QUIT\r\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+      // closing anyway
+    }
+    __LMW_smtp_free(c);
+  }
+  pthread_mutex_unlock(&__LMW_smtp_mutex);
+}
+
+/* ========== PROTOCOL ========== */
+
+/* send the buffered output; returns LMW_OK, LMW_ERROR_PIPE or LMW_ERROR_TIMEOUT */
+static int __LMW_smtp_flush(__LMW_smtp_conn *c, long long deadline)
+{
+  size_t done = 0;
+  while (done < c->out_len) {
+    ssize_t r = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+    if (r >= 0) {
+      done += r;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return LMW_ERROR_PIPE;
+    struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+    int timeout = __LMW__remaining_ms(deadline);
+    if (timeout == 0 || poll(&pfd, 1, timeout) == 0)
+      return LMW_ERROR_TIMEOUT;
+  }
+  c->out_len = 0;
+  return LMW_OK;
+}
+
+static int __LMW_smtp_write(__LMW_smtp_conn *c, const char *data, size_t len, long long deadline)
+{
+  while (len > 0) {
+    if (c->out_len == sizeof(c->out)) {
+      int r = __LMW_smtp_flush(c, deadline);
+      if (r != LMW_OK) return r;
+    }
+    size_t n = sizeof(c->out) - c->out_len;
+    if (n > len) n = len;
+    memcpy(c->out + c->out_len, data, n);
+    c->out_len += n;
+    data += n;
+    len -= n;
+  }
+  return LMW_OK;
+}
+
+static int __LMW_smtp_printf(__LMW_smtp_conn *c, long long deadline, const char *fmt, ...)
+{
+  char line[LMW_SMTP_LINE];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= (int) sizeof(line))
+    return LMW_ERROR_CANNOT_CALL;
+  return __LMW_smtp_write(c, line, n, deadline);
+}
+
+/*
+  read one (possibly multiline) reply; its text is left in c->reply ,
+  and `ext` (if not NULL) is called on each line.
+  Returns the reply code (>0), or LMW_ERROR_PIPE or LMW_ERROR_TIMEOUT
+*/
+static int __LMW_smtp_read_reply(__LMW_smtp_conn *c, long long deadline,
+				 void (*ext)(__LMW_smtp_conn *c, const char *line))
+{
+  for (;;) {
+    char *nl = memchr(c->in, '\n', c->in_len);
+    if (nl) {
+      size_t n = nl + 1 - c->in;
+      size_t l = n - 1;
+      if (l > 0 && c->in[l-1] == '\r') l--;
+      if (l >= sizeof(c->reply)) l = sizeof(c->reply) - 1;
+      memcpy(c->reply, c->in, l);
+      c->reply[l] = 0;
+      memmove(c->in, c->in + n, c->in_len - n);
+      c->in_len -= n;
+      if (ext)
+	ext(c, c->reply);
+      if (l >= 3 && c->reply[3] != '-')
+	return atoi(c->reply) > 0 ? atoi(c->reply) : LMW_ERROR_PIPE;
+      continue;
+    }
+    if (c->in_len == sizeof(c->in))
+      return LMW_ERROR_PIPE; // line too long
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int timeout = __LMW__remaining_ms(deadline);
+    if (timeout == 0 || poll(&pfd, 1, timeout) == 0)
+      return LMW_ERROR_TIMEOUT;
+    ssize_t r = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (r == 0 || (r == -1 && errno != EINTR && errno != EAGAIN))
+      return LMW_ERROR_PIPE;
+    if (r > 0)
+      c->in_len += r;
+  }
+}
+
+static void __LMW_smtp_ehlo_line(__LMW_smtp_conn *c, const char *line)
+{
+  if (strlen(line) > 4 && strncasecmp(line + 4, "PIPELINING", 10) == 0)
+    c->pipelining = 1;
+}
+
+/* open a connection to the relay and greet it; returns LMW_OK or an error code */
+static int __LMW_smtp_connect(LMW_config *cfg, const char *relay, __LMW_smtp_conn **pc, long long deadline)
+{
+  char host[256], *port;
+  snprintf(host, sizeof(host), "%s", relay);
+  port = strrchr(host, ':');
+  if (port)
+    *port++ = 0;
+  else
+    port = "25";
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai, *a;
+  int r = getaddrinfo(host, port, &hints, &ai);
+  if (r) {
+    LMW_log_error("Cannot resolve SMTP relay %s: %s\n", relay, gai_strerror(r));
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  int fd = -1;
+  for (a = ai; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, a->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == -1 && errno != EINPROGRESS) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, __LMW__remaining_ms(deadline)) != 1 ||
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  if (fd < 0) {
+    LMW_log_error("Cannot connect to SMTP relay %s\n", relay);
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  __LMW_smtp_conn *c = calloc(1, sizeof(__LMW_smtp_conn));
+  if (!c) {
+    close(fd);
+    return LMW_ERROR_CANNOT_CALL;
+  }
+  c->fd = fd;
+  snprintf(c->relay, sizeof(c->relay), "%s", relay);
+
+  char me[256] = "localhost";
+  gethostname(me, sizeof(me) - 1);
+  r = __LMW_smtp_read_reply(c, deadline, NULL);
+  if (r == 220) {
+    __LMW_smtp_printf(c, deadline, "EHLO %s\r\n", me);
+    r = __LMW_smtp_flush(c, deadline);
+    if (r == LMW_OK)
+      r = __LMW_smtp_read_reply(c, deadline, __LMW_smtp_ehlo_line);
+    if (r >= 500 && r < 600) {
+      // an old relay, that does not know ESMTP
+      __LMW_smtp_printf(c, deadline, "HELO %s\r\n", me);
+      r = __LMW_smtp_flush(c, deadline);
+      if (r == LMW_OK)
+	r = __LMW_smtp_read_reply(c, deadline, NULL);
+    }
+  }
+  if (r != 250) {
+    LMW_log_error("SMTP relay %s refused the connection: %s\n", relay, c->reply);
+    __LMW_smtp_free(c);
+    return r < 0 ? r : LMW_ERROR_CANNOT_CALL;
+  }
+  *pc = c;
+  return LMW_OK;
+}
+
+/* the body, dot-stuffed and with CRLF line ends, in one pass */
+static int __LMW_smtp_write_body(__LMW_smtp_conn *c, const char *body, long long deadline)
+{
+  const char *p = body, *end = body + strlen(body);
+  int r = LMW_OK, bol = 1;
+  while (p < end && r == LMW_OK) {
+    if (bol && *p == '.')
+      r = __LMW_smtp_write(c, ".", 1, deadline);
+    const char *nl = memchr(p, '\n', end - p);
+    const char *e = nl ? nl : end;
+    size_t n = e - p;
+    if (nl && n > 0 && e[-1] == '\r')
+      n--;
+    if (r == LMW_OK)
+      r = __LMW_smtp_write(c, p, n, deadline);
+    if (nl) {
+      if (r == LMW_OK)
+	r = __LMW_smtp_write(c, "\r\n", 2, deadline);
+      p = nl + 1;
+      bol = 1;
+    } else {
+      p = end;
+      bol = 0;
+    }
+  }
+  if (r == LMW_OK && !bol)
+    r = __LMW_smtp_write(c, "\r\n", 2, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_write(c, ".\r\n", 3, deadline);
+  return r;
+}
+
+static void __LMW_smtp_default_from(char *from, size_t len)
+{
+  char me[256] = "localhost", buf[1024];
+  struct passwd pw, *ppw = NULL;
+  gethostname(me, sizeof(me) - 1);
+  if (getpwuid_r(getuid(), &pw, buf, sizeof(buf), &ppw) != 0 || !ppw)
+    snprintf(from, len, "root@%s", me);
+  else
+    snprintf(from, len, "%s@%s", ppw->pw_name, me);
+}
+
+/* remember the first refusal, and its reply */
+static void __LMW_smtp_refused(__LMW_smtp_conn *c, int *refused, int code, char *why)
+{
+  if (*refused)
+    return;
+  *refused = code;
+  snprintf(why, LMW_SMTP_LINE, "%s", c->reply);
+}
+
+/*
+  one transaction on an open connection.
+  Returns LMW_OK, an error code, or the SMTP code of a refusal;
+  *reusable is set if the connection can be used again
+*/
+static int __LMW_smtp_transaction(LMW_config *cfg, __LMW_smtp_conn *c, char *recipient, char *subject, char *body,
+				  long long deadline, int *reusable)
+{
+  char from[512], rcpts[1024], *rcpt[64], *save = NULL, why[LMW_SMTP_LINE] = "";
+  int nrcpt = 0, r, refused = 0;
+  *reusable = 0;
+
+  if (cfg->smtp_from)
+    snprintf(from, sizeof(from), "%s", cfg->smtp_from);
+  else
+    __LMW_smtp_default_from(from, sizeof(from));
+  snprintf(rcpts, sizeof(rcpts), "%s", recipient);
+  for (char *t = strtok_r(rcpts, ",", &save); t && nrcpt < 64; t = strtok_r(NULL, ",", &save)) {
+    while (*t == ' ') t++;
+    char *e = t + strlen(t);
+    while (e > t && e[-1] == ' ') *--e = 0;
+    if (*t)
+      rcpt[nrcpt++] = t;
+  }
+  if (nrcpt == 0) {
+    LMW_log_error("No recipient for SMTP\n");
+    *reusable = 1;
+    return LMW_ERROR_CANNOT_CALL;
+  }
+
+  // envelope: with PIPELINING all commands go in one packet, then all replies are read
+  r = __LMW_smtp_printf(c, deadline, "MAIL FROM:<%s>\r\n", from);
+  if (!c->pipelining && r == LMW_OK) {
+    r = __LMW_smtp_flush(c, deadline);
+    if (r == LMW_OK)
+      r = __LMW_smtp_read_reply(c, deadline, NULL);
+    if (r < 0) return r == LMW_ERROR_PIPE ? LMW_SMTP_STALE : r;
+    if (r != 250) __LMW_smtp_refused(c, &refused, r, why);
+    r = LMW_OK;
+  }
+  for (int j = 0; j < nrcpt && r == LMW_OK && !refused; j++) {
+    r = __LMW_smtp_printf(c, deadline, "RCPT TO:<%s>\r\n", rcpt[j]);
+    if (!c->pipelining && r == LMW_OK) {
+      r = __LMW_smtp_flush(c, deadline);
+      if (r == LMW_OK)
+	r = __LMW_smtp_read_reply(c, deadline, NULL);
+      if (r < 0) return r;
+      if (r != 250 && r != 251) __LMW_smtp_refused(c, &refused, r, why);
+      r = LMW_OK;
+    }
+  }
+  if (r == LMW_OK && !refused)
+    r = __LMW_smtp_write(c, "DATA\r\n", 6, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_flush(c, deadline);
+  if (r != LMW_OK)
+    return (c->pipelining && r == LMW_ERROR_PIPE) ? LMW_SMTP_STALE : r;
+
+  if (c->pipelining) {
+    r = __LMW_smtp_read_reply(c, deadline, NULL);
+    if (r < 0) return r == LMW_ERROR_PIPE ? LMW_SMTP_STALE : r;
+    if (r != 250) __LMW_smtp_refused(c, &refused, r, why);
+    for (int j = 0; j < nrcpt; j++) {
+      r = __LMW_smtp_read_reply(c, deadline, NULL);
+      if (r < 0) return r;
+      if (r != 250 && r != 251) __LMW_smtp_refused(c, &refused, r, why);
+    }
+  }
+  if (!refused || c->pipelining) {
+    r = __LMW_smtp_read_reply(c, deadline, NULL);
+    if (r < 0) return r;
+    if (r != 354) __LMW_smtp_refused(c, &refused, r, why);
+    if (r == 354 && refused) {
+      // the relay accepted DATA for the other recipients: a message ended
+      // with a dot would be delivered to them, even if empty, and RSET
+      // would not cancel it; so the connection is dropped without it
+      snprintf(c->reply, sizeof(c->reply), "%s", why);
+      return refused;
+    }
+  }
+
+  if (refused) {
+    __LMW_smtp_write(c, "RSET\r\n", 6, deadline);
+    r = __LMW_smtp_flush(c, deadline);
+    if (r == LMW_OK && __LMW_smtp_read_reply(c, deadline, NULL) == 250)
+      *reusable = 1;
+    snprintf(c->reply, sizeof(c->reply), "%s", why);
+    return refused;
+  }
+
+  // the message
+  char date[64];
+  time_t now = time(NULL);
+  struct tm tm;
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime_r(&now, &tm));
+  r = __LMW_smtp_printf(c, deadline, "From: %s\r\nTo: %s\r\nDate: %s\r\n", from, recipient, date);
+  if (r == LMW_OK)
+    r = __LMW_smtp_write(c, "Subject: ", 9, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_write(c, subject, strlen(subject), deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_write(c, "\r\n\r\n", 4, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_write_body(c, body, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_flush(c, deadline);
+  if (r == LMW_OK)
+    r = __LMW_smtp_read_reply(c, deadline, NULL);
+  if (r < 0)
+    return r;
+  *reusable = 1;
+  return r == 250 ? LMW_OK : r;
+}
+
+/* ========== BACKEND ========== */
+
+int LMW_backend_smtp(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+		     LMW_result *res)
+{
+  const char *relay = (cfg && cfg->smtp_relay) ? cfg->smtp_relay : LMW_SMTP_RELAY;
+  int max_wait = cfg ? cfg->max_wait : LMW_MAX_WAIT;
+  long long deadline = __LMW__now_ns() + max_wait * 1000000LL;
+  LMW_config defaults;
+  if (!cfg) {
+    LMW_config_init(&defaults);
+    cfg = &defaults;
+  }
+
+  (void) argv;
+  if (argc > 0) {
+    LMW_log_error("Extra mailer arguments are not supported by the SMTP backend\n");
+    LMW_count_failure();
+    return LMW_ERROR_CANNOT_CALL;
+  }
+
+  int r, reusable = 0;
+  __LMW_smtp_conn *c = __LMW_smtp_take(relay);
+  if (c) {
+    r = __LMW_smtp_transaction(cfg, c, recipient, subject, body, deadline, &reusable);
+    if (r == LMW_SMTP_STALE) {
+      // the relay closed the pooled connection meanwhile: try once with a new one;
+      // not after MAIL was answered, the relay may have accepted the message
+      __LMW_smtp_free(c);
+      c = NULL;
+    }
+  }
+  if (!c) {
+    r = __LMW_smtp_connect(cfg, relay, &c, deadline);
+    if (r == LMW_OK)
+      r = __LMW_smtp_transaction(cfg, c, recipient, subject, body, deadline, &reusable);
+  }
+  if (r == LMW_SMTP_STALE)
+    r = LMW_ERROR_PIPE;
+
+  if (r != LMW_OK) {
+    if (r == LMW_ERROR_TIMEOUT) {
+      LMW_log_error("Timeout in SMTP to relay %s\n", relay);
+    } else if (r == LMW_ERROR_PIPE) {
+      LMW_log_error("Connection lost to SMTP relay %s\n", relay);
+    } else if (r > 0 && c) {
+      LMW_log_error("SMTP relay %s refused the email: %s\n", relay, c->reply);
+      if (res) {
+	res->err = strdup(c->reply);
+	res->err_len = res->err ? strlen(res->err) : 0;
+      }
+    }
+    LMW_count_failure();
+  }
+  if (c) {
+    if (reusable)
+      __LMW_smtp_put(c);
+    else
+      __LMW_smtp_free(c);
+  }
+  return r;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LMW_SEND_EMAIL_SMTP_H__
+#define __LMW_SEND_EMAIL_SMTP_H__
+
+#include "LMW_send_email.h"
+
+// idle connections kept open, for all relays
+#define LMW_SMTP_POOL 8
+
+/***
+   LMW_backend_smtp()
+
+   Delivery backend that submits the email with SMTP to the relay
+   in cfg->smtp_relay ("host:port", default "localhost:25"),
+   with envelope sender cfg->smtp_from ; enable it with
+
+     cfg->backend = LMW_backend_smtp;
+
+   `recipient` may be a comma separated list of addresses.
+   Extra mailer arguments (argc > 0) are not supported.
+
+   Connections are kept open and reused for the next emails;
+   if the relay announces PIPELINING, the commands MAIL, RCPT and DATA
+   are sent together.
+
+   The whole transaction must end within cfg->max_wait milliseconds.
+
+   It returns the same codes as LMW_send_email() :
+   LMW_OK (0)                 = all ok
+   LMW_ERROR_CANNOT_CALL (-1) = could not connect to the relay
+   LMW_ERROR_PIPE (-2)        = connection lost while sending
+   LMW_ERROR_TIMEOUT (-3)     = the relay did not answer in time
+   >0                         = the SMTP reply code, when the relay refused the email
+                                (its reply is in res->err , when `res` is not NULL)
+*/
+int LMW_backend_smtp(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+		     LMW_result *res);
+
+/* close all idle connections */
+void LMW_smtp_close_all(void);
+
+#endif // __LMW_SEND_EMAIL_SMTP_H__
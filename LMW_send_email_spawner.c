@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prefork spawner ("zygote"), see LMW_send_email_spawner.h
+ *
+ * The helper and this process share a SOCK_SEQPACKET socket pair.
+ * Each request is one packet: a header, the strings (mailer, recipient,
+ * subject, extra arguments) one after the other, and two file descriptors:
+ * a memory file with the body, and one end of a new socket pair,
+ * on which the helper writes the answer; so concurrent requests
+ * from many threads need no matching of answers to requests.
+ * The answer is one packet too; if the caller wants the output of
+ * the mailer, it comes in a memory file passed with the answer.
+ * The helper serves each request in its own thread.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // memfd_create(2)
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include "LMW_send_email.h"
+#include "LMW_send_email_spawner.h"
+
+// warning: this assumes that there is a variable called "cfg"
+// of type  "LMW_config *cfg"
+#define LMW_log_error( msg, ...) \
+  { if (cfg && cfg->log_error ) cfg->log_error(msg, ##__VA_ARGS__);}
+// the config may be shared by threads
+#define LMW_count_failure() \
+  { if (cfg) __atomic_fetch_add(&cfg->failures, 1, __ATOMIC_RELAXED);}
+
+#define LMW_SPAWNER_MAGIC 0x4e50534cU   // "LSPN"
+#define LMW_SPAWNER_MAX   (64 * 1024)  // largest request
+
+typedef struct {
+  uint32_t magic;
+  int32_t max_wait;
+  int32_t spawn;
+  int32_t capture_to_disk;
+  int32_t quiet;            // cfg->log_error was NULL
+  int32_t want_result;      // send back the output of the mailer, instead of logging it
+  int32_t mailer_cache;     // cfg->mailer_cache was set
+  int32_t argc;
+  uint64_t capture_max;
+  // then argc + 3 strings, each null terminated: mailer, recipient, subject, arguments
+} __LMW_spawner_request;
+
+typedef struct {
+  int32_t code;
+  int32_t truncated;
+  // the output is in the memory file that comes with the answer: stdout, then stderr
+  uint64_t out_len, err_len;
+} __LMW_spawner_answer;
+
+static int __LMW_spawner_fd = -1;
+static pid_t __LMW_spawner_pid = -1;
+static pthread_mutex_t __LMW_spawner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ========== HELPER ========== */
+
+// the helper's own cache, for the first mailer of a request with cfg->mailer_cache
+static LMW_mailer_cache *__LMW_spawner_cache;
+static pthread_mutex_t __LMW_spawner_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* sends the answer, with the output of the mailer if there is one */
+static void __LMW_spawner_answer_send(int fd, LMW_result *res)
+{
+  __LMW_spawner_answer a = { res->code, res->truncated, res->out_len, res->err_len };
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { &a, sizeof(a) };
+  struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1 };
+  int mfd = -1;
+  if (res->out_len + res->err_len > 0) {
+    mfd = memfd_create("lmw_result", MFD_CLOEXEC);
+    struct iovec out[2] = { { res->out, res->out_len }, { res->err, res->err_len } };
+    if (mfd == -1 || writev(mfd, out, 2) != (ssize_t) (res->out_len + res->err_len)) {
+      // the output is lost, the code is not
+      a.out_len = a.err_len = 0;
+    } else {
+      memset(cbuf, 0, sizeof(cbuf));
+      m.msg_control = cbuf;
+      m.msg_controllen = sizeof(cbuf);
+      struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cm), &mfd, sizeof(int));
+    }
+  }
+  if (sendmsg(fd, &m, MSG_NOSIGNAL) == -1) {
+    // the caller gave up waiting
+  }
+  if (mfd >= 0)
+    close(mfd);
+}
+
+typedef struct {
+  char packet[LMW_SPAWNER_MAX];
+  int body_fd, answer_fd;
+} __LMW_spawner_job;
+
+static void *__LMW_spawner_serve(void *p)
+{
+  __LMW_spawner_job *job = p;
+  __LMW_spawner_request *h = (__LMW_spawner_request *) job->packet;
+  char *strings[3 + h->argc + 1];
+  char *s = job->packet + sizeof(*h);
+  for (int j = 0; j < 3 + h->argc; j++) {
+    strings[j] = s;
+    s += strlen(s) + 1;
+  }
+  strings[3 + h->argc] = NULL;
+
+  LMW_config c;
+  LMW_config_init(&c);
+  c.mailer = strings[0];
+  c.max_wait = h->max_wait;
+  c.spawn = h->spawn;
+  c.capture_max = h->capture_max;
+  c.capture_to_disk = h->capture_to_disk;
+  if (h->quiet)
+    c.log_error = NULL;
+  if (h->mailer_cache) {
+    pthread_mutex_lock(&__LMW_spawner_cache_mutex);
+    if (!__LMW_spawner_cache)
+      __LMW_spawner_cache = LMW_mailer_cache_new(&c);
+    c.mailer_cache = __LMW_spawner_cache;
+    pthread_mutex_unlock(&__LMW_spawner_cache_mutex);
+  }
+
+  LMW_result res = { 0 };
+  if (h->want_result)
+    LMW_send_email_fd_result(&c, strings[1], strings[2], job->body_fd, 0, 0, h->argc, strings + 3, &res);
+  else
+    res.code = LMW_send_email_fd(&c, strings[1], strings[2], job->body_fd, 0, 0, h->argc, strings + 3);
+  __LMW_spawner_answer_send(job->answer_fd, &res);
+  LMW_result_free(&res);
+  close(job->body_fd);
+  close(job->answer_fd);
+  free(job);
+  return NULL;
+}
+
+static void __LMW_spawner_main(int fd)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    __LMW_spawner_job *job = malloc(sizeof(__LMW_spawner_job));
+    if (!job)
+      _exit(1);
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { job->packet, sizeof(job->packet) - 1 };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    ssize_t r = recvmsg(fd, &m, MSG_CMSG_CLOEXEC);
+    if (r == 0 || (r == -1 && errno != EINTR))
+      _exit(0); // the parent closed the socket, or exited
+    if (r == -1) {
+      free(job);
+      continue;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+      free(job);
+      continue;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    job->body_fd = fds[0];
+    job->answer_fd = fds[1];
+    job->packet[r] = 0;
+    __LMW_spawner_request *h = (__LMW_spawner_request *) job->packet;
+    // the strings must all be in the packet
+    int n = 0;
+    if ((size_t) r > sizeof(*h) && h->magic == LMW_SPAWNER_MAGIC && h->argc >= 0)
+      for (char *s = job->packet + sizeof(*h); s < job->packet + r; s += strlen(s) + 1)
+	n++;
+    pthread_t t;
+    if (n != 3 + h->argc || pthread_create(&t, &attr, __LMW_spawner_serve, job) != 0) {
+      LMW_result res = { .code = LMW_ERROR_CANNOT_CALL };
+      __LMW_spawner_answer_send(job->answer_fd, &res);
+      close(job->body_fd);
+      close(job->answer_fd);
+      free(job);
+    }
+  }
+}
+
+int LMW_spawner_start(LMW_config *cfg)
+{
+  int sv[2];
+  pthread_mutex_lock(&__LMW_spawner_mutex);
+  if (__LMW_spawner_fd >= 0) {
+    pthread_mutex_unlock(&__LMW_spawner_mutex);
+    cfg->backend = LMW_backend_spawner;
+    return 0;
+  }
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+    pthread_mutex_unlock(&__LMW_spawner_mutex);
+    return -1;
+  }
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(sv[0]);
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+      _exit(0);
+#endif
+    // keep only stdin, stdout, stderr and the socket, as 3
+    if (sv[1] != 3) {
+      dup2(sv[1], 3);
+      close(sv[1]);
+      fcntl(3, F_SETFD, FD_CLOEXEC);
+    }
+#if defined(__linux__) && defined(CLOSE_RANGE_CLOEXEC)
+    if (close_range(4, ~0U, 0) == -1)
+#endif
+      for (int fd = 4; fd < 1024; fd++)
+	close(fd);
+    // the signals that the parent ignores or blocks are not ours
+    sigset_t none;
+    sigemptyset(&none);
+    pthread_sigmask(SIG_SETMASK, &none, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    __LMW_spawner_main(3);
+  }
+  int saved_errno = errno;
+  close(sv[1]);
+  if (pid == -1) {
+    close(sv[0]);
+    pthread_mutex_unlock(&__LMW_spawner_mutex);
+    errno = saved_errno;
+    return -1;
+  }
+  __LMW_spawner_fd = sv[0];
+  __LMW_spawner_pid = pid;
+  pthread_mutex_unlock(&__LMW_spawner_mutex);
+  cfg->backend = LMW_backend_spawner;
+  return 0;
+}
+
+void LMW_spawner_stop(void)
+{
+  pthread_mutex_lock(&__LMW_spawner_mutex);
+  if (__LMW_spawner_fd >= 0) {
+    // the helper exits at EOF, after answering the requests in flight
+    close(__LMW_spawner_fd);
+    waitpid(__LMW_spawner_pid, NULL, 0);
+    __LMW_spawner_fd = -1;
+    __LMW_spawner_pid = -1;
+  }
+  pthread_mutex_unlock(&__LMW_spawner_mutex);
+}
+
+/* ========== CLIENT ========== */
+
+/* `len` bytes at `off` of the output sent by the helper, null terminated, in *p ; NULL if none */
+static int __LMW_spawner_output(int fd, uint64_t off, uint64_t len, char **p, size_t *l)
+{
+  if (!len)
+    return 0;
+  char *b = malloc(len + 1);
+  if (!b)
+    return -1;
+  for (uint64_t done = 0; done < len; ) {
+    ssize_t r = pread(fd, b + done, len - done, off + done);
+    if (r <= 0) {
+      free(b);
+      if (r == 0)
+	errno = EIO;
+      return -1;
+    }
+    done += r;
+  }
+  b[len] = 0;
+  *p = b;
+  *l = len;
+  return 0;
+}
+
+int LMW_backend_spawner(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+			LMW_result *res)
+{
+  char packet[LMW_SPAWNER_MAX];
+  __LMW_spawner_request *h = (__LMW_spawner_request *) packet;
+  *h = (__LMW_spawner_request) {
+    .magic = LMW_SPAWNER_MAGIC,
+    .max_wait = cfg->max_wait,
+    .spawn = cfg->spawn,
+    .capture_to_disk = cfg->capture_to_disk,
+    .quiet = cfg->log_error == NULL,
+    .want_result = res != NULL,
+    .mailer_cache = cfg->mailer_cache != NULL,
+    .argc = argc,
+    .capture_max = cfg->capture_max,
+  };
+  size_t len = sizeof(*h);
+  for (int j = 0; j < 3 + argc; j++) {
+    char *s = (j == 0) ? cfg->mailer : (j == 1) ? recipient : (j == 2) ? subject : argv[j - 3];
+    size_t l = strlen(s) + 1;
+    if (len + l > sizeof(packet)) {
+      LMW_log_error("Arguments too long for the spawner helper\n");
+      LMW_count_failure();
+      return LMW_ERROR_CANNOT_CALL;
+    }
+    memcpy(packet + len, s, l);
+    len += l;
+  }
+
+  // the body, in a memory file that the helper will splice to the mailer
+  int fds[2] = { -1, -1 }, answer[2] = { -1, -1 };
+  int ret = LMW_ERROR_CANNOT_CALL;
+  size_t bl = strlen(body);
+  fds[0] = memfd_create("lmw_body", MFD_CLOEXEC);
+  if (fds[0] == -1 || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, answer) == -1) {
+    LMW_log_error("Failure in preparing the request to the spawner helper: %d %s\n", errno, strerror(errno));
+    goto out;
+  }
+  for (size_t done = 0; done < bl; ) {
+    ssize_t r = write(fds[0], body + done, bl - done);
+    if (r == -1) {
+      LMW_log_error("Failure in writing the body for the spawner helper: %d %s\n", errno, strerror(errno));
+      goto out;
+    }
+    done += r;
+  }
+  fds[1] = answer[1];
+
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  memset(cbuf, 0, sizeof(cbuf));
+  struct iovec iov = { packet, len };
+  struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+  pthread_mutex_lock(&__LMW_spawner_mutex);
+  ssize_t r = __LMW_spawner_fd >= 0 ? sendmsg(__LMW_spawner_fd, &m, MSG_NOSIGNAL) : -1;
+  pthread_mutex_unlock(&__LMW_spawner_mutex);
+  if (r == -1) {
+    LMW_log_error("The spawner helper is not running\n");
+    goto out;
+  }
+  close(answer[1]);
+  answer[1] = -1;
+
+  // the helper enforces max_wait; if it does not answer, it died
+  struct pollfd pfd = { .fd = answer[0], .events = POLLIN };
+  int timeout = cfg->max_wait + LMW_SPAWNER_GRACE;
+  while ((r = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+    ;
+  if (r == 0) {
+    LMW_log_error("Timeout in waiting for the spawner helper\n");
+    ret = LMW_ERROR_TIMEOUT;
+    goto out;
+  }
+  __LMW_spawner_answer a;
+  int mfd = -1;
+  iov = (struct iovec) { &a, sizeof(a) };
+  m = (struct msghdr) { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+  if (recvmsg(answer[0], &m, MSG_CMSG_CLOEXEC) != sizeof(a)) {
+    LMW_log_error("The spawner helper did not answer\n");
+    goto out;
+  }
+  for (cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      memcpy(&mfd, CMSG_DATA(cm), sizeof(int));
+  ret = a.code;
+  if (res) {
+    res->truncated = a.truncated;
+    if (mfd >= 0 && (__LMW_spawner_output(mfd, 0, a.out_len, &res->out, &res->out_len) == -1 ||
+		     __LMW_spawner_output(mfd, a.out_len, a.err_len, &res->err, &res->err_len) == -1))
+      LMW_log_error("Failure in reading the output of the mailer from the spawner helper: %d %s\n",
+		    errno, strerror(errno));
+  }
+  if (mfd >= 0)
+    close(mfd);
+
+ out:
+  if (fds[0] >= 0) close(fds[0]);
+  if (answer[0] >= 0) close(answer[0]);
+  if (answer[1] >= 0) close(answer[1]);
+  if (ret != LMW_OK)
+    LMW_count_failure();
+  return ret;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2025  Andrea C G Mennucci
+ *
+ * This file is part of libmailwrap.
+ *
+ * libmailwrap is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libmailwrap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with <Project Name>; if not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LMW_SEND_EMAIL_SPAWNER_H__
+#define __LMW_SEND_EMAIL_SPAWNER_H__
+
+#include "LMW_send_email.h"
+
+// after cfg->max_wait , how long to wait for the answer of the helper, in milliseconds
+#define LMW_SPAWNER_GRACE 1000
+
+/***
+   LMW_spawner_start()
+
+   Forks a small helper process, that will start the mailers on behalf
+   of this process, and sets  cfg->backend = LMW_backend_spawner ;
+   call it early (e.g. at the start of main()), while this process
+   is small and has no threads, so that it never needs to fork later
+   when it is big.
+
+   Each email is then sent as a request to the helper over a Unix socket,
+   with the body in a memory file passed with SCM_RIGHTS; the helper
+   runs LMW_send_email_fd() with the settings of `cfg` (mailer, max_wait,
+   spawn, capture_max, capture_to_disk) and answers with its return code,
+   and with the output of the mailer if `res` is not NULL.
+   The helper logs to its stderr (that is the stderr of this process at
+   the time of the fork), unless cfg->log_error is NULL.
+
+   The rest of `cfg` cannot cross to the helper: the subject is encoded,
+   and cfg->ratelimit , cfg->breaker and the LMW_PHASE_TOTAL time in
+   cfg->stats are applied, in this process, before the backend is called;
+   the other phases are not recorded. cfg->timeout is not used, as by
+   any backend: the helper waits cfg->max_wait . If cfg->mailer_cache
+   is set, the helper keeps its own cache, for the first mailer it sees.
+
+   The helper exits when this process exits, or at LMW_spawner_stop().
+   Linux only.
+
+   Returns: 0 , or -1 (and errno) if the helper could not be started
+*/
+int LMW_spawner_start(LMW_config *cfg);
+
+/* stops the helper; emails sent with LMW_backend_spawner() afterwards fail with LMW_ERROR_CANNOT_CALL */
+void LMW_spawner_stop(void);
+
+/* the backend that sends through the helper */
+int LMW_backend_spawner(LMW_config *cfg, char *recipient, char *subject, char *body, int argc, char *argv[],
+			LMW_result *res);
+
+#endif // __LMW_SEND_EMAIL_SPAWNER_H__
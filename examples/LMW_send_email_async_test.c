@@ -0,0 +1,207 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for LMW_send_email_async()
+
+   it sends many emails at once from one thread, with an epoll loop,
+   using ./lmw_fakemail to inject faults
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "LMW_send_email.h"
+
+#define EMAILS 100
+
+static LMW_config cfg;
+
+/* send `n` emails at once, with extra arguments `fault` ; returns how many ended with `code` */
+static int send_all(int n, char *body, char *fault, int code)
+{
+  LMW_async *a[n];
+  char *xa[2] = { "-X", fault };
+  int ep = epoll_create1(0), left = 0, good = 0;
+  for (int k = 0; k < n; k++) {
+    a[k] = LMW_send_email_async(&cfg, "TEST", "the subject", body, fault ? 2 : 0, xa, NULL);
+    if (!a[k])
+      continue;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = a[k] };
+    epoll_ctl(ep, EPOLL_CTL_ADD, LMW_async_fd(a[k]), &ev);
+    left++;
+  }
+  while (left > 0) {
+    struct epoll_event ev[64];
+    int r = epoll_wait(ep, ev, 64, 10000);
+    if (r == -1 && errno == EINTR)  // SIGCHLD, without pidfd
+      continue;
+    if (r <= 0)
+      break;
+    for (int k = 0; k < r; k++) {
+      LMW_async *x = ev[k].data.ptr;
+      if (LMW_async_step(x)) {
+	good += (LMW_async_code(x) == code);
+	epoll_ctl(ep, EPOLL_CTL_DEL, LMW_async_fd(x), NULL);
+	LMW_async_free(x);
+	left--;
+      }
+    }
+  }
+  close(ep);
+  return good;
+}
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* send one email, stepping when its fd is readable; the longest step, in milliseconds, is in *slowest */
+static int send_one(char *fault, LMW_result *res, long long *slowest)
+{
+  char *xa[2] = { "-X", fault };
+  LMW_async *a = LMW_send_email_async(&cfg, "TEST", "the subject", "the body", fault ? 2 : 0, xa, res);
+  if (!a)
+    return LMW_ERROR_CANNOT_CALL;
+  int ep = epoll_create1(0);
+  struct epoll_event ev = { .events = EPOLLIN };
+  epoll_ctl(ep, EPOLL_CTL_ADD, LMW_async_fd(a), &ev);
+  *slowest = 0;
+  for (int done = 0, r; !done; ) {
+    if ((r = epoll_wait(ep, &ev, 1, 10000)) == -1 && errno == EINTR)
+      continue;
+    if (r != 1)
+      break;
+    long long t = now_ms();
+    done = LMW_async_step(a);
+    if (now_ms() - t > *slowest)
+      *slowest = now_ms() - t;
+  }
+  int code = LMW_async_code(a);
+  LMW_async_free(a);
+  close(ep);
+  return code;
+}
+
+/* a backend that takes its time */
+static int slow_backend(LMW_config *c, char *recipient, char *subject, char *body, int ac, char *av[],
+			LMW_result *res)
+{
+  (void) c; (void) recipient; (void) subject; (void) body; (void) ac; (void) av;
+  usleep(200000);
+  if (res) {
+    res->out = strdup("relayed");
+    res->out_len = strlen(res->out);
+  }
+  return 42;
+}
+
+int main(int argc , char *argv[])
+{
+  int r, ret=0;
+  (void) argc;
+  (void) argv;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  LMW_config_init(&cfg);
+  cfg.mailer = "./lmw_fakemail";
+  cfg.max_wait = 2000;
+  cfg.log_error = NULL;
+
+  size_t bl = 1 << 20;
+  char *big = malloc(bl + 1);
+  memset(big, 'a', bl);
+  big[bl] = 0;
+
+  fprintf(stdout,"========== test  %d emails at once, short body\n", EMAILS);
+  r = send_all(EMAILS, "the body", NULL, LMW_OK);
+  CHECK(r, EMAILS);
+
+  fprintf(stdout,"========== test  %d emails at once, body of %lu bytes\n", EMAILS, (unsigned long) bl);
+  r = send_all(EMAILS, big, NULL, LMW_OK);
+  CHECK(r, EMAILS);
+
+  fprintf(stdout,"========== test  %d emails at once, exit code 75\n", EMAILS);
+  r = send_all(EMAILS, big, "exit=75", 75);
+  CHECK(r, EMAILS);
+
+  fprintf(stdout,"========== test  %d emails at once, mailer stops reading\n", EMAILS);
+  r = send_all(EMAILS, big, "read=10,linger=5000", LMW_ERROR_PIPE);
+  CHECK(r, EMAILS);
+
+  fprintf(stdout,"========== test  %d emails at once, mailer stalls\n", EMAILS);
+  cfg.max_wait = 300;
+  r = send_all(EMAILS, "the body", "stall=5000", LMW_ERROR_TIMEOUT);
+  CHECK(r, EMAILS);
+
+  fprintf(stdout,"========== test  mailer that stalls and ignores SIGTERM, the steps do not block\n");
+  long long slowest;
+  r = send_one("stall=5000,ignore=15", NULL, &slowest);
+  CHECK(r, LMW_ERROR_TIMEOUT);
+  r = slowest < 50;
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  mailer that writes 10MB to stdout, the output is read as it comes\n");
+  cfg.max_wait = 2000;
+  LMW_result res;
+  r = send_one("stdout=10000000", &res, &slowest);
+  CHECK(r, LMW_OK);
+  r = res.truncated && res.out_len == cfg.capture_max && res.out[0] == 'x';
+  LMW_result_free(&res);
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  cfg->backend is called, in a thread\n");
+  cfg.backend = slow_backend;
+  long long t = now_ms();
+  LMW_async *a = LMW_send_email_async(&cfg, "TEST", "the subject", "the body", 0, NULL, &res);
+  r = a && now_ms() - t < 100 && !LMW_async_step(a);
+  CHECK(r, 1);
+  LMW_async_free(a);
+  r = res.code == 42 && res.out && !strcmp(res.out, "relayed");
+  LMW_result_free(&res);
+  CHECK(r, 1);
+  r = send_one(NULL, &res, &slowest);
+  LMW_result_free(&res);
+  CHECK(r, 42);
+  cfg.backend = NULL;
+
+  fprintf(stdout,"========== test  mailer that does not exist\n");
+  cfg.mailer = "./does_not_exist";
+  r = send_all(1, "the body", NULL, LMW_CHILD_EXEC_FAILED);
+  CHECK(r, 1);
+
+  free(big);
+  return ret;
+}
@@ -0,0 +1,276 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   throughput and latency benchmark
+
+   for each combination of body size, number of sending threads,
+   resident memory of the caller and backend, it sends emails for a
+   while, and prints one line of JSON with: emails per second, CPU time
+   per email (of this process, and of the mailers) and percentiles of
+   the time of each call
+
+   the mailer is ./lmw_fakemail , that only reads the body, so that
+   the numbers measure the library; the "smtp" backend sends to
+   ./lmw_smtp_stub , the "spawner" backend starts the mailers from
+   a helper forked at the beginning, see LMW_spawner_start()
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_smtp.h"
+#include "LMW_send_email_spawner.h"
+#include "LMW_send_email_in_thread.h"
+
+#define MAXLIST 32
+
+static const char *backends[] = { "fork", "posix_spawn", "vfork", "smtp", "spawner", "batch", "pool", "pool_borrow" };
+#define NBACKENDS 8
+#define BATCH 64   // emails per call of LMW_send_email_batch()
+
+struct worker {
+  pthread_t thread;
+  LMW_config cfg;
+  char *body;
+  int batch;
+  LMW_pool *pool;  // the emails are sent by its threads
+  double end;
+  long sent, errors;
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_s(int who)
+{
+  struct rusage ru;
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *work(void *p)
+{
+  struct worker *w = p;
+  // at least one email, also when it takes longer than the whole run
+  LMW_batch_msg msgs[BATCH];
+  do {
+    if (w->batch) {
+      for (int k = 0; k < BATCH; k++)
+	msgs[k] = (LMW_batch_msg) { .recipient = "bench@localhost", .subject = "the subject", .body = w->body };
+      int failed = LMW_send_email_batch(&w->cfg, msgs, BATCH, 0, NULL);
+      w->sent += BATCH - failed;
+      w->errors += failed;
+    } else if (w->pool) {
+      LMW_thread_context *ctx = LMW_pool_submit(w->pool, &w->cfg, "bench@localhost", "the subject", w->body, 0, NULL);
+      if (ctx && LMW_send_email_thread_wait(ctx) == LMW_OK)
+	w->sent++;
+      else
+	w->errors++;
+    } else if (LMW_send_email(&w->cfg, "bench@localhost", "the subject", w->body) == LMW_OK)
+      w->sent++;
+    else
+      w->errors++;
+  } while (now_s() < w->end);
+  return NULL;
+}
+
+/* a comma separated list of numbers, with optional suffix k or M */
+static int parse_list(char *s, long *v)
+{
+  int n = 0;
+  for (char *t = strtok(s, ","); t && n < MAXLIST; t = strtok(NULL, ",")) {
+    char *e;
+    v[n] = strtol(t, &e, 10);
+    if (*e == 'k' || *e == 'K') v[n] <<= 10;
+    if (*e == 'M') v[n] <<= 20;
+    n++;
+  }
+  return n;
+}
+
+int main(int argc , char *argv[])
+{
+  long sizes[MAXLIST] = { 1, 1 << 10, 64 << 10, 1 << 20, 100 << 20 };
+  long concs[MAXLIST] = { 1, 16, 256 };
+  long rsss[MAXLIST] = { 0, 512 };
+  int nsizes = 5, nconcs = 3, nrsss = 2;
+  int use_backend[NBACKENDS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+  double seconds = 0.3;
+  char *mailer = "./lmw_fakemail", *port = "2526";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:c:r:b:t:m:p:h")) != -1) {
+    switch (opt) {
+    case 's': nsizes = parse_list(optarg, sizes); break;
+    case 'c': nconcs = parse_list(optarg, concs); break;
+    case 'r': nrsss = parse_list(optarg, rsss); break;
+    case 'b':
+      for (int b = 0; b < NBACKENDS; b++)
+	use_backend[b] = 0;
+      for (char *t = strtok(optarg, ","); t; t = strtok(NULL, ","))
+	for (int b = 0; b < NBACKENDS; b++)
+	  if (!strcmp(t, backends[b]))
+	    use_backend[b] = 1;
+      break;
+    case 't': seconds = atof(optarg); break;
+    case 'm': mailer = optarg; break;
+    case 'p': port = optarg; break;
+    default:
+      fprintf(stderr,"Usage:  %s [-s SIZES] [-c THREADS] [-r RSS_MB] [-b BACKENDS] [-t SECONDS] [-m MAILER] [-p PORT]\n"
+	      "  lists are comma separated, sizes accept k and M suffixes;\n"
+	      "  defaults: -s 1,1k,64k,1M,100M -c 1,16,256 -r 0,512\n"
+	      "  -b fork,posix_spawn,vfork,smtp,spawner,batch,pool,pool_borrow -t 0.3\n"
+	      "  -m ./lmw_fakemail -p 2526 (port for ./lmw_smtp_stub)\n"
+	      ,argv[0]);
+      return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  LMW_config spawner_cfg;
+  LMW_config_init(&spawner_cfg);
+  if (use_backend[4] && LMW_spawner_start(&spawner_cfg) == -1) {
+    perror("LMW_spawner_start");
+    return 1;
+  }
+
+  pid_t stub = -1;
+  char relay[64];
+  snprintf(relay, sizeof(relay), "localhost:%s", port);
+  if (use_backend[3]) {
+    stub = fork();
+    if (stub == 0) {
+      execl("./lmw_smtp_stub", "lmw_smtp_stub", port, (char *) NULL);
+      _exit(127);
+    }
+    usleep(200000);
+  }
+
+  LMW_stats *stats = LMW_stats_new();
+  int ret = 0;
+  for (int r = 0; r < nrsss; r++) {
+    // grow the resident memory of this process, touching every page
+    size_t len = (size_t) rsss[r] << 20;
+    char *ballast = len ? malloc(len) : NULL;
+    if (len && !ballast) {
+      fprintf(stderr, "cannot allocate %ld MB\n", rsss[r]);
+      return 1;
+    }
+    if (ballast)
+      memset(ballast, 1, len);
+
+    for (int s = 0; s < nsizes; s++) {
+      char *body = malloc(sizes[s] + 1);
+      for (long i = 0; i < sizes[s]; i++)
+	body[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+      body[sizes[s]] = 0;
+
+      for (int b = 0; b < NBACKENDS; b++) {
+	if (!use_backend[b])
+	  continue;
+	for (int c = 0; c < nconcs; c++) {
+	  int n = concs[c];
+	  struct worker *w = calloc(n, sizeof(struct worker));
+	  // as many threads in the pool as submitting them
+	  LMW_pool *pool = b >= 6 ? LMW_pool_create(n, n) : NULL;
+	  if (pool)
+	    LMW_pool_set_borrow(pool, b == 7);
+	  LMW_alloc_counts a0, a1;
+	  LMW_pool_alloc_counts(&a0);
+	  LMW_stats_reset(stats);
+	  double t0 = now_s(), self0 = cpu_s(RUSAGE_SELF), child0 = cpu_s(RUSAGE_CHILDREN);
+	  for (int k = 0; k < n; k++) {
+	    LMW_config_init(&w[k].cfg);
+	    w[k].cfg.mailer = mailer;
+	    w[k].cfg.max_wait = 60000;
+	    w[k].cfg.log_error = NULL;
+	    w[k].cfg.stats = stats;
+	    if (b == 3) {
+	      w[k].cfg.backend = LMW_backend_smtp;
+	      w[k].cfg.smtp_relay = relay;
+	    } else if (b == 4)
+	      w[k].cfg.backend = LMW_backend_spawner;
+	    else if (b == 5)
+	      w[k].batch = 1;   // with the default spawn, and batch_parallel
+	    else if (b >= 6)
+	      w[k].pool = pool;
+	    else
+	      w[k].cfg.spawn = b;
+	    w[k].body = body;
+	    w[k].end = t0 + seconds;
+	    pthread_create(&w[k].thread, NULL, work, &w[k]);
+	  }
+	  long sent = 0, errors = 0;
+	  for (int k = 0; k < n; k++) {
+	    pthread_join(w[k].thread, NULL);
+	    sent += w[k].sent;
+	    errors += w[k].errors;
+	  }
+	  double t = now_s() - t0;
+	  LMW_pool_alloc_counts(&a1);
+	  LMW_pool_destroy(pool);
+	  double self = cpu_s(RUSAGE_SELF) - self0, child = cpu_s(RUSAGE_CHILDREN) - child0;
+	  long total = sent + errors;
+	  LMW_stats_snapshot snap;
+	  LMW_stats_get(stats, &snap);
+	  LMW_phase_snapshot *p = &snap.phase[LMW_PHASE_TOTAL];
+	  fprintf(stdout, "{\"backend\":\"%s\",\"body_bytes\":%ld,\"threads\":%d,\"rss_mb\":%ld,"
+		  "\"emails\":%ld,\"errors\":%ld,\"seconds\":%.3f,\"emails_per_s\":%.1f,"
+		  "\"cpu_us_per_email\":%.1f,\"mailer_cpu_us_per_email\":%.1f,"
+		  "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+		  "\"ctx_mallocs\":%llu,\"ctx_reused\":%llu,\"ctx_freed\":%llu}\n",
+		  backends[b], sizes[s], n, rsss[r],
+		  sent, errors, t, total / t,
+		  self * 1e6 / total, child * 1e6 / total,
+		  p->p50_ns / 1e3, p->p99_ns / 1e3, p->p999_ns / 1e3, p->max_ns / 1e3,
+		  a1.mallocs - a0.mallocs, a1.reused - a0.reused, a1.freed - a0.freed);
+	  fflush(stdout);
+	  if (errors)
+	    ret = 1;
+	  free(w);
+	}
+	LMW_smtp_close_all();
+      }
+      free(body);
+    }
+    free(ballast);
+  }
+
+  LMW_stats_free(stats);
+  LMW_spawner_stop();
+  if (stub > 0) {
+    kill(stub, SIGTERM);
+    waitpid(stub, NULL, 0);
+  }
+  return ret;
+}
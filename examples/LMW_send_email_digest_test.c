@@ -0,0 +1,140 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for LMW_digest
+
+   it sends bursts of repeated emails through a digest, to ./lmw_fakemail
+   that records them in a file, and counts the emails that were delivered
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_digest.h"
+
+static char record[] = "/tmp/lmw_digest_test_XXXXXX";
+
+/* how many lines of the recorded emails start with `what` */
+static int recorded(const char *what)
+{
+  FILE *f = fopen(record, "r");
+  char line[4096];
+  int n = 0;
+  while (f && fgets(line, sizeof(line), f))
+    n += !strncmp(line, what, strlen(what));
+  if (f) fclose(f);
+  return n;
+}
+
+int main(int argc , char *argv[])
+{
+  int r, ret=0;
+  (void) argc;
+  (void) argv;
+  LMW_config cfg;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  int fd = mkstemp(record);
+  if (fd == -1) {
+    perror(record);
+    return 1;
+  }
+  close(fd);
+  char env[64];
+  snprintf(env, sizeof(env), "record=%s", record);
+  setenv("LMW_FAKEMAIL", env, 1);
+
+  LMW_config_init(&cfg);
+  cfg.mailer = "./lmw_fakemail";
+  LMW_digest_config dcfg;
+  LMW_digest_config_init(&dcfg);
+  dcfg.window = 300;
+  dcfg.slots = 8;
+  dcfg.sample_max = 64;
+
+  fprintf(stdout,"========== test  1000 alerts with 2 keys\n");
+  LMW_digest *dg = LMW_digest_open(&cfg, &dcfg);
+  char body[64];
+  r = 0;
+  for (int j = 0; j < 1000; j++) {
+    snprintf(body, sizeof(body), "disk is full, alert number %d\n", j);
+    r |= LMW_digest_send(dg, "TEST", "disk full", body, j % 10 ? "disk" : "other");
+  }
+  CHECK(r, LMW_OK);
+  // only the first email of each key was sent
+  r = recorded("Subject:");
+  CHECK(r, 2);
+  r = LMW_digest_pending(dg);
+  CHECK(r, 998);
+
+  fprintf(stdout,"========== test  the windows end\n");
+  usleep(500000);
+  r = LMW_digest_pending(dg);
+  CHECK(r, 0);
+  r = recorded("Subject: disk full (899 times)") + recorded("Subject: disk full (99 times)");
+  CHECK(r, 2);
+  r = recorded("----- last email -----");
+  CHECK(r, 2);
+  r = recorded("disk is full, alert number 999");
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  a single repeat is sent as it is\n");
+  LMW_digest_send(dg, "TEST", "disk full", "only once\n", "disk");
+  LMW_digest_flush(dg);
+  r = recorded("only once");
+  CHECK(r, 1);
+  r = recorded("Subject: disk full\n");
+  CHECK(r, 3);
+  LMW_digest_close(dg);
+
+  fprintf(stdout,"========== test  when the table is full, emails are sent at once\n");
+  unlink(record);
+  dg = LMW_digest_open(&cfg, &dcfg);
+  for (int j = 0; j < 10; j++) {
+    snprintf(body, sizeof(body), "key%d", j);
+    LMW_digest_send(dg, "TEST", "subject", "body\n", body);
+  }
+  r = recorded("Subject:");
+  CHECK(r, 10);
+  for (int j = 0; j < 10; j++) {
+    snprintf(body, sizeof(body), "key%d", j);
+    LMW_digest_send(dg, "TEST", "subject", "body\n", body);
+  }
+  // 6 keys fit in the table, the other 4 are sent again
+  r = recorded("Subject:");
+  CHECK(r, 14);
+  LMW_digest_close(dg);
+  r = recorded("Subject:");
+  CHECK(r, 20);
+
+  unlink(record);
+  return ret;
+}
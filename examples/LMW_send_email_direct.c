@@ -27,6 +27,9 @@
 
 */
 
+// the library code uses some Linux extensions, that must be
+// requested before any system header is included
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
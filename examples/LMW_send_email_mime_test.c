@@ -0,0 +1,274 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for MIME messages and base64
+
+   it compares the base64 kernel with the scalar encoder, builds a message
+   with a text and two attachments, decodes it back, and sends it to
+   ./lmw_fakemail that records it in a file
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_mime.h"
+
+#define SIZE 200003   // not a multiple of 3 , nor of LMW_MIME_CHUNK
+
+static char record[] = "/tmp/lmw_mime_test_XXXXXX";
+static char data[] = "/tmp/lmw_mime_data_XXXXXX";
+
+/* decodes the base64 lines from `s` to the next empty line or boundary; returns the bytes */
+static size_t decode(const char *s, unsigned char *out)
+{
+  static const char *t = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t n = 0;
+  unsigned v = 0, bits = 0;
+  for (; *s && *s != '-' && !(s[0] == '\n' && s[1] == '\n'); s++) {
+    const char *p = strchr(t, *s);
+    if (*s == '\n' || *s == '=' || !p)
+      continue;
+    v = v << 6 | (unsigned) (p - t);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out[n++] = v >> bits;
+    }
+  }
+  return n;
+}
+
+/* decodes quoted-printable; returns the bytes */
+static size_t qp_decode(const char *s, size_t n, char *out)
+{
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] != '=')
+      out[k++] = s[i];
+    else if (i + 1 < n && s[i + 1] == '\n')
+      i++;
+    else if (i + 2 < n) {
+      char h[3] = { s[i + 1], s[i + 2], 0 };
+      out[k++] = (char) strtol(h, NULL, 16);
+      i += 2;
+    }
+  }
+  return k;
+}
+
+/* the longest line */
+static size_t longest(const char *s, size_t n)
+{
+  size_t max = 0, l = 0;
+  for (size_t i = 0; i < n; i++, l++)
+    if (s[i] == '\n') {
+      max = l > max ? l : max;
+      l = (size_t) -1;
+    }
+  return l > max ? l : max;
+}
+
+/* the whole message, read `step` bytes at a time */
+static char *produce(LMW_mime *m, size_t step, size_t *len)
+{
+  size_t cap = 4 * SIZE, n = 0;
+  char *msg = malloc(cap + 1);
+  ssize_t r;
+  while ((r = LMW_mime_read(m, msg + n, step < cap - n ? step : cap - n)) > 0)
+    n += r;
+  msg[n] = 0;
+  *len = n;
+  return r < 0 ? NULL : msg;
+}
+
+int main(int argc , char *argv[])
+{
+  char *recipient = "TEST";
+  char *subject =  "the subject";
+  int r, ret=0;
+  LMW_config cfg;
+  LMW_config_init(&cfg);
+  cfg.mailer = "./lmw_fakemail";
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  unsigned char *in = malloc(SIZE), *back = malloc(SIZE + 3);
+  char *a = malloc(SIZE / 3 * 4 + 4), *b = malloc(SIZE / 3 * 4 + 4);
+  srand(1);
+  for (int i = 0; i < SIZE; i++)
+    in[i] = rand();
+
+  fprintf(stdout,"========== test  base64 with the %s kernel, as the scalar one\n", LMW_base64_kernel());
+  r = 0;
+  for (size_t n = 0; n < 1000; n++)
+    if (LMW_base64_encode(in + n, n, a) != LMW_base64_encode_scalar(in + n, n, b) ||
+	memcmp(a, b, 4 * ((n + 2) / 3)))
+      r++;
+  CHECK(r, 0);
+  r = LMW_base64_encode(in, SIZE, a) == LMW_base64_encode_scalar(in, SIZE, b) && !memcmp(a, b, SIZE / 3 * 4 + 4);
+  CHECK(r, 1);
+  r = LMW_base64_encode("Man", 3, a) == 4 && !memcmp(a, "TWFu", 4) && LMW_base64_encode("M", 1, a) == 4 &&
+    !memcmp(a, "TQ==", 4);
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  text scan with the SIMD kernel, as the scalar one\n");
+  // mostly plain text, with some newlines, tabs, control characters and bytes >= 128
+  static const char mix[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa  \n\n\t\r\x01\x7f\xc3\xa8";
+  char *text = malloc(SIZE + 1);
+  for (int i = 0; i < SIZE; i++)
+    text[i] = (rand() % 50) ? mix[rand() % 33] : mix[rand() % (sizeof(mix) - 1)];
+  text[SIZE] = 0;
+  r = 0;
+  size_t maxl[4] = { 0, 5, 40, 998 };
+  for (size_t n = 0; n < 1000; n++)
+    for (int k = 0; k < 4; k++)
+      if (LMW_text_scan(text + n, n, maxl[k]) != LMW_text_scan_scalar(text + n, n, maxl[k]))
+	r++;
+  CHECK(r, 0);
+  r = LMW_text_scan("caff\xc3\xa8 al bar\r\n", 14, 0) == (LMW_SCAN_8BIT | LMW_SCAN_NEWLINE) &&
+    LMW_text_scan("the subject", 11, 0) == 0 &&
+    LMW_text_scan("0123456789\n", 11, 9) == LMW_SCAN_NEWLINE + LMW_SCAN_LONG_LINE &&
+    LMW_text_scan("a\tb\x1b", 4, 0) == LMW_SCAN_CONTROL;
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  quoted-printable, decoded back\n");
+  char *qp = malloc(4 * SIZE), *plain = malloc(SIZE + 1);
+  size_t ql = LMW_qp_encode(text, SIZE, qp);
+  r = LMW_text_scan(qp, ql, 76);
+  CHECK(r, LMW_SCAN_NEWLINE);
+  // but for CR LF , that become a newline
+  size_t pl = qp_decode(qp, ql, plain), tl = 0;
+  for (size_t i = 0; i < SIZE; i++)
+    if (!(text[i] == '\r' && i + 1 < SIZE && text[i + 1] == '\n'))
+      text[tl++] = text[i];
+  r = pl == tl && !memcmp(plain, text, tl);
+  CHECK(r, 1);
+  ql = LMW_qp_encode("a = b \ncaff\xc3\xa8\t", 14, qp);
+  r = ql == 24 && !memcmp(qp, "a =3D b=20\ncaff=C3=A8=09", 24);
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  a message with a subject and a text in UTF-8\n");
+  LMW_mime *m = LMW_mime_new(NULL, recipient, "the subject\nBcc: someone@example.com");
+  r = m == NULL && errno == EINVAL;
+  CHECK(r, 1);
+  m = LMW_mime_new(NULL, recipient, "caff\xc3\xa8");
+  LMW_mime_add_text(m, "caff\xc3\xa8\n");
+  size_t len;
+  char *msg = produce(m, 1000, &len);
+  LMW_mime_free(m);
+  r = msg && strstr(msg, "Subject: =?UTF-8?Q?caff=C3=A8?=\n") &&
+    strstr(msg, "Content-Transfer-Encoding: quoted-printable\n\ncaff=C3=A8\n") &&
+    longest(msg, len) <= 76;
+  CHECK(r, 1);
+  free(msg);
+
+  fprintf(stdout,"========== test  a message with a text and two attachments, decoded back\n");
+  int fd = mkstemp(data);
+  if (fd == -1 || write(fd, in, SIZE) != SIZE) {
+    perror(data);
+    return 1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  int empty = open("/dev/null", O_RDONLY);
+  m = LMW_mime_new("me@example.com", recipient, subject);
+  LMW_mime_add_text(m, "the body\n");
+  LMW_mime_add_fd(m, fd, "data.bin", NULL);
+  LMW_mime_add_fd(m, empty, "empty.txt", "text/plain");
+  msg = produce(m, 1000, &len);
+  LMW_mime_free(m);
+  r = msg && strstr(msg, "Subject: the subject\n") && strstr(msg, "\nthe body\n");
+  CHECK(r, 1);
+  char *att = msg ? strstr(msg, "filename=\"data.bin\"\n\n") : NULL;
+  if (att)
+    att += strlen("filename=\"data.bin\"\n\n");
+  r = att ? (int) decode(att, back) : -1;
+  CHECK(r, SIZE);
+  r = memcmp(in, back, SIZE) == 0;
+  CHECK(r, 1);
+  // lines of 76 characters
+  r = att ? (int) (strchr(att, '\n') - att) : -1;
+  CHECK(r, 76);
+
+  fprintf(stdout,"========== test  sent to ./lmw_fakemail as to sendmail -t\n");
+  int rfd = mkstemp(record);
+  if (rfd == -1) {
+    perror(record);
+    return 1;
+  }
+  close(rfd);
+  char env[128];
+  snprintf(env, sizeof(env), "record=%s", record);
+  setenv("LMW_FAKEMAIL", env, 1);
+  lseek(fd, 0, SEEK_SET);
+  m = LMW_mime_new("me@example.com", recipient, subject);
+  LMW_mime_add_text(m, "the body\n");
+  LMW_mime_add_fd(m, fd, "data.bin", NULL);
+  LMW_mime_add_fd(m, empty, "empty.txt", "text/plain");
+  r = LMW_mime_send(&cfg, m, 0, NULL);
+  LMW_mime_free(m);
+  CHECK(r, LMW_OK);
+  // lmw_fakemail adds its own lines, as if the last argument were the recipient
+  char *added = "Subject: \nTo: -i\n\n";
+  FILE *f = fopen(record, "r");
+  char *got = malloc(len + strlen(added) + 2);
+  r = f ? (int) fread(got, 1, len + strlen(added) + 2, f) : -1;
+  if (f)
+    fclose(f);
+  // the boundaries differ, but have the same length
+  CHECK(r, (int) (len + strlen(added) + 1));
+  r = msg && !memcmp(got + strlen(added), msg, strstr(msg, "boundary=") - msg);
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  an attachment that cannot be read\n");
+  int wfd = open(data, O_WRONLY);
+  m = LMW_mime_new(NULL, recipient, subject);
+  LMW_mime_add_fd(m, wfd, "data.bin", NULL);
+  r = LMW_mime_send(&cfg, m, 0, NULL);
+  LMW_mime_free(m);
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+
+  close(wfd);
+  close(fd);
+  close(empty);
+  unlink(data);
+  unlink(record);
+  free(got);
+  free(msg);
+  free(text);
+  free(qp);
+  free(plain);
+  free(in);
+  free(back);
+  free(a);
+  free(b);
+  return ret;
+}
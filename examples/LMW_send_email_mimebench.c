@@ -0,0 +1,152 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   benchmark for base64 and MIME messages
+
+   for each size, encodes random bytes with the scalar encoder and with
+   the kernel chosen for this CPU (see LMW_base64_kernel() ), and then
+   produces a whole MIME message with an attachment read from a file;
+   prints one line of JSON per measure, with megabytes per second
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_mime.h"
+
+// each measure lasts about this long, in seconds
+#define SECONDS 0.3
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s of `encode` on `n` bytes */
+static double encode_rate(size_t (*encode)(const void *, size_t, char *), unsigned char *in, size_t n, char *out)
+{
+  long rounds = 0;
+  double start = now_s(), t;
+  do {
+    for (int k = 0; k < 16; k++)
+      encode(in, n, out);
+    rounds += 16;
+  } while ((t = now_s() - start) < SECONDS);
+  return rounds * (double) n / t / 1e6;
+}
+
+/* MB/s of `scan` on `n` bytes of text, and of copying them */
+static double scan_rate(unsigned (*scan)(const char *, size_t, size_t), char *text, size_t n, char *out)
+{
+  long rounds = 0;
+  volatile unsigned found = 0;
+  double start = now_s(), t;
+  do {
+    for (int k = 0; k < 16; k++) {
+      if (scan)
+	found |= scan(text, n, 998);
+      else
+	memcpy(out, text, n);
+    }
+    rounds += 16;
+  } while ((t = now_s() - start) < SECONDS);
+  return rounds * (double) n / t / 1e6;
+}
+
+/* MB/s of attachment producing a MIME message with the file `path` */
+static double mime_rate(char *path, size_t n)
+{
+  static char buf[1 << 16];
+  long rounds = 0;
+  double start = now_s(), t;
+  do {
+    int fd = open(path, O_RDONLY);
+    LMW_mime *m = LMW_mime_new(NULL, "TEST", "the subject");
+    LMW_mime_add_text(m, "the body");
+    LMW_mime_add_fd(m, fd, "data.bin", NULL);
+    while (LMW_mime_read(m, buf, sizeof(buf)) > 0)
+      ;
+    LMW_mime_free(m);
+    close(fd);
+    rounds++;
+  } while ((t = now_s() - start) < SECONDS);
+  return rounds * (double) n / t / 1e6;
+}
+
+int main(int argc , char *argv[])
+{
+  size_t sizes[] = { 100, 1000, 57 * 1024, 1 << 20, 16 << 20 };
+  size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+  unsigned char *in = malloc(max);
+  char *out = malloc(max / 3 * 4 + 4);
+  srand(1);
+  for (size_t i = 0; i < max; i++)
+    in[i] = rand();
+  char *path = "/tmp/lmw_mimebench_data";
+
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    double scalar = encode_rate(LMW_base64_encode_scalar, in, n, out);
+    double simd = encode_rate(LMW_base64_encode, in, n, out);
+    printf("{\"measure\":\"base64\",\"size\":%zu,\"scalar_MB_s\":%.0f,\"kernel\":\"%s\",\"kernel_MB_s\":%.0f,"
+	   "\"speedup\":%.2f}\n", n, scalar, LMW_base64_kernel(), simd, simd / scalar);
+    fflush(stdout);
+  }
+
+  // lines of 72 characters, with some of UTF-8
+  char *text = malloc(max);
+  for (size_t i = 0; i < max; i++)
+    text[i] = (i % 73 == 72) ? '\n' : (i % 997 == 5) ? '\xc3' : 'a' + i % 26;
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    double scalar = scan_rate(LMW_text_scan_scalar, text, n, out);
+    double simd = scan_rate(LMW_text_scan, text, n, out);
+    printf("{\"measure\":\"text_scan\",\"size\":%zu,\"scalar_MB_s\":%.0f,\"kernel_MB_s\":%.0f,"
+	   "\"speedup\":%.2f,\"memcpy_MB_s\":%.0f}\n", n, scalar, simd, simd / scalar, scan_rate(NULL, text, n, out));
+    fflush(stdout);
+  }
+
+  for (unsigned s = 2; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    FILE *f = fopen(path, "w");
+    if (!f || fwrite(in, 1, n, f) != n) {
+      perror(path);
+      return 1;
+    }
+    fclose(f);
+    printf("{\"measure\":\"mime\",\"size\":%zu,\"kernel\":\"%s\",\"MB_s\":%.0f}\n",
+	   n, LMW_base64_kernel(), mime_rate(path, n));
+    fflush(stdout);
+  }
+  unlink(path);
+  free(in);
+  free(text);
+  free(out);
+  return 0;
+}
@@ -0,0 +1,197 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for the persistent outbox
+
+   will queue emails while the mailer fails, close the outbox,
+   reopen it with a working mailer, and check that the emails
+   left in the journal are sent
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_outbox.h"
+
+#define N 5
+
+/* enqueues emails of 32KB, and every tenth one that keeps failing */
+#define THREADS 4
+#define PER_THREAD 80
+
+static LMW_outbox *shared_ob;
+static char *shared_big;
+
+static void* enqueuer(void *arg)
+{
+  char *fail_argv[] = { "-X", "exit=75" };
+  long errors = 0;
+  for (int i = 0; i < PER_THREAD; i++) {
+    int r;
+    if (i % 10 == 9)
+      r = LMW_outbox_enqueue(shared_ob, "TEST", "fails", "the body", 2, fail_argv);
+    else
+      r = LMW_outbox_enqueue(shared_ob, "TEST", "the subject", shared_big, 0, NULL);
+    errors += r != LMW_OK;
+    for (int j = 0; j < 500 && LMW_outbox_pending(shared_ob) > THREADS * PER_THREAD / 10 + 4; j++)
+      usleep(1000);
+  }
+  (void) arg;
+  return (void *) errors;
+}
+
+int main(int argc , char *argv[])
+{
+  char *journal = (argc > 1) ? argv[1] : "/tmp/lmw_outbox_test.journal";
+  char *recipient = "TEST";
+  char *subject =  "the subject";
+  char *mail_argv[] = { "-a", "X-Test: 1", NULL };
+  int r, ret=0;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, result  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  unlink(journal);
+
+  LMW_config cfg;
+  LMW_config_init(&cfg);
+  LMW_outbox_config ocfg;
+  LMW_outbox_config_init(&ocfg);
+  ocfg.retry_min = 10;
+  ocfg.retry_max = 100;
+
+  fprintf(stdout,"========== test  /bin/false , %d emails stay in the journal\n", N);
+  cfg.mailer = "/bin/false";
+  cfg.log_error = NULL;
+  LMW_outbox *ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  if (!ob) {
+    perror(journal);
+    return 1;
+  }
+  for (int i = 0; i < N; i++)
+    LMW_outbox_enqueue(ob, recipient, subject, "the body", 2, mail_argv);
+  r = LMW_outbox_flush(ob);
+  CHECK(r, 0);
+  usleep(200000);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, N);
+  LMW_outbox_close(ob);
+
+  fprintf(stdout,"========== test  /bin/true , the journal is replayed\n");
+  cfg.mailer = "/bin/true";
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  for (int i = 0; i < 500 && LMW_outbox_pending(ob) > 0; i++)
+    usleep(10000);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, 0);
+  LMW_outbox_close(ob);
+
+  fprintf(stdout,"========== test  /bin/true , nothing left to replay\n");
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, 0);
+  LMW_outbox_close(ob);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , one email keeps failing while many are sent\n");
+  // ten times the journal, that is compacted around the failing email
+  cfg.mailer = "./lmw_fakemail";
+  ocfg.max_size = 1 << 20;
+  ocfg.retry_max = 20;
+  char *fail_argv[] = { "-X", "exit=75" };
+  char *big = malloc(32 << 10);
+  memset(big, 'x', (32 << 10) - 1);
+  big[(32 << 10) - 1] = 0;
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  LMW_outbox_enqueue(ob, recipient, "fails", "the body", 2, fail_argv);
+  r = LMW_OK;
+  for (int i = 0; i < 320 && r == LMW_OK; i++) {
+    r = LMW_outbox_enqueue(ob, recipient, subject, big, 0, NULL);
+    for (int j = 0; j < 500 && LMW_outbox_pending(ob) > 4; j++)
+      usleep(1000);
+  }
+  CHECK(r, LMW_OK);
+  for (int i = 0; i < 500 && LMW_outbox_pending(ob) > 1; i++)
+    usleep(10000);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, 1);
+  LMW_outbox_close(ob);
+  struct stat st;
+  r = stat(journal, &st) == 0 && st.st_size <= (1 << 20);
+  CHECK(r, 1);
+  // the failing email is still there
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, 1);
+  LMW_outbox_close(ob);
+
+  fprintf(stdout,"========== test  an invalid subject is refused, and not kept\n");
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  r = LMW_outbox_enqueue(ob, recipient, "hi\r\nBcc: everyone@example.com", "the body", 0, NULL);
+  CHECK(r, LMW_ERROR_INVALID);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, 1);
+  LMW_outbox_close(ob);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , %d threads enqueue while the journal is compacted\n", THREADS);
+  // the records appended while a compaction writes the new file are kept
+  unlink(journal);
+  shared_big = big;
+  // the failing emails are retried seldom, so that the drainer sends the others
+  ocfg.retry_min = 500;
+  ocfg.retry_max = 1000;
+  // room for the emails pending meanwhile, and still compacted a few times
+  ocfg.max_size = 4 << 20;
+  shared_ob = ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  pthread_t th[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&th[i], NULL, enqueuer, NULL);
+  long errors = 0;
+  for (int i = 0; i < THREADS; i++) {
+    void *e;
+    pthread_join(th[i], &e);
+    errors += (long) e;
+  }
+  r = errors;
+  CHECK(r, 0);
+  for (int i = 0; i < 500 && LMW_outbox_pending(ob) > THREADS * PER_THREAD / 10; i++)
+    usleep(10000);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, THREADS * PER_THREAD / 10);
+  LMW_outbox_close(ob);
+  ob = LMW_outbox_open(&cfg, journal, &ocfg);
+  r = LMW_outbox_pending(ob);
+  CHECK(r, THREADS * PER_THREAD / 10);
+  LMW_outbox_close(ob);
+  free(big);
+
+  unlink(journal);
+  return ret;
+}
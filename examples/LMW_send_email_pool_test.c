@@ -0,0 +1,232 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for the pool of threads sending emails
+
+   will test the queue, the backpressure and the drain,
+   the priority classes and the deadlines, and check the exit status
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_in_thread.h"
+
+#define N 20
+
+int main(int argc , char *argv[])
+{
+  char *recipient = "TEST";
+  char *subject =  "the subject";
+  char *body = "the body";
+  int r, ret=0;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  LMW_config cfg;
+  LMW_config_init(&cfg);
+
+  fprintf(stdout,"========== test  /bin/false , %d emails in a pool of 4 threads\n", N);
+  cfg.mailer = "/bin/false";
+  LMW_pool *pool = LMW_pool_create(4, 16);
+  LMW_thread_context *ctx[N];
+  for (int i = 0; i < N; i++)
+    ctx[i] = LMW_pool_submit(pool, &cfg, recipient, subject, body, 0, NULL);
+  LMW_pool_drain(pool);
+  for (int i = 0; i < N; i++) {
+    r = LMW_send_email_thread_check(ctx[i]);
+    if (r != 1) break;
+    r = LMW_send_email_thread_wait(ctx[i]);
+    if (r != 1) break;
+  }
+  CHECK(r, 1);
+  LMW_pool_destroy(pool);
+
+  fprintf(stdout,"========== test  ./cat_dev_null.sh , full queue\n");
+  cfg.mailer = "./cat_dev_null.sh";
+  cfg.max_wait = 200;
+  pool = LMW_pool_create(1, 1);
+  // the first is sent at once, the second stays in the queue
+  ctx[0] = LMW_pool_submit(pool, &cfg, recipient, subject, body, 0, NULL);
+  ctx[1] = LMW_pool_submit(pool, &cfg, recipient, subject, body, 0, NULL);
+  ctx[2] = LMW_pool_try_submit(pool, &cfg, recipient, subject, body, 0, NULL);
+  r = (ctx[2] == NULL && errno == EAGAIN) ? EAGAIN : 0;
+  CHECK(r, EAGAIN);
+  if (ctx[2])
+    LMW_send_email_thread_wait(ctx[2]);
+  r = LMW_send_email_thread_wait(ctx[0]);
+  CHECK(r, LMW_ERROR_TIMEOUT);
+  r = LMW_send_email_thread_wait(ctx[1]);
+  CHECK(r, LMW_ERROR_TIMEOUT);
+  LMW_pool_destroy(pool);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , the strings are copied, in arenas that are reused\n");
+  cfg.mailer = "./lmw_fakemail";
+  cfg.max_wait = 5000;
+  char *record = "/tmp/lmw_pool_test_record", subj[32], setting[64], buf[4096];
+  unlink(record);
+  snprintf(setting, sizeof(setting), "record=%s", record);
+  char *xargs[2] = { "-X", setting };
+  pool = LMW_pool_create(2, 16);
+  LMW_alloc_counts before, after;
+  LMW_pool_alloc_counts(&before);
+  r = 0;
+  for (int i = 0; i < N; i++) {
+    snprintf(subj, sizeof(subj), "copied %d", i);
+    ctx[0] = LMW_pool_submit(pool, &cfg, recipient, subj, body, 2, xargs);
+    // changed before it is sent
+    strcpy(subj, "changed");
+    r |= LMW_send_email_thread_wait(ctx[0]);
+  }
+  CHECK(r, LMW_OK);
+  LMW_pool_alloc_counts(&after);
+  // the first is allocated, then it is reused
+  r = (int) (after.mallocs - before.mallocs);
+  CHECK(r, 1);
+  r = (int) (after.reused - before.reused);
+  CHECK(r, N - 1);
+  FILE *f = fopen(record, "r");
+  buf[f ? fread(buf, 1, sizeof(buf) - 1, f) : 0] = 0;
+  if (f)
+    fclose(f);
+  unlink(record);
+  r = strstr(buf, "Subject: copied 0\n") && strstr(buf, "Subject: copied 19\n") && !strstr(buf, "changed");
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , the strings are borrowed\n");
+  LMW_pool_set_borrow(pool, 1);
+  for (int i = 0; i < 4; i++)
+    ctx[i] = LMW_pool_submit(pool, &cfg, recipient, subject, body, 2, xargs);
+  r = 0;
+  for (int i = 0; i < 4; i++)
+    r |= LMW_send_email_thread_wait(ctx[i]);
+  CHECK(r, LMW_OK);
+  LMW_pool_destroy(pool);
+  f = fopen(record, "r");
+  buf[f ? fread(buf, 1, sizeof(buf) - 1, f) : 0] = 0;
+  if (f)
+    fclose(f);
+  unlink(record);
+  r = strstr(buf, "Subject: the subject\nTo: TEST\n\nthe body") != NULL;
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , urgent emails overtake bulk emails\n");
+  // while the only worker is busy with a mailer that stalls, emails are queued
+  char stall[64];
+  snprintf(stall, sizeof(stall), "stall=300,record=%s", record);
+  char *sargs[2] = { "-X", stall };
+  LMW_thread_context *busy, *urgent[6], *bulk[6];
+  pool = LMW_pool_create(1, 16);
+  busy = LMW_pool_submit(pool, &cfg, recipient, "busy", body, 2, sargs);
+  usleep(50000);
+  char bulk_subj[6][16], urgent_subj[6][16];
+  for (int i = 0; i < 6; i++) {
+    snprintf(bulk_subj[i], 16, "bulk %d", i);
+    bulk[i] = LMW_pool_submit_prio(pool, LMW_PRIO_BULK, NULL, &cfg, recipient, bulk_subj[i], body, 2, xargs);
+  }
+  for (int i = 0; i < 6; i++) {
+    snprintf(urgent_subj[i], 16, "urgent %d", i);
+    urgent[i] = LMW_pool_submit_prio(pool, LMW_PRIO_URGENT, NULL, &cfg, recipient, urgent_subj[i], body, 2, xargs);
+  }
+  LMW_pool_class_stats st;
+  LMW_pool_stats(pool, LMW_PRIO_BULK, &st);
+  r = (int) st.depth;
+  CHECK(r, 6);
+  r = LMW_send_email_thread_wait(busy);
+  for (int i = 0; i < 6; i++)
+    r |= LMW_send_email_thread_wait(bulk[i]) | LMW_send_email_thread_wait(urgent[i]);
+  CHECK(r, LMW_OK);
+  f = fopen(record, "r");
+  buf[f ? fread(buf, 1, sizeof(buf) - 1, f) : 0] = 0;
+  if (f)
+    fclose(f);
+  unlink(record);
+  // with weights 8:4:1 , at most one bulk email is sent before the last urgent one
+  char *last_urgent = strstr(buf, "Subject: urgent 5\n"), *second_bulk = strstr(buf, "Subject: bulk 1\n");
+  r = last_urgent && second_bulk && last_urgent < second_bulk;
+  CHECK(r, 1);
+  LMW_pool_stats(pool, LMW_PRIO_URGENT, &st);
+  r = st.sent == 6 && st.depth == 0 && st.wait_max_ms > 200;
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , an email that expires in the queue is dropped\n");
+  struct timespec deadline;
+  busy = LMW_pool_submit(pool, &cfg, recipient, "busy", body, 2, sargs);
+  usleep(50000);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 50000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  int failures = cfg.failures;
+  ctx[0] = LMW_pool_submit_prio(pool, LMW_PRIO_URGENT, &deadline, &cfg, recipient, "late", body, 2, xargs);
+  r = LMW_send_email_thread_wait(ctx[0]);
+  CHECK(r, LMW_ERROR_EXPIRED);
+  LMW_send_email_thread_wait(busy);
+  f = fopen(record, "r");
+  buf[f ? fread(buf, 1, sizeof(buf) - 1, f) : 0] = 0;
+  if (f)
+    fclose(f);
+  unlink(record);
+  LMW_pool_stats(pool, LMW_PRIO_URGENT, &st);
+  r = st.expired == 1 && cfg.failures == failures + 1 && strstr(buf, "Subject: busy\n") && !strstr(buf, "Subject: late\n");
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  ./lmw_fakemail , or downgraded to the next class\n");
+  LMW_pool_set_expiry(pool, LMW_PRIO_URGENT, LMW_EXPIRED_DOWNGRADE);
+  busy = LMW_pool_submit(pool, &cfg, recipient, "busy", body, 2, sargs);
+  usleep(50000);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  ctx[0] = LMW_pool_submit_prio(pool, LMW_PRIO_URGENT, &deadline, &cfg, recipient, "downgraded", body, 2, xargs);
+  r = LMW_send_email_thread_wait(ctx[0]);
+  CHECK(r, LMW_OK);
+  LMW_send_email_thread_wait(busy);
+  LMW_pool_stats(pool, LMW_PRIO_URGENT, &st);
+  r = st.downgraded == 1 && st.expired == 1;
+  LMW_pool_stats(pool, LMW_PRIO_NORMAL, &st);
+  r = r && st.submitted == 4;
+  CHECK(r, 1);
+  ctx[0] = LMW_pool_try_submit_prio(pool, LMW_POOL_CLASSES, NULL, &cfg, recipient, subject, body, 0, NULL);
+  r = (ctx[0] == NULL && errno == EINVAL) ? EINVAL : 0;
+  CHECK(r, EINVAL);
+  LMW_pool_destroy(pool);
+  unlink(record);
+
+  fprintf(stdout,"========== test  /bin/false , in the default pool\n");
+  cfg.mailer = "/bin/false";
+  ctx[0] = LMW_send_email_thread_start(&cfg, recipient, subject, body);
+  r = LMW_send_email_thread_wait(ctx[0]);
+  CHECK(r, 1);
+
+  return ret;
+}
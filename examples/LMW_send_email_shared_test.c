@@ -0,0 +1,128 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for many threads sharing one LMW_config
+
+   64 threads send emails, and batches of emails, with the same config;
+   the failures must all be counted, and no SIGPIPE must reach the
+   process. Build it with  make tsan  to run it under ThreadSanitizer.
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "LMW_send_email.h"
+
+#define THREADS 64
+#define BATCH 3
+
+static LMW_config cfg;
+static char *big;  // larger than a pipe, so that the mailer that stops reading gets EPIPE
+static char *x_exit[2] = { "-X", "exit=75" };
+static char *x_read[2] = { "-X", "read=10,exit=3" };
+static atomic_int sigpipes, wrong;
+
+static void on_sigpipe(int sig)
+{
+  (void) sig;
+  sigpipes++;
+}
+
+/* what each thread does: sends 3 emails, one ok and two failing, and a batch of failing ones */
+static void *sender(void *arg)
+{
+  (void) arg;
+  if (LMW_send_email(&cfg, "TEST", "the subject", "the body") != LMW_OK)
+    wrong++;
+  if (LMW_send_email_argv(&cfg, "TEST", "the subject", "the body", 2, x_exit) != 75)
+    wrong++;
+  // when busy, the mailer may not exit soon enough to tell why the pipe broke
+  int r = LMW_send_email_argv(&cfg, "TEST", "the subject", big, 2, x_read);
+  if (r != 3 && r != LMW_ERROR_PIPE)
+    wrong++;
+  LMW_batch_msg msgs[BATCH];
+  for (int j = 0; j < BATCH; j++)
+    msgs[j] = (LMW_batch_msg) { .recipient = "TEST", .subject = "the subject", .body = big };
+  if (LMW_send_email_batch(&cfg, msgs, BATCH, 2, x_read) != BATCH)
+    wrong++;
+  for (int j = 0; j < BATCH; j++)
+    if (msgs[j].code != 3 && msgs[j].code != LMW_ERROR_PIPE)
+      wrong++;
+  return NULL;
+}
+
+int main(int argc , char *argv[])
+{
+  int r, ret=0;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  LMW_config_init(&cfg);
+  cfg.mailer = "./lmw_fakemail";
+  cfg.log_error = NULL;
+  cfg.stats = LMW_stats_new();
+  big = malloc(1 << 20);
+  memset(big, 'x', (1 << 20) - 1);
+  big[(1 << 20) - 1] = 0;
+  signal(SIGPIPE, on_sigpipe);
+
+  fprintf(stdout,"========== test  one thread, to count its failures\n");
+  sender(NULL);
+  int each = cfg.failures;
+  r = wrong;
+  CHECK(r, 0);
+
+  fprintf(stdout,"========== test  %d threads sharing the config\n", THREADS);
+  cfg.failures = 0;
+  pthread_t th[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&th[i], NULL, sender, NULL);
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(th[i], NULL);
+  r = wrong;
+  CHECK(r, 0);
+  r = cfg.failures;
+  CHECK(r, THREADS * each);
+  LMW_stats_snapshot snap;
+  LMW_stats_get(cfg.stats, &snap);
+  r = snap.phase[LMW_PHASE_TOTAL].count;
+  CHECK(r, (THREADS + 1) * (3 + BATCH));
+
+  fprintf(stdout,"========== test  no SIGPIPE reached the process\n");
+  r = sigpipes;
+  CHECK(r, 0);
+  r = signal(SIGPIPE, SIG_DFL) == on_sigpipe;
+  CHECK(r, 1);
+
+  LMW_stats_free(cfg.stats);
+  free(big);
+  return ret;
+}
@@ -0,0 +1,121 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for the SMTP backend
+
+   will start ./lmw_smtp_stub , send some emails to it, and check
+   the exit status, the dot-stuffing and the reuse of the connection
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_smtp.h"
+
+int main(int argc , char *argv[])
+{
+  char *port = (argc > 1) ? argv[1] : "2525";
+  char *output = "/tmp/lmw_smtp_test.mbox";
+  char relay[64];
+  int r, ret=0;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.smtp_relay, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  unlink(output);
+  pid_t stub = fork();
+  if (stub == 0) {
+    execl("./lmw_smtp_stub", "lmw_smtp_stub", port, output, (char *) NULL);
+    _exit(127);
+  }
+  usleep(200000);
+
+  LMW_config cfg;
+  LMW_config_init(&cfg);
+  snprintf(relay, sizeof(relay), "localhost:%s", port);
+  cfg.backend = LMW_backend_smtp;
+  cfg.smtp_relay = relay;
+  cfg.smtp_from = "sender@example.com";
+
+  fprintf(stdout,"========== test  two emails, on one connection\n");
+  r = LMW_send_email(&cfg, "user@example.com", "first", "hello\n.hidden dot\n..two dots\nend");
+  CHECK(r, LMW_OK);
+  r = LMW_send_email(&cfg, "user@example.com, other@example.com", "second", "second body\r\n");
+  CHECK(r, LMW_OK);
+
+  fprintf(stdout,"========== test  refused recipient\n");
+  LMW_result res;
+  r = LMW_send_email_argv_result(&cfg, "reject@example.com", "third", "body", 0, NULL, &res);
+  CHECK(r, 550);
+  LMW_result_free(&res);
+
+  fprintf(stdout,"========== test  extra arguments\n");
+  char *mail_argv[] = { "-A", "file", NULL };
+  r = LMW_send_email_argv(&cfg, "user@example.com", "fourth", "body", 2, mail_argv);
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+
+  fprintf(stdout,"========== test  after the refusal, the connection is reused\n");
+  r = LMW_send_email(&cfg, "user@example.com", "fifth", "body");
+  CHECK(r, LMW_OK);
+
+  fprintf(stdout,"========== test  one recipient of two refused, nothing is delivered\n");
+  r = LMW_send_email(&cfg, "good@example.com, reject@example.com", "partial", "body");
+  CHECK(r, 550);
+
+  LMW_smtp_close_all();
+  kill(stub, SIGTERM);
+  waitpid(stub, NULL, 0);
+
+  fprintf(stdout,"========== test  relay is down\n");
+  r = LMW_send_email(&cfg, "user@example.com", "sixth", "body");
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+
+  // check what the stub received
+  char buf[4096] = "";
+  FILE *f = fopen(output, "r");
+  if (f) {
+    buf[fread(buf, 1, sizeof(buf) - 1, f)] = 0;
+    fclose(f);
+  }
+  fprintf(stdout,"========== received\n%s\n", buf);
+  r = (strstr(buf, "\n.hidden dot\n..two dots\nend\n") &&
+       !strstr(buf, "From stub connection 2")) ? LMW_OK : 1;
+  CHECK(r, LMW_OK);
+  // first, second and fifth
+  int delivered = 0;
+  for (char *p = buf; (p = strstr(p, "From stub connection")); p++)
+    delivered++;
+  r = delivered == 3 && !strstr(buf, "partial") ? LMW_OK : 1;
+  CHECK(r, LMW_OK);
+
+  unlink(output);
+  return ret;
+}
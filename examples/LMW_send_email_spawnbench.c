@@ -0,0 +1,105 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   benchmark for the ways of starting the mailer
+
+   for each size of resident memory of the caller, it will send
+   many short emails with each LMW_SPAWN_* method, and print the average
+   time of each call to LMW_send_email() , and the percentiles of the
+   time spent starting the mailer
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "LMW_send_email.h"
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc , char *argv[])
+{
+  if(argc>1 && (0==strcmp(argv[1],"-h"))) {
+    fprintf(stderr,"Usage:  %s [MAILER] [RSS_MB ...]\n"
+	    "  MAILER defaults to /bin/true , RSS_MB to  0 64 256 1024\n"
+	    ,argv[0]);
+    return(0);
+  }
+
+  static const char *names[] = { "fork", "posix_spawn", "vfork" };
+  const int N = 200;
+  int default_sizes[] = { 0, 64, 256, 1024 };
+  int nsizes = 4, *sizes = default_sizes;
+  if (argc > 2) {
+    nsizes = argc - 2;
+    sizes = calloc(nsizes, sizeof(int));
+    for (int i = 0; i < nsizes; i++)
+      sizes[i] = atoi(argv[i+2]);
+  }
+
+  LMW_config cfg;
+  LMW_config_init(&cfg);
+  cfg.mailer = (argc > 1) ? argv[1] : "/bin/true";
+  // /bin/true does not read the body, do not log the broken pipes
+  cfg.log_error = NULL;
+
+  int ret = 0;
+  cfg.stats = LMW_stats_new();
+  fprintf(stdout, "%8s %12s %12s %12s %12s\n", "RSS_MB", "spawn", "us/email", "spawn_p50", "spawn_p99");
+  for (int s = 0; s < nsizes; s++) {
+    // grow the resident memory of this process, touching every page
+    size_t len = (size_t)sizes[s] << 20;
+    char *ballast = len ? malloc(len) : NULL;
+    if (len && !ballast) {
+      fprintf(stderr, "cannot allocate %d MB\n", sizes[s]);
+      return 1;
+    }
+    if (ballast)
+      memset(ballast, 1, len);
+
+    for (int m = LMW_SPAWN_FORK; m <= LMW_SPAWN_VFORK; m++) {
+      cfg.spawn = m;
+      LMW_stats_reset(cfg.stats);
+      double t = now_us();
+      for (int i = 0; i < N; i++)
+	if (LMW_send_email(&cfg, "TEST", "the subject", "the body") != LMW_OK)
+	  ret = 1;
+      t = now_us() - t;
+      LMW_stats_snapshot snap;
+      LMW_stats_get(cfg.stats, &snap);
+      fprintf(stdout, "%8d %12s %12.1f %12.1f %12.1f\n", sizes[s], names[m], t / N,
+	      snap.phase[LMW_PHASE_SPAWN].p50_ns / 1e3, snap.phase[LMW_PHASE_SPAWN].p99_ns / 1e3);
+    }
+    free(ballast);
+  }
+
+  if (sizes != default_sizes)
+    free(sizes);
+  LMW_stats_free(cfg.stats);
+  return ret;
+}
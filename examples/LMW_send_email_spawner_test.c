@@ -0,0 +1,129 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   tester program for the prefork spawner
+
+   it starts the helper, then grows, and sends emails from many threads
+   through the helper, using ./lmw_fakemail to inject faults
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "LMW_send_email.h"
+#include "LMW_send_email_spawner.h"
+
+#define THREADS 16
+#define EMAILS 20
+
+static LMW_config cfg;
+static char *body;
+
+static void *work(void *p)
+{
+  long bad = 0;
+  (void) p;
+  for (int j = 0; j < EMAILS; j++)
+    if (LMW_send_email(&cfg, "TEST", "the subject", body) != LMW_OK)
+      bad++;
+  return (void *) bad;
+}
+
+int main(int argc , char *argv[])
+{
+  int r, ret=0;
+  (void) argc;
+  (void) argv;
+
+#define CHECK(r,e) \
+  { fprintf(stdout,"for %s, return code  %d , %s  \n\n", \
+	    cfg.mailer, \
+	    r, \
+	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
+    ret = (r==e) ? ret : 1 ;  }
+
+  LMW_config_init(&cfg);
+  cfg.mailer = "./lmw_fakemail";
+  r = LMW_spawner_start(&cfg);
+  CHECK(r, 0);
+
+  // from now on, this process is big
+  size_t len = 256 << 20;
+  char *ballast = malloc(len);
+  memset(ballast, 1, len);
+  body = malloc(1 << 20);
+  memset(body, 'a', (1 << 20) - 1);
+  body[(1 << 20) - 1] = 0;
+
+  fprintf(stdout,"========== test  exit codes and faults\n");
+  r = LMW_send_email(&cfg, "TEST", "the subject", body);
+  CHECK(r, LMW_OK);
+  char *fx[2] = { "-X", "exit=75" };
+  r = LMW_send_email_argv(&cfg, "TEST", "the subject", body, 2, fx);
+  CHECK(r, 75);
+  fx[1] = "signal=9";
+  r = LMW_send_email_argv(&cfg, "TEST", "the subject", body, 2, fx);
+  CHECK(r, LMW_ERROR_SIGNAL);
+  fx[1] = "read=10,linger=5000";
+  r = LMW_send_email_argv(&cfg, "TEST", "the subject", body, 2, fx);
+  CHECK(r, LMW_ERROR_PIPE);
+
+  fprintf(stdout,"========== test  output of the mailer, sent back by the helper\n");
+  LMW_result res;
+  fx[1] = "stdout=100,stderr=100000";
+  r = LMW_send_email_argv_result(&cfg, "TEST", "the subject", body, 2, fx, &res);
+  r = r == LMW_OK && res.out_len == 100 && res.err_len == cfg.capture_max && res.truncated &&
+    strlen(res.err) == res.err_len;
+  LMW_result_free(&res);
+  CHECK(r, 1);
+  cfg.mailer_cache = LMW_mailer_cache_new(&cfg);
+  r = LMW_send_email_argv_result(&cfg, "TEST", "the subject", body, 0, NULL, &res);
+  r = r == LMW_OK && res.out == NULL && res.err == NULL;
+  LMW_result_free(&res);
+  CHECK(r, 1);
+
+  fprintf(stdout,"========== test  %d threads, %d emails each\n", THREADS, EMAILS);
+  pthread_t t[THREADS];
+  for (int j = 0; j < THREADS; j++)
+    pthread_create(&t[j], NULL, work, NULL);
+  long bad = 0;
+  for (int j = 0; j < THREADS; j++) {
+    void *b;
+    pthread_join(t[j], &b);
+    bad += (long) b;
+  }
+  r = bad;
+  CHECK(r, 0);
+
+  fprintf(stdout,"========== test  after LMW_spawner_stop()\n");
+  LMW_spawner_stop();
+  r = LMW_send_email(&cfg, "TEST", "the subject", "body");
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+
+  LMW_mailer_cache_free(cfg.mailer_cache);
+  free(body);
+  free(ballast);
+  return ret;
+}
@@ -29,9 +29,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "LMW_send_email.h"
 
+/* whether `path` contains the body, with a final newline */
+static int same_content(char *path, char *body, size_t len)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char *c = malloc(len + 2);
+  size_t n = fread(c, 1, len + 2, f);
+  fclose(f);
+  int same = (n == len + (body[len-1] != '\n')) && memcmp(c, body, len) == 0;
+  free(c);
+  return same;
+}
+
+/* produces the body in small pieces, or fails half way */
+struct chunks {
+  char *b;
+  size_t left;
+  size_t fail_below;  // fails when less than this is left
+};
+
+static ssize_t next_chunk(void *ctx, char *buf, size_t n)
+{
+  struct chunks *c = ctx;
+  if (c->left < c->fail_below)
+    return -1;
+  if (n > 1000)
+    n = 1000;
+  if (n > c->left)
+    n = c->left;
+  memcpy(buf, c->b, n);
+  c->b += n;
+  c->left -= n;
+  return n;
+}
+
+/* a backend that only measures the body */
+static size_t gathered;
+static int measure_backend(LMW_config *c, char *recipient, char *subject, char *body, int ac, char *av[],
+			   LMW_result *res)
+{
+  (void) c; (void) recipient; (void) subject; (void) ac; (void) av; (void) res;
+  gathered = strlen(body);
+  return LMW_OK;
+}
+
 int main(int argc , char *argv[])
 {
   if(argc>1 && (0==strcmp(argv[1],"-h"))) {
@@ -69,6 +119,8 @@ int main(int argc , char *argv[])
 	    (r == e) ? "as expected": "AND THIS IS NOT correct"); \
     ret = (r==e) ? ret : 1 ;  }
   
+  cfg->stats = LMW_stats_new();
+
   fprintf(stdout,"========== test  /bin/false\n");
   cfg->mailer = "/bin/false";
   r =LMW_send_email(cfg, recipient, subject, b);
@@ -82,17 +134,416 @@ int main(int argc , char *argv[])
   
   fprintf(stdout,"========== test  ./sleep.sh (sleeps 10 seconds)\n");
   cfg->mailer = "./sleep.sh";
+ // it never reads the body, nor exits, within max_wait
   r =LMW_send_email(cfg, recipient, subject, b);
-  CHECK(r,LMW_ERROR_PIPE);
+  CHECK(r,LMW_ERROR_TIMEOUT);
   
   fprintf(stdout,"======= test  ./cat_dev_null.sh  (cat body to /dev/null, then sleeps 10 seconds)\n");
   cfg->mailer = "./cat_dev_null.sh";
   r =LMW_send_email(cfg, recipient, subject, b);
   CHECK(r,LMW_ERROR_TIMEOUT);
 
+  fprintf(stdout,"======= test  ./cat_dev_null.sh  , capturing stderr\n");
+  LMW_result res;
+  r =LMW_send_email_argv_result(cfg, recipient, subject, "short body", 0, NULL, &res);
+  CHECK(r,LMW_ERROR_TIMEOUT);
+  r = (res.err && strstr(res.err, "sleep")) ? LMW_OK : LMW_ERROR_CANNOT_CALL;
+  LMW_result_free(&res);
+  CHECK(r,LMW_OK);
+
+  fprintf(stdout,"======= test  statistics of the 5 emails above\n");
+  LMW_stats_print(cfg->stats, stdout);
+  LMW_stats_snapshot snap;
+  LMW_stats_get(cfg->stats, &snap);
+  r = snap.phase[LMW_PHASE_TOTAL].count;
+  CHECK(r, 5);
+  r = snap.phase[LMW_PHASE_TOTAL].max_ns >= (unsigned long long) cfg->max_wait * 1000000;
+  CHECK(r, 1);
+
+  fprintf(stdout,"======= test  batch of 20 emails to ./cat_dev_null.sh , 8 at once\n");
+  LMW_batch_msg msgs[20];
+  for (int j = 0; j < 20; j++)
+    msgs[j] = (LMW_batch_msg) { .recipient = recipient, .subject = subject, .body = b };
+  msgs[5].recipient = NULL;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  r = LMW_send_email_batch(cfg, msgs, 20, 0, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  CHECK(r, 20);
+  for (int j = 0; j < 20; j++)
+    if (msgs[j].code != (j == 5 ? LMW_ERROR_CANNOT_CALL : LMW_ERROR_TIMEOUT))
+      r = -1;
+  CHECK(r, 20);
+  // three rounds of max_wait , not twenty
+  r = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < 6 * cfg->max_wait;
+  CHECK(r, 1);
+
+  fprintf(stdout,"======= test  batch of 20 emails to /bin/false\n");
+  cfg->mailer = "/bin/false";
+  r = LMW_send_email_batch(cfg, msgs, 20, 0, NULL);
+  CHECK(r, 20);
+  r = (msgs[0].code == 1 && msgs[19].code == 1) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+
+  fprintf(stdout,"======= test  ./cat_to_file.sh , body from a file descriptor and from buffers\n");
+  cfg->mailer = "./cat_to_file.sh";
+  size_t bl = strlen(b);
+  char *copy = "/tmp/lmw_stresstest_copy", *orig = "/tmp/lmw_stresstest_body";
+  FILE *f = fopen(orig, "w");
+  fwrite("HEAD", 1, 4, f);
+  fwrite(b, 1, bl, f);
+  fclose(f);
+  int fd = open(orig, O_RDONLY);
+  r = LMW_send_email_fd(cfg, copy, subject, fd, 4, 0, 0, NULL);
+  close(fd);
+  CHECK(r, LMW_OK);
+  r = same_content(copy, b, bl);
+  CHECK(r, 1);
+  struct iovec iov[3] = { { b, bl / 2 }, { b, 0 }, { b + bl / 2, bl - bl / 2 } };
+  r = LMW_send_email_iov(cfg, copy, subject, iov, 3, 0, NULL);
+  CHECK(r, LMW_OK);
+  r = same_content(copy, b, bl);
+  CHECK(r, 1);
+
+  fprintf(stdout,"======= test  ./cat_to_file.sh , body from a callback\n");
+  struct chunks ch = { b, bl, 0 };
+  r = LMW_send_email_pull(cfg, copy, subject, next_chunk, &ch, 0, NULL);
+  CHECK(r, LMW_OK);
+  r = same_content(copy, b, bl);
+  CHECK(r, 1);
+  ch = (struct chunks) { b, bl, bl / 2 };
+  r = LMW_send_email_pull(cfg, copy, subject, next_chunk, &ch, 0, NULL);
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+
+  fprintf(stdout,"======= test  body from a file descriptor, to cfg->backend\n");
+  cfg->backend = measure_backend;
+  fd = open(orig, O_RDONLY);
+  r = LMW_send_email_fd(cfg, copy, subject, fd, 4, 0, 0, NULL);
+  close(fd);
+  CHECK(r, LMW_OK);
+  r = gathered == bl;
+  CHECK(r, 1);
+  // a body that cannot be read is not sent truncated
+  fd = open(orig, O_WRONLY);
+  r = LMW_send_email_fd(cfg, copy, subject, fd, 4, 0, 0, NULL);
+  close(fd);
+  CHECK(r, LMW_ERROR_CANNOT_CALL);
+  cfg->backend = NULL;
+  unlink(copy);
+  unlink(orig);
+
+  fprintf(stdout,"======= test  faults injected with ./lmw_fakemail\n");
+  cfg->mailer = "./lmw_fakemail";
+  r = LMW_send_email(cfg, recipient, subject, b);
+  CHECK(r, LMW_OK);
+  char *fx[2] = { "-X", "exit=75" };
+  r = LMW_send_email_argv(cfg, recipient, subject, b, 2, fx);
+  CHECK(r, 75);
+  fx[1] = "signal=9";
+  r = LMW_send_email_argv(cfg, recipient, subject, b, 2, fx);
+  CHECK(r, LMW_ERROR_SIGNAL);
+  fx[1] = "read=10,exit=3";      // exits before reading the body
+  r = LMW_send_email_argv(cfg, recipient, subject, b, 2, fx);
+  CHECK(r, 3);
+  fx[1] = "stall=5000";          // as ./sleep.sh
+  r = LMW_send_email_argv(cfg, recipient, subject, b, 2, fx);
+  CHECK(r, LMW_ERROR_TIMEOUT);
+  fx[1] = "read=10,linger=5000";  // exits after max_wait, but never reads the body
+  r = LMW_send_email_argv(cfg, recipient, subject, b, 2, fx);
+  CHECK(r, (bl > 70000 ? LMW_ERROR_PIPE : LMW_ERROR_TIMEOUT));
+  // the body fills the pipe, and the final newline must wait for room
+  char *full = malloc(65537);
+  memset(full, 'x', 65536);
+  full[65536] = 0;
+  fx[1] = "stall=100";
+  r = LMW_send_email_argv(cfg, recipient, subject, full, 2, fx);
+  free(full);
+  CHECK(r, LMW_OK);
+  // exits at once, but a process it started keeps the pipe open
+  char *big = malloc(4 << 20);
+  memset(big, 'x', 4 << 20);
+  big[(4 << 20) - 1] = 0;
+  fx[1] = "hold=3000,read=0,exit=3";
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  r = LMW_send_email_argv(cfg, recipient, subject, big, 2, fx);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  free(big);
+  CHECK(r, 3);
+  r = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < cfg->max_wait / 2;
+  CHECK(r, 1);
+  fx[1] = "stderr=100000";
+  r = LMW_send_email_argv_result(cfg, recipient, subject, b, 2, fx, &res);
+  CHECK(r, LMW_OK);
+  r = (res.truncated && res.err_len == cfg->capture_max) ? LMW_OK : -1;
+  LMW_result_free(&res);
+  CHECK(r, LMW_OK);
+  // a mailer that writes without end cannot fill the memory
+  fx[1] = "stdout=100000000";
+  r = LMW_send_email_argv_result(cfg, recipient, subject, "short body", 2, fx, &res);
+  CHECK(r, LMW_OK);
+  r = (res.truncated && res.out_len == cfg->capture_max && res.out[0] == 'x') ? LMW_OK : -1;
+  LMW_result_free(&res);
+  CHECK(r, LMW_OK);
+  // nor can the mailers of a batch, each with its own capture, that never fails their writes
+  {
+    LMW_batch_msg bm[3];
+    for (int j = 0; j < 3; j++)
+      bm[j] = (LMW_batch_msg) { .recipient = recipient, .subject = subject, .body = "short body" };
+    r = LMW_send_email_batch(cfg, bm, 3, 2, fx);
+    CHECK(r, 0);
+  }
+  fx[1] = "record=/tmp/lmw_stresstest_copy";
+  r = LMW_send_email_argv(cfg, recipient, subject, "recorded\n", 2, fx);
+  CHECK(r, LMW_OK);
+  char *recorded = "Subject: the subject\nTo: TEST\n\nrecorded\n\n";
+  r = same_content(copy, recorded, strlen(recorded));
+  CHECK(r, 1);
+  unlink(copy);
+
+  fprintf(stdout,"======= test  rate limits, 10 emails per second in all, 1 per second to each domain\n");
+  LMW_ratelimit_config rcfg;
+  LMW_ratelimit_config_init(&rcfg);
+  rcfg.rate = 10;
+  rcfg.burst = 5;
+  cfg->ratelimit = LMW_ratelimit_new(&rcfg);
+  int sent = 0;
+  for (int j = 0; j < 20; j++)
+    if ((r = LMW_send_email(cfg, recipient, subject, "short body")) == LMW_OK)
+      sent++;
+  CHECK(r, LMW_ERROR_RATE_LIMITED);
+  // a few more may be allowed, if the mailers are slow
+  r = (sent >= 5 && sent < 15) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  r = LMW_ratelimit_rejected(cfg->ratelimit) == (unsigned long long) (20 - sent) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  LMW_ratelimit_free(cfg->ratelimit);
+  LMW_ratelimit_config_init(&rcfg);
+  rcfg.domain_rate = 1;
+  rcfg.domain_burst = 2;
+  cfg->ratelimit = LMW_ratelimit_new(&rcfg);
+  LMW_send_email(cfg, "a@example.com", subject, "short body");
+  LMW_send_email(cfg, "b@EXAMPLE.com", subject, "short body");
+  r = LMW_send_email(cfg, "c@example.com", subject, "short body");
+  CHECK(r, LMW_ERROR_RATE_LIMITED);
+  r = LMW_send_email(cfg, "c@example.org", subject, "short body");
+  CHECK(r, LMW_OK);
+  for (int j = 0; j < 3; j++)
+    msgs[j] = (LMW_batch_msg) { .recipient = j ? "d@example.net, e@example.com" : "d@example.net", .subject = subject, .body = "short body" };
+  LMW_send_email_batch(cfg, msgs, 3, 0, NULL);
+  r = (msgs[0].code == LMW_OK && msgs[1].code == LMW_ERROR_RATE_LIMITED) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  // the refused emails give back what they took from example.net
+  LMW_ratelimit_free(cfg->ratelimit);
+  cfg->ratelimit = LMW_ratelimit_new(&rcfg);
+  LMW_send_email(cfg, "a@example.com", subject, "short body");
+  LMW_send_email(cfg, "b@example.com", subject, "short body");
+  for (int j = 0; j < 3; j++)
+    r = LMW_send_email(cfg, "d@example.net, e@example.com", subject, "short body");
+  CHECK(r, LMW_ERROR_RATE_LIMITED);
+  r = LMW_send_email(cfg, "d@example.net", subject, "short body") == LMW_OK &&
+    LMW_send_email(cfg, "d@example.net", subject, "short body") == LMW_OK;
+  CHECK(r, 1);
+  LMW_ratelimit_free(cfg->ratelimit);
+  rcfg.per_address = 1;
+  cfg->ratelimit = LMW_ratelimit_new(&rcfg);
+  LMW_send_email(cfg, "Ann <ann@example.com>", subject, "short body");
+  LMW_send_email(cfg, "Ann <ann@example.com>", subject, "short body");
+  r = LMW_send_email(cfg, "ANN@example.com", subject, "short body");
+  CHECK(r, LMW_ERROR_RATE_LIMITED);
+  r = LMW_send_email(cfg, "Ann <other@example.com>", subject, "short body");
+  CHECK(r, LMW_OK);
+  LMW_ratelimit_free(cfg->ratelimit);
+  cfg->ratelimit = NULL;
+
+  fprintf(stdout,"======= test  circuit breaker, open after 3 failures of /bin/false\n");
+  LMW_breaker_config bcfg;
+  LMW_breaker_config_init(&bcfg);
+  bcfg.threshold = 3;
+  bcfg.open = 300;
+  bcfg.probes = 2;
+  cfg->breaker = LMW_breaker_new(&bcfg);
+  cfg->mailer = "/bin/false";
+  for (int j = 0; j < 3; j++)
+    r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, 1);
+  int failures = cfg->failures;
+  r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, LMW_ERROR_CIRCUIT_OPEN);
+  r = (cfg->failures == failures && LMW_breaker_state(cfg->breaker) == LMW_CIRCUIT_OPEN) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  // after 300ms one probe is let through
+  usleep(350000);
+  cfg->mailer = "./lmw_fakemail";
+  r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, LMW_OK);
+  r = LMW_breaker_state(cfg->breaker);
+  CHECK(r, LMW_CIRCUIT_HALF_OPEN);
+  r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, LMW_OK);
+  r = LMW_breaker_state(cfg->breaker);
+  CHECK(r, LMW_CIRCUIT_CLOSED);
+  // unknown recipients and unreadable bodies are not failures of the mailer
+  char *nouser[2] = { "-X", "exit=67" };
+  for (int j = 0; j < 5; j++)
+    LMW_send_email_argv(cfg, recipient, subject, "short body", 2, nouser);
+  for (int j = 0; j < 5; j++) {
+    ch = (struct chunks) { b, bl, bl / 2 };
+    LMW_send_email_pull(cfg, recipient, subject, next_chunk, &ch, 0, NULL);
+  }
+  r = LMW_breaker_state(cfg->breaker);
+  CHECK(r, LMW_CIRCUIT_CLOSED);
+  // emails refused while the circuit is open do not take rate tokens
+  cfg->mailer = "/bin/false";
+  for (int j = 0; j < 3; j++)
+    LMW_send_email(cfg, recipient, subject, "short body");
+  LMW_ratelimit_config_init(&rcfg);
+  rcfg.rate = 1;
+  rcfg.burst = 2;
+  cfg->ratelimit = LMW_ratelimit_new(&rcfg);
+  for (int j = 0; j < 5; j++)
+    r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, LMW_ERROR_CIRCUIT_OPEN);
+  LMW_breaker_free(cfg->breaker);
+  cfg->breaker = NULL;
+  cfg->mailer = "./lmw_fakemail";
+  r = LMW_send_email(cfg, recipient, subject, "short body") == LMW_OK &&
+    LMW_send_email(cfg, recipient, subject, "short body") == LMW_OK;
+  CHECK(r, 1);
+  LMW_ratelimit_free(cfg->ratelimit);
+  cfg->ratelimit = NULL;
+
+  fprintf(stdout,"======= test  mailer cache, of a symlink that is switched to /bin/false\n");
+  char *link = "/tmp/lmw_stresstest_mailer", target[4096];
+  unlink(link);
+  if (!realpath("./lmw_fakemail", target) || symlink(target, link) == -1)
+    perror(link);
+  cfg->mailer = "/nonexistent";
+  cfg->mailer_cache = LMW_mailer_cache_new(cfg);
+  r = (cfg->mailer_cache == NULL && errno == ENOENT) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  cfg->mailer = link;
+  cfg->mailer_cache = LMW_mailer_cache_new(cfg);
+  r = cfg->mailer_cache != NULL;
+  CHECK(r, 1);
+  int spawns[3] = { LMW_SPAWN_FORK, LMW_SPAWN_POSIX_SPAWN, LMW_SPAWN_VFORK };
+  for (int j = 0; j < 3; j++) {
+    cfg->spawn = spawns[j];
+    r = LMW_send_email(cfg, recipient, subject, "short body");
+    CHECK(r, LMW_OK);
+  }
+  unlink(link);
+  if (symlink("/bin/false", link) == -1)
+    perror(link);
+  // noticed within a second
+  usleep(1100000);
+  r = LMW_send_email(cfg, recipient, subject, "short body");
+  CHECK(r, 1);
+  unlink(link);
+  LMW_mailer_cache_free(cfg->mailer_cache);
+  cfg->mailer_cache = NULL;
+  cfg->spawn = LMW_SPAWN;
+  // empty elements of PATH are the current directory, as for execvp()
+  char *saved_path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+  cfg->mailer = "lmw_fakemail";
+  char *paths[2] = { ":/nonexistent", "/nonexistent:" };
+  for (int j = 0; j < 2; j++) {
+    setenv("PATH", paths[j], 1);
+    cfg->mailer_cache = LMW_mailer_cache_new(cfg);
+    r = cfg->mailer_cache != NULL;
+    CHECK(r, 1);
+    LMW_mailer_cache_free(cfg->mailer_cache);
+  }
+  cfg->mailer_cache = NULL;
+  if (saved_path)
+    setenv("PATH", saved_path, 1);
+  free(saved_path);
+
+  fprintf(stdout,"======= test  invalid recipient and subject, and a subject in UTF-8\n");
+  cfg->mailer = "./lmw_fakemail";
+  r = LMW_send_email(cfg, recipient, "the subject\nBcc: someone@example.com", "short body");
+  CHECK(r, LMW_ERROR_INVALID);
+  r = LMW_send_email(cfg, "-oQ/tmp", subject, "short body");
+  CHECK(r, LMW_ERROR_INVALID);
+  msgs[0].subject = "bell\a";
+  r = LMW_send_email_batch(cfg, msgs, 2, 0, NULL);
+  r = (msgs[0].code == LMW_ERROR_INVALID && msgs[1].code == LMW_OK) ? LMW_OK : -1;
+  CHECK(r, LMW_OK);
+  char *record = "/tmp/lmw_stresstest_record", setting[64], buf[4096];
+  unlink(record);
+  snprintf(setting, sizeof(setting), "record=%s", record);
+  char *xargs[2] = { "-X", setting };
+  cfg->encode_subject = 1;
+  r = LMW_send_email_argv(cfg, recipient, "caff\xc3\xa8 al bar", "short body", 2, xargs);
+  CHECK(r, LMW_OK);
+  f = fopen(record, "r");
+  buf[f ? fread(buf, 1, sizeof(buf) - 1, f) : 0] = 0;
+  if (f)
+    fclose(f);
+  unlink(record);
+  r = strstr(buf, "Subject: =?UTF-8?Q?caff=C3=A8_al_bar?=\n") != NULL;
+  CHECK(r, 1);
+  cfg->encode_subject = 0;
+
+  fprintf(stdout,"======= test  adaptive timeout, of a mailer that becomes slow\n");
+  LMW_timeout_config tcfg;
+  LMW_timeout_config_init(&tcfg);
+  tcfg.min = 50;
+  tcfg.max = 3000;
+  tcfg.warmup = 3;
+  cfg->timeout = LMW_timeout_new(&tcfg);
+  LMW_timeout_estimate est;
+  r = LMW_timeout_get(cfg, 10, &est);
+  CHECK(r, 3000);
+  r = 0;
+  for (int j = 0; j < 5; j++)
+    r |= LMW_send_email(cfg, recipient, subject, "short body");
+  msgs[0].subject = subject;
+  r |= LMW_send_email_batch(cfg, msgs, 3, 0, NULL);
+  CHECK(r, LMW_OK);
+  r = LMW_timeout_get(cfg, 10, &est);
+  fprintf(stdout, "after %llu emails: mean %.1f ms, deviation %.1f ms, deadline %d ms\n",
+	  est.samples, est.mean_ms, est.dev_ms, est.deadline_ms);
+  r = est.samples == 8 && est.deadline_ms < 3000 && LMW_timeout_get(cfg, 1 << 20, NULL) == 3000;
+  CHECK(r, 1);
+  // a batch of larger bodies counts with their whole size, not with what is left to write
+  size_t ml = 100 << 10;
+  char *mid = malloc(ml + 1);
+  memset(mid, 'm', ml);
+  mid[ml] = 0;
+  LMW_batch_msg mm[3];
+  for (int j = 0; j < 3; j++)
+    mm[j] = (LMW_batch_msg) { .recipient = recipient, .subject = subject, .body = mid };
+  r = LMW_send_email_batch(cfg, mm, 3, 0, NULL);
+  LMW_timeout_estimate big_est;
+  LMW_timeout_get(cfg, ml, &big_est);
+  LMW_timeout_get(cfg, 10, &est);
+  r = r == 0 && big_est.samples == 3 && est.samples == 8;
+  CHECK(r, 1);
+  free(mid);
+  // with the fixed max_wait it would be sent
+  char *stall[2] = { "-X", "stall=400" };
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  r = LMW_send_email_argv(cfg, recipient, subject, "short body", 2, stall);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  CHECK(r, LMW_ERROR_TIMEOUT);
+  r = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < 400;
+  CHECK(r, 1);
+  // the deadline grows, until it is sent
+  int tries = 1;
+  while (LMW_send_email_argv(cfg, recipient, subject, "short body", 2, stall) != LMW_OK && tries < 30)
+    tries++;
+  LMW_timeout_get(cfg, 10, &est);
+  fprintf(stdout, "sent after %d tries: mean %.1f ms, deviation %.1f ms, deadline %d ms\n",
+	  tries, est.mean_ms, est.dev_ms, est.deadline_ms);
+  r = tries < 30 && est.deadline_ms > 400;
+  CHECK(r, 1);
+  LMW_timeout_free(cfg->timeout);
+  cfg->timeout = NULL;
+
   if(argc<=1)
     free(b);
   
+  LMW_stats_free(cfg->stats);
   free(cfg);
   
   return ret;
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# called as  mailer -s subject recipient : the body is saved in the file "recipient"
+
+cat > "$3"
@@ -0,0 +1,190 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   a fast, configurable stand-in for /bin/mail, for benchmarks and fault injection
+
+   called as   lmw_fakemail -s subject [args] recipient
+   by default it reads the body from stdin until EOF, and exits with 0;
+   its behaviour is changed by a comma separated list of settings, in the
+   environment variable LMW_FAKEMAIL and in extra arguments  -X settings :
+
+     stall=MS      sleep MS milliseconds before reading the body
+     hold=MS       first start a process that keeps stdin open for MS milliseconds,
+                   as a mailer that leaves a helper behind
+     rate=BYTES    read at most BYTES bytes per second
+     read=N        stop reading after N bytes (and exit, closing the pipe)
+     linger=MS     sleep MS milliseconds after reading the body
+     stdout=N      write N bytes to stdout (exit with 74 if a write fails)
+     stderr=N      write N bytes to stderr (likewise)
+     record=FILE   append subject, recipient and body to FILE
+     signal=SIG    at the end, kill itself with signal SIG
+     ignore=SIG    ignore signal SIG , as a mailer that does not die at SIGTERM
+     exit=CODE     at the end, exit with CODE
+
+   e.g.  LMW_FAKEMAIL=stall=2000   or   LMW_FAKEMAIL=read=10,exit=75
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+static struct {
+  long stall, hold, rate, read, linger, out, err, sig, ignore, code;
+  char *record;
+} opt = { .read = -1 };
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+  while (nanosleep(&ts, &ts) == -1)
+    ;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void parse(char *settings)
+{
+  char *save = NULL;
+  for (char *t = strtok_r(settings, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+    char *v = strchr(t, '=');
+    if (!v) {
+      fprintf(stderr, "lmw_fakemail: bad setting %s\n", t);
+      exit(64);
+    }
+    *v++ = 0;
+    long n = atol(v);
+    if (!strcmp(t, "stall")) opt.stall = n;
+    else if (!strcmp(t, "hold")) opt.hold = n;
+    else if (!strcmp(t, "rate")) opt.rate = n;
+    else if (!strcmp(t, "read")) opt.read = n;
+    else if (!strcmp(t, "linger")) opt.linger = n;
+    else if (!strcmp(t, "stdout")) opt.out = n;
+    else if (!strcmp(t, "stderr")) opt.err = n;
+    else if (!strcmp(t, "signal")) opt.sig = n;
+    else if (!strcmp(t, "ignore")) opt.ignore = n;
+    else if (!strcmp(t, "exit")) opt.code = n;
+    else if (!strcmp(t, "record")) opt.record = v;
+    else {
+      fprintf(stderr, "lmw_fakemail: unknown setting %s\n", t);
+      exit(64);
+    }
+  }
+}
+
+static void fill(int fd, long n)
+{
+  char buf[4096];
+  memset(buf, 'x', sizeof(buf));
+  while (n > 0) {
+    ssize_t r = write(fd, buf, n < (long) sizeof(buf) ? (size_t) n : sizeof(buf));
+    if (r <= 0)
+      exit(74);   // EX_IOERR, as a mailer that checks its writes
+    n -= r;
+  }
+}
+
+int main(int argc , char *argv[])
+{
+  static char buf[1 << 16];
+  char *subject = "", *recipient = argc > 1 ? argv[argc - 1] : "";
+  char *env = getenv("LMW_FAKEMAIL");
+  if (env)
+    parse(strdup(env));
+  for (int j = 1; j < argc - 1; j++) {
+    if (!strcmp(argv[j], "-s"))
+      subject = argv[++j];
+    else if (!strcmp(argv[j], "-X") && j + 1 < argc - 1)
+      parse(argv[++j]);
+  }
+
+  if (opt.ignore)
+    signal(opt.ignore, SIG_IGN);
+
+  int rec = -1;
+  if (opt.record) {
+    rec = open(opt.record, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (rec == -1) {
+      perror(opt.record);
+      return 73;
+    }
+    // the messages of concurrent mailers must not mix
+    flock(rec, LOCK_EX);
+    dprintf(rec, "Subject: %s\nTo: %s\n\n", subject, recipient);
+  }
+
+  if (opt.hold && fork() == 0) {
+    sleep_ms(opt.hold);
+    _exit(0);
+  }
+  if (opt.stall)
+    sleep_ms(opt.stall);
+
+  double start = now_s();
+  long total = 0;
+  while (opt.read < 0 || total < opt.read) {
+    size_t n = sizeof(buf);
+    if (opt.read >= 0 && (long) n > opt.read - total)
+      n = opt.read - total;
+    if (opt.rate > 0 && (long) n > opt.rate / 100 + 1)
+      n = opt.rate / 100 + 1;   // about 100 reads per second
+    ssize_t r = read(STDIN_FILENO, buf, n);
+    if (r == 0)
+      break;
+    if (r < 0)
+      return 74;
+    total += r;
+    if (rec >= 0 && write(rec, buf, r) != r)
+      return 74;
+    if (opt.rate > 0) {
+      double ahead = total / (double) opt.rate - (now_s() - start);
+      if (ahead > 0)
+	sleep_ms((long) (ahead * 1000));
+    }
+  }
+  if (opt.read >= 0)
+    close(STDIN_FILENO);
+  if (rec >= 0) {
+    if (write(rec, "\n", 1) != 1)
+      return 74;
+    close(rec);
+  }
+
+  fill(STDOUT_FILENO, opt.out);
+  fill(STDERR_FILENO, opt.err);
+  if (opt.linger)
+    sleep_ms(opt.linger);
+  if (opt.sig) {
+    signal(opt.sig, SIG_DFL);
+    kill(getpid(), opt.sig);
+  }
+  return opt.code;
+}
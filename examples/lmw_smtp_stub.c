@@ -0,0 +1,145 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   a stub SMTP server, to test the SMTP backend
+
+   it accepts connections on localhost:PORT , announces PIPELINING,
+   refuses recipients that start with "reject", and appends the messages
+   (with dot-stuffing removed) to OUTPUT, each preceded by a line
+   "From stub connection N"
+
+  Copyright (c) by Andrea C G Mennucci
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static void reply(FILE *f, const char *r)
+{
+  fputs(r, f);
+  fflush(f);
+}
+
+static void serve(int fd, int conn, const char *output)
+{
+  FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+  char line[4096];
+  int rcpts = 0;
+  reply(out, "220 lmw_smtp_stub ready\r\n");
+  while (fgets(line, sizeof(line), in)) {
+    if (strncasecmp(line, "EHLO", 4) == 0)
+      reply(out, "250-lmw_smtp_stub\r\n250-PIPELINING\r\n250 8BITMIME\r\n");
+    else if (strncasecmp(line, "HELO", 4) == 0)
+      reply(out, "250 lmw_smtp_stub\r\n");
+    else if (strncasecmp(line, "MAIL FROM:", 10) == 0) {
+      rcpts = 0;
+      reply(out, "250 ok\r\n");
+    } else if (strncasecmp(line, "RCPT TO:<reject", 15) == 0)
+      reply(out, "550 no such user\r\n");
+    else if (strncasecmp(line, "RCPT TO:", 8) == 0) {
+      rcpts++;
+      reply(out, "250 ok\r\n");
+    } else if (strncasecmp(line, "DATA", 4) == 0) {
+      if (!rcpts) {
+	reply(out, "554 no valid recipients\r\n");
+	continue;
+      }
+      reply(out, "354 go ahead\r\n");
+      // as a real relay, the message is delivered only when it ends with a dot
+      char *msg = NULL;
+      size_t msg_len = 0;
+      FILE *m = open_memstream(&msg, &msg_len);
+      int ended = 0;
+      while (fgets(line, sizeof(line), in)) {
+	if (strcmp(line, ".\r\n") == 0) {
+	  ended = 1;
+	  break;
+	}
+	char *l = line;
+	if (*l == '.') l++;
+	size_t n = strlen(l);
+	if (n >= 2 && l[n-2] == '\r') {
+	  l[n-2] = '\n';
+	  l[n-1] = 0;
+	}
+	fputs(l, m);
+      }
+      fclose(m);
+      FILE *o = (ended && output) ? fopen(output, "a") : NULL;
+      if (o) {
+	fprintf(o, "From stub connection %d\n", conn);
+	fwrite(msg, 1, msg_len, o);
+	fclose(o);
+      }
+      free(msg);
+      if (!ended)
+	break;
+      reply(out, "250 queued\r\n");
+    } else if (strncasecmp(line, "RSET", 4) == 0 || strncasecmp(line, "NOOP", 4) == 0)
+      reply(out, "250 ok\r\n");
+    else if (strncasecmp(line, "QUIT", 4) == 0) {
+      reply(out, "221 bye\r\n");
+      break;
+    } else
+      reply(out, "500 unknown command\r\n");
+  }
+  fclose(in);
+  fclose(out);
+}
+
+int main(int argc , char *argv[])
+{
+  if(argc<2 || (0==strcmp(argv[1],"-h"))) {
+    fprintf(stderr,"Usage:  %s PORT [OUTPUT]\n",argv[0]);
+    return(0);
+  }
+  const char *output = (argc > 2) ? argv[2] : NULL;
+
+  int s = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(atoi(argv[1])) };
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(s, (struct sockaddr *) &sa, sizeof(sa)) == -1 || listen(s, 512) == -1) {
+    perror("bind");
+    return 1;
+  }
+  signal(SIGCHLD, SIG_IGN);
+  for (int conn = 1; ; conn++) {
+    int fd = accept(s, NULL, NULL);
+    if (fd == -1)
+      continue;
+    // replies are small, do not wait for the ack of the previous one
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fork() == 0) {
+      close(s);
+      serve(fd, conn, output);
+      _exit(0);
+    }
+    close(fd);
+  }
+}